@@ -0,0 +1,32 @@
+#pragma once
+
+#include "common.hpp"
+#include "runtime.hpp"
+
+// Ahead-of-time compilation to C++ (--emit-cpp=<file>). The module's bytecode is
+// embedded in the generated file, and every function also becomes a C++ function
+// that runs its frame natively: local, constant and integer ops are inlined on
+// the thread's stack, jumps become gotos, and everything else goes through the
+// same per-opcode runtime helpers as the JIT tiers.
+//
+// Green threads keep their semantics through continuation points. An instruction
+// that may block, call, return or switch threads leaves the C++ function with the
+// frame's ip saved, exactly like the interpreter would; when the scheduler runs
+// the thread again, VM::run re-enters the function, whose `switch (ip)` jumps to
+// the label of the instruction to resume at.
+//
+// The generated file links against the runtime, i.e. every object except main.o
+// (see `make aot`).
+namespace aot {
+    // aot::Entry (declared in runtime.hpp) runs the current frame of
+    // vm->current_thread from its ip until it leaves the frame or yields. It returns
+    // false, running nothing, if ip is not one of its resume points.
+
+    // Writes a C++ translation unit with a main() that runs the module
+    void emit_cpp(std::ostream &out, const Function::Ptr &main_func, uint64_t source_hash);
+
+    // Called by the generated main(): loads the embedded module, attaches the
+    // compiled functions (in the order emit_cpp numbered them) and runs it
+    int run_module(const uint8_t *module, size_t size, uint64_t source_hash,
+                   const Entry *entries, size_t entry_count);
+}
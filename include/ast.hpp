@@ -92,6 +92,12 @@ StmtPtr make_stmt(Args &&...args) {
     return std::make_unique<Stmt>(T{std::forward<Args>(args)...});
 }
 
+// Declared types of a function's parameters (one per parameter) and result
+struct FunctionTypes {
+    std::vector<StaticType> params;
+    StaticType result = StaticType::Any;
+};
+
 // ==== Expression structs ====
 struct BinaryExpr {
     ExprPtr left, right;
@@ -174,6 +180,7 @@ struct TernaryExpr {
 struct LambdaExpr {
     std::vector<Token> params;
     std::shared_ptr<std::vector<StmtPtr>> body;
+    FunctionTypes types;
 };
 
 struct SelfExpr {
@@ -197,6 +204,7 @@ struct DispStmt {
 struct LetStmt {
     Token name;
     ExprPtr initializer;
+    StaticType type = StaticType::Any;
 };
 
 struct BlockStmt {
@@ -223,6 +231,7 @@ struct FunctionStmt {
     Token name;
     std::vector<Token> params;
     std::shared_ptr<std::vector<StmtPtr>> body;
+    FunctionTypes types;
 };
 
 struct ReturnStmt {
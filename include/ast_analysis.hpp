@@ -0,0 +1,76 @@
+#pragma once
+
+#include "common.hpp"
+#include "ast.hpp"
+
+// Collects the names of all variables that are written to (`=`, compound
+// assignment, `++`/`--`) inside a piece of AST, including nested function bodies.
+// Shadowing is ignored, so the result is a conservative over-approximation.
+struct MutationScanner {
+    std::unordered_set<std::string> names;
+    std::vector<std::string> self_fields; // fields written through `self`, in order of appearance
+
+    void scan(const Expr &expr);
+    void scan(const Stmt &stmt);
+    void scan(const std::vector<StmtPtr> &stmts);
+
+    inline bool mutates(const std::string &name) const { return names.count(name) != 0; }
+
+private:
+    void scan_target(const Expr &target);
+    void add_self_field(const Expr &target, const std::string &field);
+};
+
+// Static typing rules of the binary operators (compound assignments use the rule
+// of their operator), mirroring Value's operators: the type both operands are
+// brought to so a typed opcode can run it (Any: dispatch at runtime), and the
+// type of the result
+StaticType operand_type(TokenType op, StaticType lhs, StaticType rhs);
+StaticType result_type(TokenType op, StaticType lhs, StaticType rhs);
+
+// Flow-sensitive type inference over one function body. The statements are
+// walked in order with the type each local currently holds; both sides of a
+// branch are joined and loops are iterated until their entry state is stable.
+// Locals written by a nested function (closure, inline lambda, spawn block) may
+// change at any call, so they are never typed.
+struct TypeInference {
+    // Type of the variable read (VariableExpr) or updated (AssignExpr, UnaryExpr,
+    // PostfixExpr) at each site, before the update. Sites not recorded are Any.
+    std::unordered_map<const void *, StaticType> site_types;
+
+    void analyze_script(const std::vector<StmtPtr> &statements);
+    void analyze_function(const std::vector<Token> &params, const FunctionTypes &types,
+                          const std::vector<StmtPtr> &body);
+
+    StaticType type_at(const void *site) const;
+
+private:
+    struct Variable {
+        StaticType declared;
+        bool pinned = false; // written by a nested function
+    };
+
+    using State = std::vector<StaticType>; // indexed like variables
+
+    std::vector<Variable> variables;
+    std::unordered_map<const void *, int> declarations; // declaring node -> variable
+    std::vector<std::vector<std::pair<std::string, int>>> scopes;
+    State state;
+    bool pinned_new = false;
+
+    void run(const std::function<void()> &walk);
+
+    int declare(const void *node, const std::string &name, StaticType declared = StaticType::Any);
+    int resolve(const std::string &name) const;
+    StaticType read(int var) const;
+    void write(int var, StaticType type);
+    void pin_writes(const MutationScanner &writes);
+    void restore(const State &saved);
+    void join(const State &other);
+    void loop(const std::function<void()> &condition, const std::function<void()> &body);
+
+    StaticType infer(const Expr &expr);
+    void infer(const Stmt &stmt);
+    void infer(const std::vector<StmtPtr> &stmts);
+    StaticType update(const void *site, const Expr &target);
+};
@@ -40,6 +40,7 @@ struct AstPrinter {
     std::string print_expr(const ExprStmt &stmt);
     std::string print_disp(const DispStmt &stmt);
     std::string print_let(const LetStmt &stmt);
+    std::string annotation(StaticType type); // ":type", or nothing when unannotated
     std::string print_function(const FunctionStmt &stmt);
     std::string print_block(const BlockStmt &stmt);
     std::string print_if(const IfStmt &stmt);
@@ -9,6 +9,7 @@ enum OpCode : uint8_t {
     OP_DEFINE_GLOBAL,
     OP_NULL, OP_TRUE, OP_FALSE,
     OP_CONST,          // operand: constant index
+    OP_CONST_LONG,     // operand: 24-bit constant index, for constants past the first 65536
     OP_ICONST8,        // operand: small signed 8-bit integer
     OP_ICONST16,       // operand: small signed 16-bit integer
     OP_LOAD_LOCAL,     // operand: variable name index
@@ -16,32 +17,45 @@ enum OpCode : uint8_t {
     OP_LOAD_UPVALUE,   // operand: upvalue index
     OP_STORE_UPVALUE,  // operand: upvalue index
     OP_CLOSE_UPVALUE,  // no operand
+    OP_LOAD_CAPTURE,   // operand: index of a by-value capture of the closure
+    OP_LOAD_ENCLOSING, // operands: frame depth, slot (inline functions only)
+    OP_STORE_ENCLOSING, // operands: frame depth, slot
     OP_LOAD_GLOBAL,    // operand: variable name index
     OP_STORE_GLOBAL,   // operand: variable name index
     OP_LOAD_INDEX,     // pops index + container, pushes value
     OP_STORE_INDEX,    // pops value + index + container
     OP_LOAD_FIELD,     // operand: field name index
     OP_STORE_FIELD,    // operand: field name index
+    OP_LOAD_SLOT,      // operands: field name index, slot in the struct layout (falls back on the name)
+    OP_STORE_SLOT,     // operands: field name index, slot
     OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_NOT, OP_NEG,
     OP_EQ, OP_NEQ, OP_LT, OP_LE, OP_GT, OP_GE,
     OP_BIT_OR, OP_BIT_AND, OP_BIT_NOT, OP_BIT_XOR, OP_SHIFT_LEFT, OP_SHIFT_RIGHT,
+    // operands known to be ints / floats at compile time, so no type dispatch
+    OP_ADD_INT, OP_SUB_INT, OP_MUL_INT, OP_MOD_INT, OP_LT_INT, OP_LE_INT, OP_GT_INT, OP_GE_INT,
+    OP_ADD_FLOAT, OP_SUB_FLOAT, OP_MUL_FLOAT, OP_DIV_FLOAT, OP_LT_FLOAT, OP_LE_FLOAT, OP_GT_FLOAT, OP_GE_FLOAT,
+    OP_CHECK_TYPE,     // operands: StaticType, local slot (0xFF: top of stack); ints widen to float
     OP_DUP,            // duplicate top of stack
     OP_DUP2,           // duplicate top 2 values
     OP_JUMP,           // unconditional jump, operand = jump offset
     OP_JUMP_IF_FALSE,  // pop top, if false jump
     OP_JUMP_IF_TRUE,   // pop top, if true jump
+    OP_FOR_PREP,       // operands: counter slot, comparison, exit offset
+    OP_FOR_LOOP,       // operands: counter slot, comparison, loop offset
     OP_CALL,           // operand = argument count
     OP_MAKE_ARRAY, OP_MAKE_OBJECT,
+    OP_MAKE_OBJECT_FROM_TEMPLATE, // operand: template constant (array of keys), values pushed in key order
     OP_POP,
     OP_PRINT,
     OP_RETURN,
-    OP_CLOSURE,        // operand: function index
+    OP_CLOSURE,        // operand: index into chunk.functions
     OP_STRUCT,         // operand: struct index
     OP_METHOD,         // operand: method name index
+    OP_FIELD,          // operand: field name index; appends a slot to the struct's layout
     OP_SPAWN,
-    OP_GET_ITER,
-    OP_ITER_NEXT,
-    OP_LOAD_ITER_INDEX,
+    OP_GET_ITER,       // turns the iterable on top into iteration state, pushes position 0
+    OP_ITER_NEXT,      // operands: iterator slot, exit offset; stores next element in slot + 2
+    OP_LOAD_ITER_INDEX, // operand: iterator slot; stores current index/key in slot + 3
     OP_SEND_PIPE,
     OP_RECV_PIPE,
     OP_CLOSE_PIPE,
@@ -49,12 +63,47 @@ enum OpCode : uint8_t {
     OP_SELECT_RECV,    // operand: jump offset and slot index
     OP_SELECT_SEND,    // operand: jump offset
     OP_SELECT_DEFAULT, // operand: jump offset
-    OP_SELECT_EXEC
+    OP_SELECT_EXEC,
+
+    OP_COUNT // number of opcodes, not an instruction
+};
+
+// Constant table shared by every chunk of a compiled module. A hash index keyed on
+// type and value makes add() O(1), and equal literals and names are stored once.
+// Names and object templates have 16-bit operands, so add() keeps them below
+// 65536. Literals take at most half of that range; past it add_literal() places
+// them above, where OP_CONST_LONG loads them.
+struct ConstantPool {
+    static constexpr uint32_t MAX_SIZE = 1 << 24;
+    static constexpr uint32_t NARROW_LITERALS = 1 << 15;
+
+    std::vector<Value> values;
+    std::unordered_map<std::string, uint32_t> index;
+    uint32_t narrow_size = 0;     // indices below 65536 handed out (the rest may be padding)
+    uint32_t narrow_literals = 0; // of those, the ones add_literal() took
+
+    using Ptr = std::shared_ptr<ConstantPool>;
+
+    uint16_t add(const Value &v);
+    uint32_t add_literal(const Value &v);
+
+    // Appends a value read back from a .dogc at the index it was written from
+    void restore(const Value &v);
+
+    inline size_t size() const { return values.size(); }
+    inline const Value& operator[](size_t i) const { return values[i]; }
+
+    // The value OP_CONST pushes: folded array and object literals are mutable,
+    // so each load gets its own copy and the pooled one never escapes
+    Value load(size_t i) const;
+
+    static std::string key_of(const Value &v);
 };
 
 struct Chunk {
     std::vector<uint8_t> code;
-    std::vector<Value> constants;
+    ConstantPool::Ptr constants = std::make_shared<ConstantPool>();
+    std::vector<Value> functions; // nested function prototypes, indexed by OP_CLOSURE
 
     inline void write_u8(uint8_t v) {
         code.push_back(v);
@@ -65,7 +114,15 @@ struct Chunk {
         code.push_back(v & 0xFF);
     }
 
-    uint16_t add_constant(const Value &v);
+    inline uint16_t add_constant(const Value &v) { return constants->add(v); }
+    inline uint32_t add_literal(const Value &v) { return constants->add_literal(v); }
+    uint16_t add_function(const Value &func);
 };
 
 std::string opcode_to_string(OpCode op);
+
+// Size in bytes of the instruction at `offset`, opcode and operands included
+size_t instruction_length(const Chunk &chunk, size_t offset);
+
+// Bytecode offset a branching instruction may jump to, or -1 if it has no static target
+int branch_target(const Chunk &chunk, size_t offset);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "common.hpp"
+#include "runtime.hpp"
+
+// Compiled modules are cached next to their source (`main.dog` -> `main.dogc`).
+//
+// Layout (host byte order):
+//   header    : magic "DOGC", u32 version, u64 FNV-1a hash of the source
+//   constants : u32 count, then one tagged value each
+//   functions : the `$main` function, with nested prototypes written depth first
+//               (name, arity, upvalue count, code, nested functions)
+//
+// A cache whose magic, version or source hash does not match is ignored.
+namespace bytecode_cache {
+    constexpr uint32_t VERSION = 5;
+
+    uint64_t hash_source(const std::string &source);
+    std::string path_for(const std::string &source_path);
+
+    // Returns nullptr if the cache is missing, stale or malformed.
+    Function::Ptr load(const std::string &path, uint64_t source_hash);
+
+    // Returns false if the module could not be written (e.g. read-only directory).
+    bool store(const std::string &path, uint64_t source_hash, const Function::Ptr &main_func);
+
+    // The in-memory form behind load/store (also embedded by --emit-cpp).
+    // serialize compiles every lazy body first and throws if a constant cannot be written.
+    std::string serialize(uint64_t source_hash, const Function::Ptr &main_func);
+    Function::Ptr deserialize(const uint8_t *data, size_t size, uint64_t source_hash);
+}
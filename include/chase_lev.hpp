@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Chase-Lev work-stealing deque (Chase & Lev, "Dynamic Circular Work-Stealing
+// Deque", with the memory orderings of Lê et al.). Only the owning worker pushes
+// and pops at the bottom; any worker, the owner included, steals from the top.
+// The ring doubles when full. Outgrown rings are kept until the deque is
+// destroyed, since a thief may still be reading from one.
+template <typename T>
+class ChaseLevDeque {
+    struct Ring {
+        int64_t capacity; // power of two
+        std::unique_ptr<std::atomic<T>[]> slots;
+
+        explicit Ring(int64_t capacity) : capacity(capacity), slots(new std::atomic<T>[capacity]) {}
+
+        T get(int64_t i) const { return slots[i & (capacity - 1)].load(std::memory_order_relaxed); }
+        void put(int64_t i, T value) { slots[i & (capacity - 1)].store(value, std::memory_order_relaxed); }
+    };
+
+    std::atomic<int64_t> top { 0 };
+    std::atomic<int64_t> bottom { 0 };
+    std::atomic<Ring *> ring;
+    std::vector<std::unique_ptr<Ring>> rings; // owner only: the current ring and the outgrown ones
+
+    Ring *grow(Ring *old, int64_t t, int64_t b) {
+        rings.push_back(std::make_unique<Ring>(old->capacity * 2));
+        Ring *bigger = rings.back().get();
+        for (int64_t i = t; i < b; i++) bigger->put(i, old->get(i));
+        ring.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+public:
+    explicit ChaseLevDeque(int64_t capacity = 64) {
+        rings.push_back(std::make_unique<Ring>(capacity));
+        ring.store(rings.back().get(), std::memory_order_relaxed);
+    }
+
+    ChaseLevDeque(const ChaseLevDeque &) = delete;
+    ChaseLevDeque &operator=(const ChaseLevDeque &) = delete;
+
+    // Owner only
+    void push(T value) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Ring *r = ring.load(std::memory_order_relaxed);
+        if (b - t > r->capacity - 1) r = grow(r, t, b);
+
+        r->put(b, value);
+        bottom.store(b + 1, std::memory_order_release); // publishes the slot to thieves
+    }
+
+    // Owner only: takes the most recently pushed value
+    bool pop(T &out) {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Ring *r = ring.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b) { // empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        out = r->get(b);
+        if (t == b) { // the last value: race the thieves for it
+            bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+
+        return true;
+    }
+
+    // Any thread: takes the oldest value, retrying while other thieves win the race
+    bool steal(T &out) {
+        while (true) {
+            int64_t t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t b = bottom.load(std::memory_order_acquire);
+            if (t >= b) return false;
+
+            T value = ring.load(std::memory_order_acquire)->get(t);
+            if (top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                out = value;
+                return true;
+            }
+        }
+    }
+
+    // Racy unless the caller excludes concurrent pushes
+    bool empty() const {
+        return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire);
+    }
+};
@@ -6,11 +6,24 @@
 #include "value.hpp"
 #include "ast.hpp"
 #include "scope_manager.hpp"
+#include "ast_analysis.hpp"
 
 struct Codegen {
     std::shared_ptr<ScopeManager> scopes = nullptr;
     Function::Ptr curr;
     std::vector<Function::Ptr> function_stack;
+    ConstantPool::Ptr constants = std::make_shared<ConstantPool>();
+
+    // Declared types of globals, shared with the lazily compiled functions. Only
+    // used to check stores: any function may redefine a global, so reads are untyped.
+    using GlobalTypes = std::unordered_map<std::string, StaticType>;
+    std::shared_ptr<GlobalTypes> global_types = std::make_shared<GlobalTypes>();
+
+    // Also shared with the lazily compiled functions, so complete once the script ran
+    struct Stats {
+        size_t specialized_sites = 0; // arithmetic emitted as typed opcodes
+    };
+    std::shared_ptr<Stats> stats = std::make_shared<Stats>();
     
     Codegen() = default;
 
@@ -19,6 +32,13 @@ struct Codegen {
     void begin_function(const std::string &name, int arity = 0, bool is_method = false);
     Function::Ptr end_function(bool is_init = false);
 
+    bool can_compile_lazily() const;
+    Function::Ptr make_lazy_function(const std::string &name, const std::vector<Token> &params,
+                                     const std::shared_ptr<std::vector<StmtPtr>> &body, const FunctionTypes &types,
+                                     bool is_method = false, const std::vector<std::string> &self_fields = {});
+    void generate_function_body(const std::vector<Token> &params, const std::vector<StmtPtr> &body,
+                                const FunctionTypes &types);
+
     void generate(const Expr &expr);
     void generate(const Stmt &stmt);
 
@@ -35,13 +55,23 @@ struct Codegen {
     void mark_initialized();
     ScopeManager::ResolveResult resolve_variable(const Token &name);
 
+    StaticType static_type_of(const Expr &expr);
+    StaticType variable_type(const Token &name, const void *site);
+    StaticType declared_type(const Token &name);
+    void generate_typed(const Expr &expr, StaticType type);
+
     void emit_constant(const Value &v);
     void emit_iconst8(int8_t v);
     void emit_iconst16(int16_t v);
     void emit_return(bool is_init = false);
     void emit_load_var(const Token &name);
-    void emit_store_var(const Token &name);
+    void emit_store_var(const Token &name, StaticType value_type = StaticType::Any);
     void emit_compound_op(const Token &op);
+    void emit_type_check(StaticType type, uint8_t slot = 0xFF);
+    void emit_default_value(StaticType type);
+    StaticType emit_step(OpCode op, StaticType type);
+    void emit_arithmetic(OpCode op, StaticType operands);
+    int self_slot(const Expr &target, const std::string &field);
     void emit_closure(const Function::Ptr &func, const std::vector<ScopeManager::Upvalue> &upvalues);
     
     int emit_jump(OpCode op);
@@ -58,6 +88,8 @@ struct Codegen {
     void generate_block(const BlockStmt &stmt);
     void generate_if(const IfStmt &stmt);
     void generate_while(const WhileStmt &stmt);
+    bool generate_counted_loop(const BlockStmt &stmt);
+    bool is_loop_invariant(const Expr &expr, const MutationScanner &mutated, const std::string &counter);
     void generate_foreach(const ForEachStmt &stmt);
     void generate_function(const FunctionStmt &stmt);
     void generate_return(const ReturnStmt &stmt);
@@ -81,7 +113,7 @@ struct Codegen {
     void generate_index(const IndexExpr &expr);
     void generate_dot(const DotExpr &expr);
     void generate_ternary(const TernaryExpr &expr);
-    void generate_lambda(const LambdaExpr &expr);
+    void generate_lambda(const LambdaExpr &expr, bool is_inline = false);
     void generate_self(const SelfExpr &expr);
     void generate_spawn(const SpawnExpr &expr);
 
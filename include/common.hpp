@@ -7,6 +7,7 @@
 #include <string>
 #include <string_view>
 #include <array>
+#include <bitset>
 #include <vector>
 #include <queue>
 #include <deque>
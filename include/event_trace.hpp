@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+// Scheduler event tracer (see --trace). Events are fixed-size records in a
+// ring that keeps the most recent CAPACITY of them; writers claim a slot with
+// one fetch_add and publish it through the slot's sequence number, so no lock
+// is taken. While tracing is off, record() is a single relaxed load and branch.
+// After the run the ring is exported as Chrome trace-event JSON (chrome://tracing
+// or Perfetto), one track per worker.
+namespace event_trace {
+
+enum class Kind : uint8_t {
+    Spawn,  // `thread` was created by thread `arg` (-1 for the main thread)
+    Run,    // `thread` starts a slice
+    Stop,   // `thread`'s slice is over, `arg` is its GreenThread::State
+    Block,  // `thread` parked until woken
+    Wake,   // `thread` made ready
+    Send,   // `thread` sent to pipe `arg` (`thread` is -1 for an after() timer)
+    Recv,   // `thread` received from pipe `arg`
+    Select, // `thread` took the case at index `arg` (-1: default, -2: blocked)
+    Exit,   // `thread` finished (`arg` 0) or was killed (`arg` 1)
+};
+
+struct Record {
+    std::atomic<uint64_t> seq { 0 }; // index + 1 once written
+    uint64_t time_ns;
+    int64_t arg;
+    int32_t thread;
+    int16_t worker;
+    Kind kind;
+};
+
+constexpr size_t CAPACITY = 1 << 16; // power of two
+
+struct Buffer {
+    std::atomic<bool> enabled { false };
+    std::atomic<uint64_t> next { 0 };
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::array<Record, CAPACITY> records;
+};
+
+inline Buffer buffer;
+
+// The worker recording on this OS thread, -1 outside the workers
+inline thread_local int16_t worker = -1;
+
+inline void enable() {
+    buffer.epoch = std::chrono::steady_clock::now();
+    buffer.enabled.store(true, std::memory_order_relaxed);
+}
+
+inline bool enabled() { return buffer.enabled.load(std::memory_order_relaxed); }
+
+inline void record_slow(Kind kind, int64_t thread, int64_t arg) {
+    uint64_t index = buffer.next.fetch_add(1, std::memory_order_relaxed);
+    Record &rec = buffer.records[index & (CAPACITY - 1)];
+
+    rec.seq.store(0, std::memory_order_relaxed); // torn until republished
+    rec.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - buffer.epoch).count();
+    rec.arg = arg;
+    rec.thread = static_cast<int32_t>(thread);
+    rec.worker = worker;
+    rec.kind = kind;
+    rec.seq.store(index + 1, std::memory_order_release);
+}
+
+inline void record(Kind kind, int64_t thread, int64_t arg = 0) {
+    if (__builtin_expect(enabled(), 0)) record_slow(kind, thread, arg);
+}
+
+inline const char *kind_name(Kind kind) {
+    switch (kind) {
+        case Kind::Spawn:  return "spawn";
+        case Kind::Run:    return "run";
+        case Kind::Stop:   return "stop";
+        case Kind::Block:  return "block";
+        case Kind::Wake:   return "wake";
+        case Kind::Send:   return "send";
+        case Kind::Recv:   return "recv";
+        case Kind::Select: return "select";
+        case Kind::Exit:   return "exit";
+    }
+    return "?";
+}
+
+// Writes the recorded events, oldest first. Call once every worker has
+// stopped. Returns the number of events written, or -1 if `path` could not be
+// written.
+inline int64_t write_chrome_json(const std::string &path) {
+    std::ofstream out(path);
+    if (!out) return -1;
+
+    uint64_t end = buffer.next.load(std::memory_order_acquire);
+    uint64_t begin = end > CAPACITY ? end - CAPACITY : 0;
+
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"scheduler\"}}";
+
+    int16_t max_worker = -1;
+    int64_t written = 0;
+    for (uint64_t i = begin; i < end; i++) {
+        const Record &rec = buffer.records[i & (CAPACITY - 1)];
+        if (rec.seq.load(std::memory_order_acquire) != i + 1) continue; // overwritten while writing
+
+        max_worker = std::max(max_worker, rec.worker);
+        int tid = rec.worker + 1; // track 0 is outside the workers
+        double ts = rec.time_ns / 1000.0;
+
+        out << ",\n{\"pid\":1,\"tid\":" << tid << ",\"ts\":" << std::fixed << ts;
+        if (rec.kind == Kind::Run) {
+            out << ",\"ph\":\"B\",\"name\":\"thread " << rec.thread << "\"";
+        } else if (rec.kind == Kind::Stop) {
+            out << ",\"ph\":\"E\"";
+        } else {
+            out << ",\"ph\":\"i\",\"s\":\"t\",\"name\":\"" << kind_name(rec.kind) << "\"";
+        }
+        out << ",\"args\":{\"thread\":" << rec.thread << ",\"arg\":" << rec.arg << "}}";
+        written++;
+    }
+
+    for (int tid = 0; tid <= max_worker + 1; tid++) {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid << ",\"args\":{\"name\":\""
+            << (tid == 0 ? std::string("main") : "worker " + std::to_string(tid - 1)) << "\"}}";
+    }
+
+    out << "\n]}\n";
+    return out ? written : -1;
+}
+
+}
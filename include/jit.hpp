@@ -0,0 +1,78 @@
+#pragma once
+
+#include "common.hpp"
+#include "runtime.hpp"
+#include "x86_assembler.hpp"
+
+struct VM;
+
+// Baseline JIT: once a function gets hot, each of its instructions is stitched
+// into x86-64 code as a fixed template. Constants, locals, stack shuffles, int
+// arithmetic and compares, jumps and FOR_LOOP work on the Values in place behind
+// type-tag guards; everything else, and any guard that fails, calls the opcode's
+// runtime helper. Helpers run the interpreter's own implementation on the same
+// stack and frames, so native code and VM::run can hand over to each other at
+// any instruction. Branches with a static target become native jumps; calls,
+// returns, blocking operations and errors leave native code with the frame's ip
+// up to date.
+namespace jit {
+    enum class Mode { Off, Baseline, Stencil, Trace };
+
+    bool parse_mode(const std::string &name, Mode &mode);
+
+    // Whether the mode compiles whole functions once they are hot
+    inline bool compiles_functions(Mode mode) { return mode == Mode::Baseline || mode == Mode::Stencil; }
+
+    // Calls (or thread starts) before a function is compiled
+    constexpr int HOT_CALL_THRESHOLD = 16;
+
+    // Runs the instruction at `pc` (ending at `next`) for the current thread.
+    // Returns 0 to fall through, 2 if it branched within the frame, 1 to leave native code.
+    using Helper = int (*)(VM *vm, uint32_t pc, uint32_t next);
+
+    enum HelperResult { NEXT = 0, EXIT = 1, BRANCH = 2 };
+
+    // A Value is a std::any: a pointer naming the stored type, then storage that
+    // holds ints and bools inline. These are that pointer for int and for bool,
+    // probed once. Both are null where std::any is laid out differently, and
+    // then native code never touches a Value itself.
+    struct ValueTags {
+        const void *int_tag = nullptr;
+        const void *bool_tag = nullptr;
+    };
+
+    const ValueTags &value_tags();
+
+    // The thread state native code addresses directly. It stays put for one run
+    // of native code, since calls and returns leave it. src/stencils/stencils.cpp
+    // keeps a copy of this layout.
+    struct NativeFrame {
+        Value *stack;
+        size_t *stack_size;
+        size_t capacity;  // slots in the stack
+        Value *locals;    // stack + the frame's base
+        int *ip;          // the frame's ip, written when native code falls off the end
+        int64_t *budget;  // see GreenThread::tick
+        ValueTags tags;
+    };
+
+    struct NativeCode {
+        ExecutableMemory code;
+        std::vector<int32_t> entries; // native offset per bytecode offset, -1 inside operands
+
+        using Ptr = std::shared_ptr<NativeCode>;
+
+        NativeCode(const std::vector<uint8_t> &code, std::vector<int32_t> entries)
+            : code(code), entries(std::move(entries)) {}
+
+        NativeCode(size_t size, const std::function<void(uint8_t *memory)> &fill, std::vector<int32_t> entries)
+            : code(size, fill), entries(std::move(entries)) {}
+
+        // Runs from bytecode offset `ip` until an instruction leaves native code.
+        // Returns false (running nothing) if `ip` is not the start of an instruction.
+        bool enter(VM &vm, int ip) const;
+    };
+
+    // Returns nullptr if the function cannot be compiled on this platform.
+    NativeCode::Ptr compile(const Function &func, const Helper *helpers);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+// Bounded multi-producer multi-consumer queue (Vyukov, "Bounded MPMC queue").
+// Every cell carries a sequence number telling whose turn it is: a producer at
+// position `pos` may fill the cell once its sequence is `2 * pos`, a consumer
+// may empty it once it is `2 * pos + 1` (doubled, unlike Vyukov's, so that a
+// one-cell queue can tell a filled cell from the next lap's empty one).
+// Claiming a position is one CAS on the shared counter, so neither side ever
+// takes a lock. Positions are taken modulo the capacity rather than masked, so
+// a queue holds exactly `capacity` values; a capacity of 0 is always full and
+// always empty.
+template <typename T>
+class MpmcQueue {
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    size_t cap;
+    std::unique_ptr<Cell[]> cells;
+
+    alignas(64) std::atomic<size_t> enqueue_pos { 0 };
+    alignas(64) std::atomic<size_t> dequeue_pos { 0 };
+
+public:
+    explicit MpmcQueue(size_t capacity) : cap(capacity), cells(capacity ? new Cell[capacity] : nullptr) {
+        for (size_t i = 0; i < cap; i++) cells[i].seq.store(2 * i, std::memory_order_relaxed);
+    }
+
+    MpmcQueue(const MpmcQueue &) = delete;
+    MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+    size_t capacity() const { return cap; }
+
+    // `value` is moved from only when the push succeeds
+    bool try_push(T &value) {
+        if (cap == 0) return false;
+
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos % cap];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq - 2 * pos);
+
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.seq.store(2 * pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // The cell is reset so the queue does not keep the value alive
+    bool try_pop(T &out) {
+        if (cap == 0) return false;
+
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos % cap];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq - (2 * pos + 1));
+
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out = std::exchange(cell.value, T{});
+                    cell.seq.store(2 * (pos + cap), std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // empty
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Exact while nothing else is pushing or popping, a snapshot otherwise
+    size_t size() const {
+        size_t head = dequeue_pos.load(std::memory_order_acquire);
+        size_t tail = enqueue_pos.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+};
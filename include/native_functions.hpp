@@ -13,6 +13,8 @@ namespace native_functions {
     Value len(VM &, const std::vector<Value> &args) {
         if (args[0].is_array())
             return static_cast<int>(args[0].as_array()->size());
+        if (args[0].is_range())
+            return static_cast<int>(args[0].as_range()->size());
         if (args[0].is_object())
             return static_cast<int>(args[0].as_object()->size());
         if (args[0].is_string())
@@ -41,6 +43,7 @@ namespace native_functions {
         if (v.is_bool())     return "bool";
         if (v.is_string())   return "string";
         if (v.is_array())    return "array";
+        if (v.is_range())    return "range";
         if (v.is_object())   return "object";
         if (v.is_struct())   return "type";
         if (v.is_struct_instance()) return std::string(v.as_struct_instance()->struct_ptr->name);
@@ -179,17 +182,14 @@ namespace native_functions {
             if (step == 0) {
                 throw std::runtime_error("Step cannot be zero");
             }
-            
-            std::vector<Value> result;
-            if ((step > 0 && start >= end) || (step < 0 && start <= end)) {
-                return std::make_shared<Array>(result);
-            }
 
-            for (int i = start; (step > 0 ? i < end : i > end); i += step) {
-                result.push_back(i);
-            }
+            return std::make_shared<Range>(start, end, step);
+        }
 
-            return std::make_shared<Array>(result);
+        Value to_array(VM &, const std::vector<Value> &args) {
+            if (args[0].is_range()) return args[0].as_range()->to_array();
+            if (args[0].is_array()) return args[0];
+            throw std::runtime_error("Cannot convert " + args[0].type_name() + " to array");
         }
 
         Value push(VM &, const std::vector<Value> &args) {
@@ -245,6 +245,35 @@ namespace native_functions {
         }
     }
 
+    namespace range {
+        Value slice(VM &vm, const std::vector<Value> &args) {
+            auto range = args[0].as_range();
+            if (range->array) {
+                return array::slice(vm, { range->array, args[1], args[2] });
+            }
+
+            int start = args[1].as_int();
+            int end = args[2].as_int();
+
+            if (start < 0 || end > static_cast<int>(range->size()) || start > end) {
+                throw std::runtime_error("Invalid slice indices");
+            }
+
+            int first = range->at(start).as_int();
+            return std::make_shared<Range>(first, first + (end - start) * range->step, range->step);
+        }
+
+        Value sum(VM &vm, const std::vector<Value> &args) {
+            auto range = args[0].as_range();
+            if (range->array) {
+                return array::sum(vm, { range->array });
+            }
+
+            double n = static_cast<double>(range->size());
+            return n * range->start + range->step * n * (n - 1) / 2;
+        }
+    }
+
     Value sleep(VM &vm, const std::vector<Value> &args) {
         int ms = args[0].as_int();
         vm.scheduler.send_to_sleep(vm.current_thread, ms);
@@ -255,25 +284,56 @@ namespace native_functions {
         return static_cast<int>(vm.current_thread->ID);
     }
 
-    Value join(VM &vm, const std::vector<Value> &args) {
-        ThreadHandle handle = args[0].as_thread_handle();
-        size_t thread_id = handle.ID;
+    // Time-slice accounting of the calling thread
+    Value slice_stats(VM &vm, const std::vector<Value> &args) {
+        const auto &stats = vm.current_thread->slice_stats;
+        auto max_wait = std::chrono::duration_cast<std::chrono::microseconds>(stats.max_wait).count();
+
+        return std::make_shared<Object>(std::unordered_map<std::string, Value> {
+            { "slices",      static_cast<int>(stats.slices) },
+            { "preemptions", static_cast<int>(stats.preemptions) },
+            { "ticks",       static_cast<int>(stats.ticks) },
+            { "max_wait_us", static_cast<int>(max_wait) },
+        });
+    }
+
+    Value select_stats(VM &vm, const std::vector<Value> &args) {
+        const auto &stats = vm.current_thread->select_stats;
+
+        std::vector<Value> wins;
+        for (size_t count : stats.wins) wins.push_back(static_cast<int>(count));
+
+        return std::make_shared<Object>(std::unordered_map<std::string, Value> {
+            { "selects",  static_cast<int>(stats.selects) },
+            { "blocked",  static_cast<int>(stats.blocked) },
+            { "defaults", static_cast<int>(stats.defaults) },
+            { "wins",     std::make_shared<Array>(wins) },
+        });
+    }
 
-        auto thread = vm.scheduler.get_thread_by_id(thread_id);
+    Value join(VM &vm, const std::vector<Value> &args) {
+        size_t thread_id = args[0].as_thread_handle().ID;
+        return vm.scheduler.join_threads(vm.current_thread, { thread_id }, JoinWait::One).value_or(Value{});
+    }
 
-        // If the thread is already finished, return its return value immediately
-        if (!thread || thread->state == GreenThread::Finished) {
-            return vm.scheduler.get_return_value(thread_id);
+    Value wait_for(VM &vm, const Value &handles, JoinWait::Mode mode) {
+        std::vector<size_t> thread_ids;
+        for (const auto &handle : handles.as_array()->elements) {
+            thread_ids.push_back(handle.as_thread_handle().ID);
         }
 
-        // Map the current thread to the target thread for joining
-        vm.scheduler.join_map[vm.current_thread->ID] = thread_id;
+        return vm.scheduler.join_threads(vm.current_thread, thread_ids, mode).value_or(Value{});
+    }
 
-        // Block the current thread
-        vm.current_thread->state = GreenThread::Blocked;
-        vm.current_thread->wake_time = {};
+    // wait_all(handles): the results of all the threads, in order, once the
+    // last one has exited
+    Value wait_all(VM &vm, const std::vector<Value> &args) {
+        return wait_for(vm, args[0], JoinWait::All);
+    }
 
-        return {};
+    // wait_any(handles): [index, result] of the first of the threads to exit
+    Value wait_any(VM &vm, const std::vector<Value> &args) {
+        return wait_for(vm, args[0], JoinWait::Any);
     }
 
     // Value detach(VM &vm, const std::vector<Value> &args) {
@@ -309,13 +369,62 @@ namespace native_functions {
     //     return {};
     // }
 
+    // pipe(n) buffers up to n values (0: unbuffered), pipe(-1) any number
     Value pipe(VM &vm, const std::vector<Value> &args) {
-        int capacity = args[0].as_int();        
-        size_t pipe_id = vm.scheduler.next_pipe_id++;
+        int capacity = args[0].as_int();
+        if (capacity < -1) {
+            throw std::runtime_error("Pipe capacity must be -1 (unbounded) or at least 0");
+        }
+
+        auto pipe = vm.scheduler.create_pipe(capacity == -1 ? Pipe::UNBOUNDED : static_cast<size_t>(capacity));
+        return PipeHandle(pipe->ID, pipe);
+    }
+
+    // A pipe that receives the time (as clock() reads it) `ms` from now
+    Value after(VM &vm, const std::vector<Value> &args) {
+        auto pipe = vm.scheduler.after(args[0].as_int());
+        return PipeHandle(pipe->ID, pipe);
+    }
+
+    // p.recv(ms): receives like `<- p`, but gives null once `ms` have passed
+    Value recv(VM &vm, const std::vector<Value> &args) {
+        auto pipe = args[0].as_pipe_handle().pipe_ptr;
+        if (!pipe) {
+            throw std::runtime_error("Invalid pipe handle");
+        }
+
+        return vm.scheduler.receive_from_pipe(vm.current_thread, pipe, std::max(args[1].as_int(), 0));
+    }
+
+    // p.send_many(values): sends every value of the array in one operation,
+    // waiting while the pipe is full; returns how many were sent
+    Value send_many(VM &vm, const std::vector<Value> &args) {
+        auto pipe = args[0].as_pipe_handle().pipe_ptr;
+        if (!pipe) {
+            throw std::runtime_error("Invalid pipe handle");
+        }
+
+        return vm.scheduler.send_many_to_pipe(vm.current_thread, pipe, args[1].as_array()->elements);
+    }
+
+    // p.recv_many(n): up to n values as an array, waiting only while there are
+    // none; an empty array once the pipe is closed and drained
+    Value recv_many(VM &vm, const std::vector<Value> &args) {
+        auto pipe = args[0].as_pipe_handle().pipe_ptr;
+        if (!pipe) {
+            throw std::runtime_error("Invalid pipe handle");
+        }
 
-        auto pipe = std::make_shared<Pipe>(pipe_id, capacity);
-        vm.scheduler.pipes[pipe_id] = pipe;
+        return vm.scheduler.receive_many_from_pipe(vm.current_thread, pipe, std::max(args[1].as_int(), 0));
+    }
+
+    // p.drain(): every value that is ready, as an array, without waiting
+    Value drain(VM &vm, const std::vector<Value> &args) {
+        auto pipe = args[0].as_pipe_handle().pipe_ptr;
+        if (!pipe) {
+            throw std::runtime_error("Invalid pipe handle");
+        }
 
-        return PipeHandle(pipe_id, pipe);
+        return vm.scheduler.drain_pipe(vm.current_thread, pipe);
     }
 }
\ No newline at end of file
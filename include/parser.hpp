@@ -31,7 +31,8 @@ private:
     StmtPtr select_statement();
     StmtPtr expr_statement();
 
-    std::vector<Token> parameters();
+    std::vector<Token> parameters(FunctionTypes &types);
+    StaticType type_annotation();
     std::shared_ptr<std::vector<StmtPtr>> block_statements();
 
     ExprPtr expression();
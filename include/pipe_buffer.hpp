@@ -0,0 +1,102 @@
+#pragma once
+
+#include "mpmc_queue.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// FIFO storage of a pipe. A bounded buffer is an MpmcQueue, which any worker
+// may push to or pop from without a lock. An unbounded one is a linked list of
+// fixed-size chunks that callers serialize (under Scheduler::lock); a drained
+// chunk is kept as a spare for the tail, so a steady producer/consumer pair
+// stops allocating once it is warmed up.
+template <typename T>
+class PipeBuffer {
+public:
+    static constexpr size_t UNBOUNDED = SIZE_MAX;
+    static constexpr size_t CHUNK_SIZE = 64;
+
+    explicit PipeBuffer(size_t capacity) : cap(capacity), queue(capacity == UNBOUNDED ? 0 : capacity) {
+        if (!bounded()) head_chunk = tail_chunk = new Chunk();
+    }
+
+    PipeBuffer(const PipeBuffer &) = delete;
+    PipeBuffer &operator=(const PipeBuffer &) = delete;
+
+    ~PipeBuffer() {
+        while (head_chunk) {
+            Chunk *next = head_chunk->next;
+            delete head_chunk;
+            head_chunk = next;
+        }
+        delete spare;
+    }
+
+    size_t capacity() const { return cap; }
+    bool bounded() const { return cap != UNBOUNDED; }
+    bool lock_free() const { return bounded(); }
+
+    // Snapshots while other workers use a bounded buffer
+    size_t size() const { return bounded() ? queue.size() : count.load(std::memory_order_relaxed); }
+    bool empty() const { return size() == 0; }
+    bool full() const { return bounded() && size() >= cap; }
+
+    // `value` is moved from only when the push succeeds; an unbounded buffer
+    // always takes it
+    bool try_push(T &value) {
+        if (bounded()) return queue.try_push(value);
+
+        if (tail == CHUNK_SIZE) {
+            Chunk *chunk = spare ? spare : new Chunk();
+            spare = nullptr;
+            tail_chunk->next = chunk;
+            tail_chunk = chunk;
+            tail = 0;
+        }
+        tail_chunk->items[tail++] = std::move(value);
+        count.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // The slot is reset so the buffer does not keep the value alive
+    bool try_pop(T &out) {
+        if (bounded()) return queue.try_pop(out);
+        if (count.load(std::memory_order_relaxed) == 0) return false;
+
+        out = std::exchange(head_chunk->items[head++], T{});
+        count.fetch_sub(1, std::memory_order_relaxed);
+
+        if (head == CHUNK_SIZE) {
+            if (head_chunk == tail_chunk) {
+                tail = 0; // drained: reuse the chunk in place
+            } else {
+                Chunk *drained = head_chunk;
+                head_chunk = head_chunk->next;
+                drained->next = nullptr;
+                if (spare) delete spare;
+                spare = drained;
+            }
+            head = 0;
+        }
+        return true;
+    }
+
+private:
+    struct Chunk {
+        T items[CHUNK_SIZE];
+        Chunk *next = nullptr;
+    };
+
+    size_t cap;
+    MpmcQueue<T> queue; // bounded mode
+
+    // unbounded mode: offsets into the head and tail chunks
+    std::atomic<size_t> count { 0 };
+    size_t head = 0;
+    size_t tail = 0;
+    Chunk *head_chunk = nullptr;
+    Chunk *tail_chunk = nullptr;
+    Chunk *spare = nullptr;
+};
@@ -10,16 +10,43 @@ struct VM;
 // Function pointer type for native functions
 using NativeFn = std::function<Value(VM&, const std::vector<Value> &)>;
 
+namespace jit { struct NativeCode; struct Trace; }
+namespace aot { using Entry = bool (*)(VM *vm); }
+
 struct Function {
     std::string name;
     Chunk chunk;
     int arity;
     int upvalue_count = 0;
 
+    // Set while the body is still uncompiled; run on first call, then cleared
+    std::function<void(Function &)> compile_body;
+
+    int call_count = 0;
+    std::shared_ptr<jit::NativeCode> native_code; // set once the JIT has compiled it
+    std::unordered_map<int, std::shared_ptr<jit::Trace>> traces; // keyed by loop header offset
+    aot::Entry aot_code = nullptr; // set when running as an --emit-cpp executable
+
     using Ptr = std::shared_ptr<Function>;
 
     Function(const std::string &name, int arity) : name(name), arity(arity) {}
 
+    void ensure_compiled() {
+        if (!compile_body) return;
+        compile_body(*this);
+        compile_body = nullptr;
+    }
+
+    // Compiles this body and every nested one, called or not. Compiling adds to
+    // the shared constant pool, so this is for before the pool is read as a
+    // whole (writing a cache) or shared between workers.
+    void compile_all() {
+        ensure_compiled();
+        for (const auto &nested : chunk.functions) {
+            nested.as_function()->compile_all();
+        }
+    }
+
     std::string to_string() const { return "<fn " + name + "/" + std::to_string(arity) + ">"; }
 };
 
@@ -61,6 +88,7 @@ struct Upvalue {
 struct Closure {
     Function::Ptr func;
     std::vector<Upvalue::Ptr> upvalues;
+    std::vector<Value> captures; // copies of variables that are never reassigned
     int upvalue_count;
     Value recv_self; // for methods
 
@@ -100,6 +128,43 @@ struct Array {
     std::string to_string() const;
 };
 
+// Lazy arithmetic sequence returned by arange. Elements are computed on access, so a
+// range takes O(1) memory until something mutates it; from then on it forwards to a
+// materialized array, which every reference to the range shares.
+struct Range {
+    int start, stop, step;
+    Array::Ptr array; // set once the range has been materialized
+
+    using Ptr = std::shared_ptr<Range>;
+
+    Range(int start, int stop, int step) : start(start), stop(stop), step(step) {}
+
+    inline size_t size() const {
+        if (array) return array->size();
+        long long span = static_cast<long long>(stop) - start;
+        if (step > 0) return span > 0 ? static_cast<size_t>((span + step - 1) / step) : 0;
+        return span < 0 ? static_cast<size_t>((-span - step - 1) / -step) : 0;
+    }
+
+    inline bool empty() const { return size() == 0; }
+
+    inline Value at(size_t index) const {
+        if (array) return (*array)[index];
+        return static_cast<int>(start + static_cast<long long>(index) * step);
+    }
+
+    // Copies the elements into a fresh array, leaving the range untouched.
+    Array::Ptr to_array() const;
+
+    // Turns the range into its backing array; used before any mutation.
+    inline const Array::Ptr& materialize() {
+        if (!array.get()) array = to_array();
+        return array;
+    }
+
+    std::string to_string() const;
+};
+
 struct Object {
     std::unordered_map<std::string, Value> items;
 
@@ -128,10 +193,28 @@ struct Object {
     std::string to_string() const;
 };
 
+// Cursor over the entries of an object, created once per for-in loop. A rehash
+// invalidates `it`, so the bucket count is kept to detect that case.
+struct ObjectIterator {
+    Object::Ptr object;
+    Object::iterator it;
+    size_t bucket_count;
+
+    using Ptr = std::shared_ptr<ObjectIterator>;
+
+    ObjectIterator(Object::Ptr obj)
+        : object(std::move(obj)), it(object->begin()), bucket_count(object->items.bucket_count()) {}
+};
+
 struct Struct {
     std::string name;
     std::unordered_map<std::string, Value> methods;
 
+    // Fixed layout of the instances: the fields the methods assign through
+    // `self`, each with its own slot (see OP_FIELD)
+    std::vector<std::string> fields;
+    std::unordered_map<std::string, uint8_t> field_slots;
+
     using Ptr = std::shared_ptr<Struct>;
 
     Struct(const std::string &name) : name(name) {}
@@ -140,25 +223,62 @@ struct Struct {
         methods[name] = method;
     }
 
+    inline void add_field(const std::string &name) {
+        if (fields.size() == 256 || field_slots.count(name)) return; // slot operands are one byte
+        field_slots.emplace(name, static_cast<uint8_t>(fields.size()));
+        fields.push_back(name);
+    }
+
+    inline int slot_of(const std::string &name) const {
+        auto it = field_slots.find(name);
+        return it != field_slots.end() ? it->second : -1;
+    }
+
     std::string to_string() const { return "<struct " + name + ">"; };
 };
 
+// Fields of the struct's layout live in `slots`, with `assigned` telling which
+// hold a value yet; any other field gets a hash map, allocated on first use
 struct StructInstance {
     std::shared_ptr<Struct> struct_ptr;
-    std::unordered_map<std::string, Value> fields;
+    std::vector<Value> slots;
+    std::bitset<256> assigned; // a layout has at most 256 slots (see Struct::add_field)
+    std::unique_ptr<std::unordered_map<std::string, Value>> fields;
 
     using Ptr = std::shared_ptr<StructInstance>;
 
-    StructInstance(std::shared_ptr<Struct> strct) : struct_ptr(std::move(strct)) {}
+    StructInstance(std::shared_ptr<Struct> strct)
+        : struct_ptr(std::move(strct)), slots(struct_ptr->fields.size()) {}
 
+    // Whether `slot` holds `name` in this instance's layout
+    inline bool has_slot(uint8_t slot, const std::string &name) const {
+        return slot < slots.size() && struct_ptr->fields[slot] == name;
+    }
+
+    inline void store_slot(uint8_t slot, const Value &value) {
+        slots[slot] = value;
+        assigned.set(slot);
+    }
+
+    // Fields come before methods; a field no method has assigned yet is undefined
     inline const Value& get(const std::string &name) const {
-        if (auto it = fields.find(name); it != fields.end()) return it->second;
+        int slot = struct_ptr->slot_of(name);
+        if (slot >= 0 && assigned[slot]) return slots[slot];
+        if (fields) {
+            if (auto it = fields->find(name); it != fields->end()) return it->second;
+        }
         if (auto it2 = struct_ptr->methods.find(name); it2 != struct_ptr->methods.end()) return it2->second;
         throw std::runtime_error("Undefined property `" + std::string(name) + "`.");
     }
 
     inline void put(const std::string &name, const Value &value) {
-        fields[name] = value;
+        if (int slot = struct_ptr->slot_of(name); slot >= 0) {
+            store_slot(static_cast<uint8_t>(slot), value);
+            return;
+        }
+
+        if (!fields) fields = std::make_unique<std::unordered_map<std::string, Value>>();
+        (*fields)[name] = value;
     }
 
     std::string to_string() const { return "<instance of '" + std::string(struct_ptr->name) + "'>"; };
@@ -2,21 +2,30 @@
 
 #include "common.hpp"
 #include "token.hpp"
+#include "ast_analysis.hpp"
 
 struct ScopeManager {
     struct Local {
         std::string name;
         int depth;
         bool is_captured;
+        bool is_final; // never written after its initialization, so closures may copy it
+        StaticType type = StaticType::Any; // declared type, enforced on every store
 
-        Local(const std::string &name) : name(name), depth(-1), is_captured(false) {}
+        Local(const std::string &name) : name(name), depth(-1), is_captured(false), is_final(true) {}
     };
 
+    // A closure either shares a variable through an Upvalue object or, when the
+    // variable is final, keeps its own copy (by_value). The two kinds are numbered
+    // separately: `slot` indexes closure->upvalues or closure->captures.
     struct Upvalue {
         uint8_t index;
         bool is_local;
+        bool by_value;
+        uint8_t slot;
 
-        Upvalue(uint8_t index, bool is_local) : index(index), is_local(is_local) {}
+        Upvalue(uint8_t index, bool is_local, bool by_value, uint8_t slot)
+            : index(index), is_local(is_local), by_value(by_value), slot(slot) {}
     };
 
     std::shared_ptr<ScopeManager> parent;
@@ -24,6 +33,22 @@ struct ScopeManager {
     std::vector<Upvalue> upvalues;
     int scope_depth = 0;
 
+    // Variables written anywhere in the function body (including nested functions)
+    MutationScanner mutations;
+
+    // Types proven for the locals of the function body
+    TypeInference inference;
+
+    // Set for functions that cannot escape (immediately invoked lambdas). They run
+    // right on top of their enclosing frame, so they read its locals in place.
+    bool is_inline = false;
+
+    // Slot layout of `self` in methods (see Struct::fields)
+    std::vector<std::string> self_fields;
+
+    // Declared result type of the function, checked by every return
+    StaticType return_type = StaticType::Any;
+
     ScopeManager(std::shared_ptr<ScopeManager> parent = nullptr, bool is_method = false) : parent(parent) {
         if (is_method) {
             locals.emplace_back("self");
@@ -62,6 +87,7 @@ struct ScopeManager {
         }
 
         locals.emplace_back(name.value);
+        locals.back().is_final = !mutations.mutates(name.value);
     }
 
     void mark_initialized() {
@@ -80,53 +106,68 @@ struct ScopeManager {
         return -1;
     }
 
-    int add_upvalue(uint8_t index, bool is_local) {
-        int upvalue_count = static_cast<int>(upvalues.size());
-        for (int i = 0; i < upvalue_count; i++) {
-            if (upvalues[i].index == index && upvalues[i].is_local == is_local) {
-                return i;
-            }
+    int add_upvalue(uint8_t index, bool is_local, bool by_value) {
+        int kind_count = 0;
+        for (const auto &uv : upvalues) {
+            if (uv.by_value != by_value) continue;
+            if (uv.index == index && uv.is_local == is_local) return uv.slot;
+            kind_count++;
         }
 
-        if (upvalue_count == 255) {
+        if (kind_count == 255) {
             throw std::runtime_error("Too many closure upvalues");
         }
 
-        upvalues.emplace_back(index, is_local);
-        return upvalue_count;
+        upvalues.emplace_back(index, is_local, by_value, static_cast<uint8_t>(kind_count));
+        return kind_count;
     }
 
-    int resolve_upvalue(const Token &name) {
-        if (!parent) return -1;
+    enum class VarType { Local, Upvalue, Capture, Enclosing, Global };
+
+    struct ResolveResult {
+        VarType type;
+        int index;
+        int depth = 0; // frames up, for Enclosing
+        StaticType static_type = StaticType::Any;
+    };
+
+    ResolveResult resolve_upvalue(const Token &name) {
+        if (!parent) return { VarType::Global, -1 };
 
         if (int local = parent->resolve_local(name); local != -1) {
+            StaticType type = parent->locals[local].type;
+            if (parent->locals[local].is_final) {
+                return { VarType::Capture, add_upvalue(static_cast<uint8_t>(local), true, true), 0, type };
+            }
+
             parent->locals[local].is_captured = true;
-            return add_upvalue(static_cast<uint8_t>(local), true);
+            return { VarType::Upvalue, add_upvalue(static_cast<uint8_t>(local), true, false), 0, type };
         }
 
-        if (int upvalue = parent->resolve_upvalue(name); upvalue != -1) {
-            return add_upvalue(static_cast<uint8_t>(upvalue), false);
+        auto outer = parent->resolve_upvalue(name);
+        switch (outer.type) {
+            case VarType::Capture:
+                return { VarType::Capture, add_upvalue(static_cast<uint8_t>(outer.index), false, true), 0, outer.static_type };
+            case VarType::Upvalue:
+                return { VarType::Upvalue, add_upvalue(static_cast<uint8_t>(outer.index), false, false), 0, outer.static_type };
+            default:
+                return { VarType::Global, -1 };
         }
-
-        return -1;
     }
 
-    enum class VarType { Local, Upvalue, Global };
-
-    struct ResolveResult {
-        VarType type;
-        int index;
-    };
-
     ResolveResult resolve_variable(const Token &name) {
         if (int local = resolve_local(name); local != -1) {
-            return { VarType::Local, local };
+            return { VarType::Local, local, 0, locals[local].type };
         }
 
-        if (int upvalue = resolve_upvalue(name); upvalue != -1) {
-            return { VarType::Upvalue, upvalue };
+        // inline functions see the locals of the frames they run on top of
+        int depth = 1;
+        for (auto scope = this; scope->is_inline && scope->parent; scope = scope->parent.get(), depth++) {
+            if (int local = scope->parent->resolve_local(name); local != -1) {
+                return { VarType::Enclosing, local, depth, scope->parent->locals[local].type };
+            }
         }
 
-        return { VarType::Global, -1 };
+        return resolve_upvalue(name);
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "common.hpp"
+#include "jit.hpp"
+
+// Copy-and-patch JIT (--jit=stencil). Instead of encoding instructions, the
+// compiler writes the machine code: src/stencils/stencils.cpp is compiled at build
+// time and src/stencils/generate.cpp extracts each function as a stencil, its
+// relocations becoming holes. Compiling a function is then a matter of copying one
+// stencil per instruction into executable memory and patching its holes with the
+// instruction's operands, its runtime helper and the addresses of its successors.
+// The hot opcodes have stencils of their own that only call the helper when a
+// check fails; the rest share a stencil that always calls it. The helpers (and
+// so the hand-over to VM::run) are the baseline tier's.
+namespace jit {
+    enum class HoleKind : uint8_t {
+        Pc,       // bytecode offset of the instruction
+        Next,     // bytecode offset of the following instruction
+        Operand,  // the instruction's operand (a local slot or an int)
+        Helper,   // runtime helper for the opcode
+        Continue, // address of the following instruction's stencil
+        Target    // address of the branch target's stencil
+    };
+
+    struct Hole {
+        uint32_t offset; // of a 64-bit absolute value within the stencil
+        HoleKind kind;
+        int64_t addend;
+    };
+
+    struct Stencil {
+        const uint8_t *code;
+        size_t size;
+        const Hole *holes;
+        size_t hole_count;
+    };
+
+    // Returns nullptr if the function cannot be compiled on this platform.
+    NativeCode::Ptr compile_stencils(const Function &func, const Helper *helpers);
+}
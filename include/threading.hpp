@@ -3,11 +3,84 @@
 #include "common.hpp"
 #include "runtime.hpp"
 #include "value.hpp"
+#include "chase_lev.hpp"
+#include "timer_wheel.hpp"
+#include "event_trace.hpp"
+#include "pipe_buffer.hpp"
+
+#include <mutex>
+#include <condition_variable>
+#include <optional>
 
 // Forward declarations
 struct VM;
 struct GreenThread;
 struct SelectFrame;
+struct Pipe;
+struct WaitList;
+
+// Intrusive FIFO of nodes with `prev`/`next` links, for registrations that
+// must come off a list in O(1) (blocked selects, joins). Guarded by
+// Scheduler::lock like WaitList; `length` may be read without it.
+template <typename Node>
+struct NodeList {
+    Node *head = nullptr;
+    Node *tail = nullptr;
+    std::atomic<size_t> length { 0 };
+
+    void push_back(Node &node) {
+        length++;
+        node.prev = tail;
+        node.next = nullptr;
+        if (tail) tail->next = &node; else head = &node;
+        tail = &node;
+    }
+
+    void remove(Node &node) {
+        if (node.prev) node.prev->next = node.next; else head = node.next;
+        if (node.next) node.next->prev = node.prev; else tail = node.prev;
+        node.prev = node.next = nullptr;
+        length--;
+    }
+};
+
+// A blocked join's registration on one of the threads it waits for; the nodes
+// live in the waiter's JoinWait
+struct JoinNode {
+    GreenThread *waiter;
+    GreenThread *target; // null once the target has exited
+    size_t index;        // of the target in JoinWait::results
+
+    JoinNode *prev = nullptr;
+    JoinNode *next = nullptr;
+};
+
+// A thread blocked in join, wait_all or wait_any (see Scheduler::join_threads)
+struct JoinWait {
+    enum Mode {
+        One, // join(): resumes with the result
+        All, // wait_all(): resumes with every result, once the last one is in
+        Any, // wait_any(): resumes with [index, result] of the first to exit
+    } mode;
+
+    std::vector<JoinNode> nodes;
+    std::vector<Value> results;
+    size_t remaining = 0;
+};
+
+// What a timer does once it is due (see Scheduler::fire_timer)
+struct TimerEvent {
+    enum Kind {
+        Sleep,       // wake `thread`
+        RecvTimeout, // take `thread` off `pipe`'s readers and wake it with null
+        After,       // send the time to `pipe`
+    } kind;
+
+    std::shared_ptr<GreenThread> thread;
+    std::shared_ptr<Pipe> pipe;
+};
+
+using Timers = TimerWheel<TimerEvent>;
 
 struct CallFrame {
     Closure::Ptr closure;
@@ -15,7 +88,7 @@ struct CallFrame {
     int base = 0; // base index in the VM stack
 };
 
-struct GreenThread {
+struct GreenThread : std::enable_shared_from_this<GreenThread> {
     using Ptr = std::shared_ptr<GreenThread>;
 
     size_t ID;
@@ -25,9 +98,23 @@ struct GreenThread {
         Ready,
         Blocked,
         Finished,
-    } state = Ready;
+    };
 
-    std::chrono::steady_clock::time_point wake_time;
+    // Atomic as the thread's worker polls it while other workers wake or kill it
+    std::atomic<State> state { Ready };
+
+    // Set while a worker runs the thread, until it has been requeued or parked
+    // (under Scheduler::lock once it blocks). Waking it in between only marks it Ready.
+    std::atomic<bool> on_cpu { false };
+
+    // Pending sleep or receive timeout, cancelled when the thread is woken or
+    // killed first
+    Timers::Timer *timer = nullptr;
+
+    // The pipe reader/writer list the thread is blocked on, if any (see WaitList)
+    WaitList *wait_list = nullptr;
+    GreenThread *wait_prev = nullptr;
+    GreenThread *wait_next = nullptr;
 
     std::array<Value, 512> stack;
     size_t stack_size = 0;
@@ -36,32 +123,151 @@ struct GreenThread {
 
     std::vector<GreenThread::Ptr> children;
 
-    Value pending_value;
+    // Joins waiting for this thread to exit, and the one this thread is blocked in
+    NodeList<JoinNode> joiners;
+    std::unique_ptr<JoinWait> join_wait;
+
+    // Values a thread blocked on a pipe's writers still has to hand over, from
+    // `pending_next` on: one for a send, the rest of the batch for send_many
+    std::vector<Value> pending_values;
+    size_t pending_next = 0;
+    size_t send_batch = 0; // send_many: the count it returns once all are handed over
+
+    // recv_many: the most values a thread blocked on a pipe's readers takes at once
+    size_t recv_batch = 0;
+
+    // Result of the blocking call, handed over while the thread was still on
+    // its worker (see Scheduler::resume_with)
+    std::optional<Value> resume_value;
 
     std::unique_ptr<SelectFrame> active_select = nullptr;
 
+    // Time slicing (see Scheduler::slice_budget)
+    int64_t budget = 0; // back edges and calls left in the current slice
+    std::chrono::steady_clock::time_point ready_since;
+
+    struct SliceStats {
+        size_t slices = 0;      // times the thread was scheduled
+        size_t preemptions = 0; // slices that ended because the budget ran out
+        size_t ticks = 0;       // budget spent in the slices that have ended
+        std::chrono::steady_clock::duration max_wait{}; // longest stay in the ready queue
+    } slice_stats;
+
+    // How the thread's selects went (see select_stats())
+    struct SelectStats {
+        size_t selects = 0;       // SELECT_EXECs that completed
+        size_t blocked = 0;       // of those, the ones that had to wait
+        size_t defaults = 0;      // the ones that took the default case
+        std::vector<size_t> wins; // per case index, the others
+    } select_stats;
+
     GreenThread(size_t id = 0) : ID(id) {}
+
+    // Spends one unit of the slice; once it is used up the thread yields and
+    // goes to the back of the ready queue
+    inline bool tick() {
+        if (--budget != 0) return false;
+        state = Ready;
+        slice_stats.preemptions++;
+        return true;
+    }
+};
+
+// Intrusive FIFO of blocked threads, linked through the threads themselves. A
+// thread is on at most one list, so it can be taken off in O(1) when it times
+// out or is killed. The scheduler's thread table keeps listed threads alive.
+// The list itself is guarded by Scheduler::lock; `length` may be read without it.
+struct WaitList {
+    GreenThread *head = nullptr;
+    GreenThread *tail = nullptr;
+    std::atomic<size_t> length { 0 };
+
+    bool empty() const { return head == nullptr; }
+
+    void push_back(GreenThread &thread) {
+        length++;
+        thread.wait_list = this;
+        thread.wait_prev = tail;
+        thread.wait_next = nullptr;
+        if (tail) tail->wait_next = &thread; else head = &thread;
+        tail = &thread;
+    }
+
+    void remove(GreenThread &thread) {
+        if (thread.wait_prev) thread.wait_prev->wait_next = thread.wait_next; else head = thread.wait_next;
+        if (thread.wait_next) thread.wait_next->wait_prev = thread.wait_prev; else tail = thread.wait_prev;
+        thread.wait_list = nullptr;
+        thread.wait_prev = thread.wait_next = nullptr;
+        length--;
+    }
+
+    GreenThread::Ptr pop_front() {
+        GreenThread *thread = head;
+        remove(*thread);
+        return thread->shared_from_this();
+    }
+
+    template <typename F>
+    void for_each(F &&f) const {
+        for (GreenThread *thread = head; thread; thread = thread->wait_next) f(*thread);
+    }
 };
 
+// A blocked select's registration on one of its case pipes; the nodes live in
+// the thread's SelectFrame
+struct SelectNode {
+    GreenThread *thread;
+    SelectFrame *frame;
+    size_t index; // of the case in frame->cases
+    Pipe *pipe;
+
+    SelectNode *prev = nullptr;
+    SelectNode *next = nullptr;
+};
+
+// The select nodes registered on a pipe
+using SelectList = NodeList<SelectNode>;
+
+// A bounded pipe's buffer is lock-free: a send or receive that finds room or a
+// value completes without Scheduler::lock (see Scheduler::send_to_pipe). Only
+// blocking, handoffs between parked threads and unbounded pipes take the lock.
 struct Pipe {
     using Ptr = std::shared_ptr<Pipe>;
+    static constexpr size_t UNBOUNDED = PipeBuffer<Value>::UNBOUNDED;
 
     size_t ID;
 
-    size_t capacity;
-    std::deque<Value> buffer;
+    // 0 hands each value straight from a writer to a reader
+    PipeBuffer<Value> buffer;
+
+    WaitList readers;
+    WaitList writers;
 
-    std::deque<GreenThread::Ptr> readers;
-    std::deque<GreenThread::Ptr> writers;
+    std::atomic<bool> closed { false };
 
-    bool closed = false;
+    SelectList selects; // blocked selects with a case on this pipe
 
-    std::vector<GreenThread::Ptr> select_waiters;
+    // foreach loops waiting for a value, woken on any activity to retry
+    std::vector<GreenThread::Ptr> watchers;
+    std::atomic<size_t> watcher_count { 0 }; // watchers.size(), readable without the lock
 
-    Pipe(size_t id, size_t cap) : ID(id), capacity(cap) {}
+    Pipe(size_t id, size_t capacity) : ID(id), buffer(capacity) {}
 
     bool can_receive();
     bool can_send();
+
+    // Whether a lock-free send or receive has to settle the pipe afterwards.
+    // Paired with the fence a thread issues after registering as a waiter, so
+    // either the waiter sees the value or the sender sees the waiter.
+    bool has_waiters() const {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return readers.length.load() + writers.length.load() + selects.length.load() + watcher_count.load() != 0;
+    }
+
+    void add_watcher(GreenThread::Ptr thread) {
+        watchers.push_back(std::move(thread));
+        watcher_count++;
+    }
 };
 
 struct SelectCase {
@@ -77,39 +283,100 @@ struct SelectFrame {
     std::vector<SelectCase> cases;
     bool has_default = false;
     int default_target_ip;
+
+    // While blocked: a node on each case pipe. The first pipe event to claim
+    // the frame completes its case on the spot and takes every node off its
+    // pipe (see Scheduler::complete_select); SELECT_EXEC applies the outcome
+    // once the thread runs again.
+    std::vector<SelectNode> nodes;
+    std::atomic<bool> claimed { false };
+    size_t chosen = 0;
+    Value received;
+};
+
+// Back edges and calls a thread may run before it is preempted (see --slice)
+constexpr size_t DEFAULT_SLICE_BUDGET = 10000;
+
+// An OS thread running green threads. Its deque holds the ready threads it woke,
+// spawned or preempted; idle workers steal from the others.
+struct Worker {
+    size_t index;
+    ChaseLevDeque<GreenThread *> ready;
+    std::atomic<GreenThread *> run_next { nullptr }; // runs before the deque (e.g. a woken joiner)
+
+    Worker(size_t index) : index(index) {}
 };
 
+// M:N scheduler: green threads run on `worker_count` OS threads (see --workers).
+// Each worker takes from its own deque in FIFO order, then from the injection
+// queue, then steals from the others. Everything a blocked thread waits on
+// (pipes, joins, timers) and the thread table are guarded by `lock`.
 struct Scheduler {
+    size_t slice_budget = DEFAULT_SLICE_BUDGET; // 0: never preempt
+    size_t worker_count = 1;
+
+    std::recursive_mutex lock;
+    std::condition_variable_any idle; // signalled when work is queued or the program ends
+    bool done = false;
+    size_t idle_workers = 0;  // parked with no timer to wait for
+    std::string deadlock;     // set when every thread is blocked for good
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::deque<GreenThread *> injection_queue; // threads queued from outside the workers
+    std::vector<GreenThread::Ptr> retired;     // killed threads a deque may still point to
+    std::atomic<size_t> dequeuing { 0 };       // workers in dequeue, maybe holding a raw pointer
+
     size_t next_thread_id = 0;
     std::unordered_map<size_t, GreenThread::Ptr> threads;
-    std::deque<size_t> ready_queue;
-    std::priority_queue<
-        std::pair<std::chrono::steady_clock::time_point, size_t>,
-        std::vector<std::pair<std::chrono::steady_clock::time_point, size_t>>,
-        std::greater<>
-    > blocked_queue;
-
-    std::unordered_map<size_t, size_t> join_map; // parent thread ID -> child thread ID
+
+    // Sleeps, receive timeouts and after() pipes, in milliseconds since `epoch`
+    Timers timers;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
     std::unordered_map<size_t, Value> return_values; // thread ID -> return value
 
     size_t next_pipe_id = 0;
     std::unordered_map<size_t, Pipe::Ptr> pipes; // pipe ID -> Pipe
 
+    Value final_return;
+
     GreenThread::Ptr get_thread_by_id(size_t id);
     void add_thread(GreenThread::Ptr thread);
-    void enqueue(GreenThread::Ptr thread);
-    inline GreenThread::Ptr dequeue();
-    inline void block_thread(GreenThread::Ptr &thread);
+    void enqueue(GreenThread::Ptr thread, bool next = false);
+    void wake(const GreenThread::Ptr &thread, bool next = false);
+    void resume_with(const GreenThread::Ptr &thread, const Value &value);
+    inline GreenThread::Ptr dequeue(Worker &worker);
+    void trim_retired();
 
+    Pipe::Ptr create_pipe(size_t capacity);
     Pipe::Ptr get_pipe_by_id(size_t id);
 
-    void notify_pipe_select_waiters(Pipe::Ptr &pipe);
+    void notify_watchers(Pipe::Ptr &pipe);
+    void settle_pipe(Pipe::Ptr &pipe);
+
+    // blocked selects, with `lock` held
+    SelectNode *find_select(Pipe &pipe, SelectCase::Type type, int64_t other_than = -1);
+    void unregister_select(SelectFrame &frame);
+    void complete_select(SelectNode &node, const Value &received = {});
+
+    // parked readers and writers, with `lock` held
+    void hand_to_reader(Pipe::Ptr &pipe, Value val);
+    Value take_from_writer(Pipe::Ptr &pipe);
+    size_t take_available(Pipe::Ptr &pipe, std::vector<Value> &out, size_t max, int64_t receiver);
 
-    // pipe operations
+    // pipe operations; the try_ forms never block and need `lock`
+    bool try_send(int64_t sender, Pipe::Ptr &pipe, const Value &val);
+    std::optional<Value> try_receive(int64_t receiver, Pipe::Ptr &pipe);
+    std::optional<Value> poll_pipe(int64_t receiver, Pipe::Ptr &pipe);
     void send_to_pipe(GreenThread::Ptr &current_thread, Pipe::Ptr pipe, const Value &val);
-    Value receive_from_pipe(GreenThread::Ptr current_thread, Pipe::Ptr pipe);
+    Value receive_from_pipe(GreenThread::Ptr current_thread, Pipe::Ptr pipe, int timeout_ms = -1);
     void close_pipe(Pipe::Ptr pipe);
 
+    // batch operations: one lock and one round of wakeups for the whole batch
+    Value send_many_to_pipe(GreenThread::Ptr &current_thread, Pipe::Ptr pipe, const std::vector<Value> &values);
+    Value receive_many_from_pipe(GreenThread::Ptr &current_thread, Pipe::Ptr pipe, size_t max);
+    Value drain_pipe(GreenThread::Ptr &current_thread, Pipe::Ptr pipe);
+
     // select helpers
     void select_begin(GreenThread::Ptr thread, uint8_t case_count);
     void select_add_recv_case(GreenThread::Ptr thread, Pipe::Ptr pipe, uint16_t target_ip, uint8_t slot);
@@ -120,12 +387,25 @@ struct Scheduler {
     Value get_return_value(size_t thread_id);
     void set_return_value(GreenThread::Ptr &thread, const Value &return_value);
 
+    // Blocks `waiter` until the threads in `ids` have exited (see JoinWait);
+    // the result if that needs no waiting, nullopt once it is blocked
+    std::optional<Value> join_threads(GreenThread::Ptr &waiter, const std::vector<size_t> &ids, JoinWait::Mode mode);
+    void unregister_join(JoinWait &wait);
     void notify_waiters(GreenThread::Ptr &thread);
     void kill_thread_and_children(GreenThread::Ptr &thread);
 
-    void wake_threads(const std::chrono::steady_clock::time_point &now);
-    void sleep_until_ready(const std::chrono::steady_clock::time_point &now);
+    // timers
+    void start_timer(int ms, TimerEvent event);
+    void cancel_timer(GreenThread &thread);
+    void fire_timer(TimerEvent &event);
+    void expire_timers(const std::chrono::steady_clock::time_point &now);
     void send_to_sleep(GreenThread::Ptr thread, int ms);
+    Pipe::Ptr after(int ms);
+
+    void wait_for_work(std::unique_lock<std::recursive_mutex> &guard);
+    std::string describe_deadlock();
 
+    void run_worker(VM &vm, Worker &worker);
+    void finish_slice(GreenThread::Ptr &thread);
     Value schedule(VM &vm);
 };
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+
+// Hashed hierarchical timer wheel (Varghese & Lauck). Time is counted in ticks;
+// level l has 64 slots of 64^l ticks each, so four levels cover about 4.6
+// hours of ticks before a timer has to be re-placed. Timers are intrusive list
+// nodes: adding and cancelling are O(1), and a tick fires its whole slot. Once
+// level 0 wraps around, the next slot of level 1 is cascaded into level 0 (and
+// so on up), each timer landing by its own deadline.
+template <typename T>
+class TimerWheel {
+public:
+    struct Timer {
+        T payload;
+        uint64_t deadline;
+
+    private:
+        friend class TimerWheel;
+        Timer *prev = nullptr;
+        Timer *next = nullptr;
+        int level = 0;
+        int slot = 0;
+
+        Timer(T payload, uint64_t deadline) : payload(std::move(payload)), deadline(deadline) {}
+    };
+
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+
+    TimerWheel() = default;
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    ~TimerWheel() {
+        for (auto &level : slots) {
+            for (Timer *head : level) {
+                while (head) {
+                    Timer *next = head->next;
+                    delete head;
+                    head = next;
+                }
+            }
+        }
+    }
+
+    uint64_t now() const { return current; }
+    size_t size() const { return count; }
+
+    // A deadline that has already passed fires on the next tick
+    Timer *add(uint64_t deadline, T payload) {
+        Timer *timer = new Timer(std::move(payload), deadline);
+        place(timer, current + 1);
+        count++;
+        return timer;
+    }
+
+    void cancel(Timer *timer) {
+        unlink(timer);
+        count--;
+        delete timer;
+    }
+
+    // Moves the wheel forward to `to`, calling `fire(payload)` for each timer
+    // that comes due. The timer is released before `fire` runs.
+    template <typename Fire>
+    void advance(uint64_t to, Fire &&fire) {
+        while (current < to) {
+            if (count == 0) {
+                current = to;
+                break;
+            }
+
+            // nothing in level 0: jump to the end of its rotation
+            if (level_counts[0] == 0) {
+                current = std::min(to - 1, current | (SLOTS - 1));
+            }
+
+            current++;
+            if ((current & (SLOTS - 1)) == 0) cascade();
+
+            Timer *&head = slots[0][current & (SLOTS - 1)];
+            while (head) {
+                Timer *timer = head;
+                unlink(timer);
+                count--;
+
+                T payload = std::move(timer->payload);
+                delete timer;
+                fire(payload);
+            }
+        }
+    }
+
+    // The earliest tick at which advance() may have something to do: the next
+    // occupied slot of level 0, or the next cascade
+    std::optional<uint64_t> next_tick() const {
+        if (count == 0) return std::nullopt;
+
+        if (level_counts[0] != 0) {
+            for (uint64_t tick = current + 1; tick <= (current | (SLOTS - 1)); tick++) {
+                if (slots[0][tick & (SLOTS - 1)]) return tick;
+            }
+        }
+
+        return (current | (SLOTS - 1)) + 1;
+    }
+
+private:
+    Timer *slots[LEVELS][SLOTS] = {};
+    size_t level_counts[LEVELS] = {};
+    uint64_t current = 0;
+    size_t count = 0;
+
+    void place(Timer *timer, uint64_t earliest) {
+        uint64_t deadline = std::max(timer->deadline, earliest);
+        uint64_t delta = deadline - current;
+
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) level++;
+
+        // beyond the top level: park in its furthest slot and re-place on cascade
+        if (delta >= (uint64_t(1) << (SLOT_BITS * LEVELS))) {
+            deadline = current + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+        }
+
+        timer->level = level;
+        timer->slot = static_cast<int>((deadline >> (SLOT_BITS * level)) & (SLOTS - 1));
+
+        Timer *&head = slots[level][timer->slot];
+        timer->prev = nullptr;
+        timer->next = head;
+        if (head) head->prev = timer;
+        head = timer;
+        level_counts[level]++;
+    }
+
+    void unlink(Timer *timer) {
+        if (timer->prev) {
+            timer->prev->next = timer->next;
+        } else {
+            slots[timer->level][timer->slot] = timer->next;
+        }
+        if (timer->next) timer->next->prev = timer->prev;
+        level_counts[timer->level]--;
+    }
+
+    // Called as level 0 wraps: each level whose lower levels all wrapped hands
+    // its current slot down, the highest first
+    void cascade() {
+        int top = 1;
+        while (top < LEVELS - 1 && ((current >> (SLOT_BITS * top)) & (SLOTS - 1)) == 0) top++;
+
+        for (int level = top; level >= 1; level--) {
+            Timer *head = slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)];
+            slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)] = nullptr;
+
+            while (head) {
+                Timer *next = head->next;
+                level_counts[level]--;
+                place(head, current); // the slot of `current` fires right after
+                head = next;
+            }
+        }
+    }
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "common.hpp"
+#include "jit.hpp"
+
+struct VM;
+struct CallFrame;
+struct GreenThread;
+
+// Tracing JIT for hot loops (--jit=trace). Backward jumps count how often they
+// reach their loop header; once a header is hot, the next iteration is recorded
+// instruction by instruction along with the types it actually saw. The recording
+// becomes a small register IR over unboxed int/bool values: the operand stack
+// disappears, type checks become guards at trace entry, and branches become
+// guards with side exits. After optimization the IR is emitted as x86-64 that
+// loops natively until a guard fails, then writes its registers back into the
+// frame and resumes the interpreter at the matching instruction.
+namespace jit {
+    constexpr int HOT_LOOP_THRESHOLD = 50;   // back edges before a header is recorded
+    constexpr int MAX_TRACE_ATTEMPTS = 3;    // aborted recordings before a header is given up
+    constexpr size_t MAX_TRACE_LENGTH = 400; // recorded instructions
+
+    enum class TraceType : uint8_t { Unknown, Int, Bool, Ref }; // Ref: boxed value left in its slot
+
+    enum class TraceOp : uint8_t {
+        Const, Move,
+        Add, Sub, Mul, Mod, And, Or, Xor, Shl, Shr, Neg, Not,
+        Lt, Le, Gt, Ge, Eq, Ne,
+        Guard,     // side exit unless truthiness of a == imm
+        LoadElem,  // dst = slot[imm][a], side exit unless the element has type `type`
+        StoreElem  // slot[imm][a] = b (as `type`), side exit if the store fails
+    };
+
+    struct TraceInstr {
+        TraceOp op;
+        int dst = -1, a = -1, b = -1;
+        int32_t imm = 0;
+        TraceType type = TraceType::Int;
+        int exit = -1;
+    };
+
+    // A value the interpreter expects on its stack when a side exit is taken
+    struct StackEntry {
+        int reg;        // register, or local slot for Ref
+        TraceType type;
+    };
+
+    struct TraceExit {
+        int ip;
+        std::vector<StackEntry> stack;
+    };
+
+    struct Trace {
+        int header = 0;         // bytecode offset the loop jumps back to
+        size_t stack_depth = 0; // stack size at the header, relative to the frame base
+        int reg_count = 0;      // registers 0..slot_types.size()-1 mirror local slots
+
+        std::vector<TraceType> slot_types;
+        std::vector<bool> written;
+        std::vector<TraceInstr> preheader; // loop invariant code, run once per entry
+        std::vector<TraceInstr> body;
+        std::vector<TraceExit> exits;
+
+        std::unique_ptr<ExecutableMemory> native;
+
+        int hotness = 0;
+        int attempts = 0;
+        bool failed = false;
+
+        using Ptr = std::shared_ptr<Trace>;
+    };
+
+    struct TraceRecorder {
+        Trace::Ptr trace;      // being recorded, null when idle
+        Function *func = nullptr;
+        GreenThread *thread = nullptr;
+        size_t frame_depth = 0;
+        size_t length = 0;
+        std::vector<StackEntry> stack; // virtual operand stack above the header's depth
+
+        bool active() const { return trace != nullptr; }
+
+        // Called before `op` at `pc` executes in the recorded frame
+        void record(VM &vm, CallFrame &frame, int pc, OpCode op);
+        void abort();
+    };
+
+    // Called after a backward jump landed on `frame.ip`: runs the loop's trace if
+    // there is one, otherwise counts towards recording it.
+    void on_back_edge(VM &vm, CallFrame &frame);
+}
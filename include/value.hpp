@@ -8,6 +8,7 @@ struct Function;
 struct Native;
 struct Closure;
 struct Array;
+struct Range;
 struct Object;
 struct Struct;
 struct StructInstance;
@@ -33,6 +34,7 @@ struct Value {
     using NativePtr   = std::shared_ptr<Native>;
     using ClosurePtr  = std::shared_ptr<Closure>;
     using ArrayPtr    = std::shared_ptr<Array>;
+    using RangePtr    = std::shared_ptr<Range>;
     using ObjectPtr   = std::shared_ptr<Object>;
     using StructPtr   = std::shared_ptr<Struct>;
     using StructInstancePtr = std::shared_ptr<StructInstance>;
@@ -51,6 +53,7 @@ struct Value {
     Value(NativePtr n)            : data(std::move(n)) {}
     Value(ClosurePtr c)           : data(std::move(c)) {}
     Value(ArrayPtr arr)           : data(std::move(arr)) {}
+    Value(RangePtr range)         : data(std::move(range)) {}
     Value(ObjectPtr obj)          : data(std::move(obj)) {}
     Value(StructPtr strct)        : data(std::move(strct)) {}
     Value(StructInstancePtr inst) : data(std::move(inst)) {}
@@ -71,6 +74,7 @@ struct Value {
     inline bool is_native()   const { return is<NativePtr>(); }
     inline bool is_closure()  const { return is<ClosurePtr>(); }
     inline bool is_array()    const { return is<ArrayPtr>(); }
+    inline bool is_range()    const { return is<RangePtr>(); }
     inline bool is_object()   const { return is<ObjectPtr>(); }
     inline bool is_struct()   const { return is<StructPtr>(); }
     inline bool is_struct_instance() const { return is<StructInstancePtr>(); }
@@ -102,6 +106,7 @@ struct Value {
     inline const NativePtr& as_native()     const { return as<const NativePtr&>("native function"); }
     inline const ClosurePtr& as_closure()   const { return as<const ClosurePtr&>("closure"); }
     inline const ArrayPtr& as_array()       const { return as<const ArrayPtr&>("array"); }
+    inline const RangePtr& as_range()       const { return as<const RangePtr&>("range"); }
     inline const ObjectPtr& as_object()     const { return as<const ObjectPtr&>("object"); }
     inline const StructPtr& as_struct()     const { return as<const StructPtr&>("struct"); }
     inline const StructInstancePtr& as_struct_instance() const { return as<const StructInstancePtr&>("struct instance"); }
@@ -143,4 +148,17 @@ Value operator|(const Value &lhs, const Value &rhs);
 Value operator^(const Value &lhs, const Value &rhs);
 Value operator&(const Value &lhs, const Value &rhs);
 Value operator<<(const Value &lhs, const Value &rhs);
-Value operator>>(const Value &lhs, const Value &rhs);
\ No newline at end of file
+Value operator>>(const Value &lhs, const Value &rhs);
+// Types that can be written in annotations (`let x: int`, `fn f(a: float) -> float`).
+// Any is the unannotated, dynamically typed default.
+enum class StaticType : uint8_t { Any, Int, Float, Bool, String };
+
+bool parse_static_type(const std::string &name, StaticType &type);
+std::string static_type_name(StaticType type);
+
+inline bool is_numeric(StaticType type) {
+    return type == StaticType::Int || type == StaticType::Float;
+}
+
+// Whether `v` may be stored as `type`; ints are converted in place when `type` is float
+bool coerce_to_static_type(Value &v, StaticType type);
@@ -2,12 +2,31 @@
 
 #include "common.hpp"
 #include "threading.hpp"
+#include "jit.hpp"
+#include "stencil_jit.hpp"
+#include "trace_jit.hpp"
 
+#include <shared_mutex>
+
+// One VM is shared by all scheduler workers. The state of the green thread a
+// worker is running lives in the thread_local members.
 struct VM {
     std::unordered_map<std::string, Value> globals;
 
+    // With several workers (`parallel`), globals are read under a shared lock and
+    // written under an exclusive one
+    std::shared_mutex globals_lock;
+    bool parallel = false;
+
     Scheduler scheduler;
-    GreenThread::Ptr current_thread;
+    static thread_local GreenThread::Ptr current_thread;
+
+    jit::Mode jit_mode = jit::Mode::Off;
+    static thread_local std::exception_ptr jit_error; // raised by a helper, rethrown once native code has returned
+    static thread_local jit::TraceRecorder tracer;
+
+    // Preshaped object per literal template (see OP_MAKE_OBJECT_FROM_TEMPLATE)
+    static thread_local std::unordered_map<const Array *, Object::Ptr> object_shapes;
 
     VM();
 
@@ -17,9 +36,13 @@ struct VM {
 
     inline void define_native(const std::string &name, int arity, NativeFn func);
 
+    Value bind_method(const Native::Ptr &method, const Value &self);
+    Value bind_method(const Closure::Ptr &method, const Value &self);
+
     void call_value(const Value &callee, int arg_count);
     void call_native(const Native::Ptr &native, int arg_count);
     void call(const Closure::Ptr &closure, int arg_count);
+    void count_call(Function &func);
 
     inline Upvalue::Ptr capture_upvalue(Value *local);
     inline void close_upvalues(int last);
@@ -33,7 +56,11 @@ struct VM {
 
     inline void unary_op(OpCode op);
     inline void binary_op(OpCode op);
+    inline bool loop_condition(OpCode cmp, const Value &counter, const Value &limit);
 
     void debug_instruction(CallFrame &frame, OpCode op);
+    inline void execute(OpCode op, CallFrame &curr);
     void run();
+
+    static const jit::Helper *jit_helpers();
 };
\ No newline at end of file
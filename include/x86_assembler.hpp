@@ -0,0 +1,124 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <cstring>
+
+// Minimal x86-64 encoder shared by the JIT tiers. The tiers keep their frame in
+// rbx, so memory operands are always [rbx + disp32].
+struct X86Assembler {
+    // The same numbers name the 64-bit registers in the `wide` forms below
+    enum Reg : uint8_t { EAX = 0, ECX = 1, EDX = 2, EBX = 3, ESP = 4, EBP = 5, ESI = 6, EDI = 7,
+                         R12 = 12, R13 = 13, R14 = 14, R15 = 15 };
+
+    // condition codes, as in the low nibble of Jcc/SETcc; flipping bit 0 negates one
+    enum Cond : uint8_t { B = 0x2, AE = 0x3, EQ = 0x4, NE = 0x5, LT = 0xc, GE = 0xd, LE = 0xe, GT = 0xf };
+
+    std::vector<uint8_t> code;
+
+    size_t size() const { return code.size(); }
+
+    void bytes(std::initializer_list<uint8_t> b) { code.insert(code.end(), b); }
+
+    void u32(uint32_t v) {
+        for (int i = 0; i < 4; i++) code.push_back(static_cast<uint8_t>(v >> (8 * i)));
+    }
+
+    void u64(uint64_t v) {
+        for (int i = 0; i < 8; i++) code.push_back(static_cast<uint8_t>(v >> (8 * i)));
+    }
+
+    void patch_rel32(size_t at, size_t target) {
+        int32_t rel = static_cast<int32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(at + 4));
+        std::memcpy(&code[at], &rel, sizeof(rel));
+    }
+
+    // opcode bytes followed by ModRM for [rbx + disp32]
+    void mem(std::initializer_list<uint8_t> opcode, uint8_t reg, int32_t disp) {
+        bytes(opcode);
+        code.push_back(static_cast<uint8_t>(0x80 | (reg << 3) | 3));
+        u32(static_cast<uint32_t>(disp));
+    }
+
+    // The general forms: any register, 64-bit operands with `wide`, and memory
+    // operands [base + disp32] on any base
+    void rex(bool wide, uint8_t reg, uint8_t base) {
+        uint8_t prefix = static_cast<uint8_t>(0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3));
+        if (prefix != 0x40) code.push_back(prefix);
+    }
+
+    void mem(std::initializer_list<uint8_t> opcode, bool wide, uint8_t reg, Reg base, int32_t disp) {
+        rex(wide, reg, base);
+        bytes(opcode);
+        code.push_back(static_cast<uint8_t>(0x80 | ((reg & 7) << 3) | (base & 7)));
+        if ((base & 7) == ESP) code.push_back(0x24); // rsp and r12 need a SIB byte
+        u32(static_cast<uint32_t>(disp));
+    }
+
+    void reg_reg(std::initializer_list<uint8_t> opcode, bool wide, uint8_t reg, Reg rm) {
+        rex(wide, reg, rm);
+        bytes(opcode);
+        code.push_back(static_cast<uint8_t>(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+    }
+
+    void load(Reg r, int32_t disp)  { mem({ 0x8b }, r, disp); }  // mov r32, [rbx + disp]
+    void store(int32_t disp, Reg r) { mem({ 0x89 }, r, disp); }  // mov [rbx + disp], r32
+
+    void store_imm(int32_t disp, int32_t imm) { // mov dword [rbx + disp], imm32
+        mem({ 0xc7 }, 0, disp);
+        u32(static_cast<uint32_t>(imm));
+    }
+
+    void cmp_imm8(int32_t disp, int8_t imm) { // cmp dword [rbx + disp], imm8
+        mem({ 0x83 }, 7, disp);
+        code.push_back(static_cast<uint8_t>(imm));
+    }
+
+    void set_bool(Cond cc) {
+        bytes({ 0x0f, static_cast<uint8_t>(0x90 | cc), 0xc0 }); // setcc al
+        bytes({ 0x0f, 0xb6, 0xc0 });                            // movzx eax, al
+    }
+
+    void mov_imm(Reg r, uint32_t imm) {
+        code.push_back(static_cast<uint8_t>(0xb8 | r));
+        u32(imm);
+    }
+
+    void call_abs(const void *target) {
+        bytes({ 0x48, 0xb8 }); // movabs rax, target
+        u64(reinterpret_cast<uint64_t>(target));
+        bytes({ 0xff, 0xd0 }); // call rax
+    }
+
+    void test_eax() { bytes({ 0x85, 0xc0 }); }
+
+    // Jumps return the position of their rel32, to be patched once the target is known
+    size_t jcc(Cond cc) {
+        bytes({ 0x0f, static_cast<uint8_t>(0x80 | cc) });
+        u32(0);
+        return size() - 4;
+    }
+
+    size_t jmp() {
+        bytes({ 0xe9 });
+        u32(0);
+        return size() - 4;
+    }
+};
+
+// Machine code copied into its own mapping and made executable (never writable
+// and executable at the same time)
+struct ExecutableMemory {
+    uint8_t *memory = nullptr;
+    size_t size = 0;
+
+    explicit ExecutableMemory(const std::vector<uint8_t> &code);
+
+    // For code that embeds its own addresses: `fill` writes all `size` bytes
+    // while the mapping is still writable
+    ExecutableMemory(size_t size, const std::function<void(uint8_t *memory)> &fill);
+    ~ExecutableMemory();
+
+    ExecutableMemory(const ExecutableMemory &) = delete;
+    ExecutableMemory &operator=(const ExecutableMemory &) = delete;
+};
@@ -0,0 +1,318 @@
+#include "aot.hpp"
+#include "bytecode.hpp"
+#include "bytecode_cache.hpp"
+#include "vm.hpp"
+
+#include <set>
+
+namespace aot {
+
+// Functions are numbered depth first, `$main` being 0. run_module walks the
+// loaded module in the same order.
+static void collect_functions(const Function::Ptr &func, std::vector<Function::Ptr> &out) {
+    out.push_back(func);
+    for (const auto &nested : func->chunk.functions) {
+        collect_functions(nested.as_function(), out);
+    }
+}
+
+static uint16_t u16_at(const Chunk &chunk, size_t at) {
+    return static_cast<uint16_t>((chunk.code[at] << 8) | chunk.code[at + 1]);
+}
+
+// Folded array and object literals are copied on every load (see ConstantPool::load)
+static std::string const_expr(const Chunk &chunk, uint16_t idx) {
+    const Value &v = (*chunk.constants)[idx];
+    bool mutable_literal = v.is_array() || v.is_object();
+    return (mutable_literal ? "K.load(" : "K[") + std::to_string(idx) + (mutable_literal ? ")" : "]");
+}
+
+// Instructions emitted as C++; any other opcode runs through its runtime helper
+static bool is_inlined(OpCode op) {
+    switch (op) {
+        case OP_NULL: case OP_TRUE: case OP_FALSE:
+        case OP_CONST: case OP_ICONST8: case OP_ICONST16:
+        case OP_LOAD_LOCAL: case OP_STORE_LOCAL:
+        case OP_POP: case OP_DUP:
+        case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_JUMP_IF_TRUE:
+        case OP_ADD: case OP_SUB: case OP_MUL:
+        case OP_EQ: case OP_NEQ: case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+        case OP_ADD_INT: case OP_SUB_INT: case OP_MUL_INT:
+        case OP_LT_INT: case OP_LE_INT: case OP_GT_INT: case OP_GE_INT:
+        case OP_FOR_LOOP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static const char *int_operator(OpCode op) {
+    switch (op) {
+        case OP_ADD: return "+";
+        case OP_SUB: return "-";
+        case OP_MUL: return "*";
+        case OP_EQ:  return "==";
+        case OP_NEQ: return "!=";
+        case OP_LT:  return "<";
+        case OP_LE:  return "<=";
+        case OP_GT:  return ">";
+        case OP_GE:  return ">=";
+        default:     return nullptr;
+    }
+}
+
+// Int opcodes whose operand types the compiler already proved
+static const char *typed_int_operator(OpCode op) {
+    switch (op) {
+        case OP_ADD_INT: return "+";
+        case OP_SUB_INT: return "-";
+        case OP_MUL_INT: return "*";
+        case OP_LT_INT:  return "<";
+        case OP_LE_INT:  return "<=";
+        case OP_GT_INT:  return ">";
+        case OP_GE_INT:  return ">=";
+        default:         return nullptr;
+    }
+}
+
+// The helper call, with its exits: a branch to a static target continues
+// natively, anything else that leaves the straight line is a continuation point
+static void emit_helper(std::ostream &out, OpCode op, size_t pc, size_t next, int target) {
+    out << "        r = H[" << static_cast<int>(op) << "](vm, " << pc << ", " << next << ");\n";
+    out << "        if (r == jit::EXIT) return true;\n";
+    if (target >= 0) {
+        out << "        if (r == jit::BRANCH) { if (frame.ip == " << target << ") goto L" << target << "; return true; }\n";
+    } else {
+        out << "        if (r == jit::BRANCH) return true;\n";
+    }
+}
+
+// A native jump to `target`; going backwards spends the thread's slice budget,
+// and running out of it leaves the function to yield at the loop header
+static std::string jump_to(int target, size_t pc) {
+    std::string label = "goto L" + std::to_string(target) + ";";
+    if (static_cast<size_t>(target) > pc) return label;
+    return "{ if (thread.tick()) { frame.ip = " + std::to_string(target) + "; return true; } " + label + " }";
+}
+
+// Fast path guarded by `condition`, falling back to the helper
+static void emit_guarded(std::ostream &out, const std::string &condition, const std::string &fast,
+                         OpCode op, size_t pc, size_t next, int target) {
+    out << "        if (" << condition << ") {\n" << fast << "        } else {\n";
+    std::ostringstream helper;
+    emit_helper(helper, op, pc, next, target);
+    std::string line;
+    std::istringstream lines(helper.str());
+    while (std::getline(lines, line)) out << "    " << line << "\n";
+    out << "        }\n";
+}
+
+static void emit_function(std::ostream &out, const Function &func, size_t index) {
+    const auto &chunk = func.chunk;
+    std::set<size_t> labels = { 0 };
+
+    for (size_t pc = 0; pc < chunk.code.size(); pc += instruction_length(chunk, pc)) {
+        OpCode op = static_cast<OpCode>(chunk.code[pc]);
+        int target = branch_target(chunk, pc);
+        if (target >= 0 && static_cast<size_t>(target) < chunk.code.size()) labels.insert(target);
+
+        // resume points: a yielding instruction is retried or continues after itself
+        if (!is_inlined(op)) {
+            labels.insert(pc);
+            labels.insert(pc + instruction_length(chunk, pc));
+        }
+    }
+    labels.erase(chunk.code.size());
+
+    out << "// " << func.to_string() << "\n";
+    out << "static bool fn_" << index << "(VM *vm) {\n";
+    out << "    GreenThread &thread = *vm->current_thread;\n";
+    out << "    CallFrame &frame = thread.frames.back();\n";
+    out << "    Value *stack = thread.stack.data();\n";
+    out << "    size_t &sp = thread.stack_size;\n";
+    out << "    const ConstantPool &K = *frame.closure->func->chunk.constants;\n";
+    out << "    const size_t base = static_cast<size_t>(frame.base);\n";
+    out << "    int r = 0;\n";
+    out << "    (void)stack; (void)K; (void)base; (void)r;\n\n";
+
+    out << "    switch (frame.ip) {\n";
+    for (size_t label : labels) out << "        case " << label << ": goto L" << label << ";\n";
+    out << "        default: return false;\n";
+    out << "    }\n\n";
+
+    for (size_t pc = 0; pc < chunk.code.size(); ) {
+        OpCode op = static_cast<OpCode>(chunk.code[pc]);
+        size_t next = pc + instruction_length(chunk, pc);
+        int target = branch_target(chunk, pc);
+        if (target >= 0 && static_cast<size_t>(target) >= chunk.code.size()) target = -1;
+
+        if (labels.count(pc)) out << "L" << pc << ":\n";
+        out << "    { // " << opcode_to_string(op) << "\n";
+
+        std::ostringstream fast;
+        switch (op) {
+            case OP_NULL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_CONST:
+            case OP_ICONST8:
+            case OP_ICONST16: {
+                std::string value =
+                    op == OP_NULL    ? "Value()" :
+                    op == OP_TRUE    ? "Value(true)" :
+                    op == OP_FALSE   ? "Value(false)" :
+                    op == OP_CONST   ? const_expr(chunk, u16_at(chunk, pc + 1)) :
+                    op == OP_ICONST8 ? "Value(" + std::to_string(static_cast<int8_t>(chunk.code[pc + 1])) + ")" :
+                                       "Value(" + std::to_string(static_cast<int16_t>(u16_at(chunk, pc + 1))) + ")";
+                fast << "            stack[sp++] = " << value << ";\n";
+                emit_guarded(out, "sp < STACK_SIZE", fast.str(), op, pc, next, target);
+                break;
+            }
+            case OP_LOAD_LOCAL: {
+                int slot = chunk.code[pc + 1];
+                fast << "            stack[sp] = stack[base + " << slot << "];\n";
+                fast << "            sp++;\n";
+                emit_guarded(out, "sp < STACK_SIZE && base + " + std::to_string(slot) + " < sp",
+                             fast.str(), op, pc, next, target);
+                break;
+            }
+            case OP_STORE_LOCAL: {
+                int slot = chunk.code[pc + 1];
+                fast << "            stack[base + " << slot << "] = stack[sp - 1];\n";
+                emit_guarded(out, "base + " + std::to_string(slot) + " < sp", fast.str(), op, pc, next, target);
+                break;
+            }
+            case OP_POP:
+                fast << "            sp--;\n";
+                emit_guarded(out, "sp > 0", fast.str(), op, pc, next, target);
+                break;
+            case OP_DUP:
+                fast << "            stack[sp] = stack[sp - 1];\n";
+                fast << "            sp++;\n";
+                emit_guarded(out, "sp > 0 && sp < STACK_SIZE", fast.str(), op, pc, next, target);
+                break;
+            case OP_JUMP:
+                if (target >= 0) {
+                    out << "        " << jump_to(target, pc) << "\n";
+                } else {
+                    emit_helper(out, op, pc, next, target);
+                }
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+                if (target >= 0) {
+                    out << "        if (" << (op == OP_JUMP_IF_FALSE ? "!" : "")
+                        << "stack[sp - 1].is_truthy()) " << jump_to(target, pc) << "\n";
+                } else {
+                    emit_helper(out, op, pc, next, target);
+                }
+                break;
+            case OP_FOR_LOOP: {
+                int slot = chunk.code[pc + 1];
+                const char *cmp = int_operator(static_cast<OpCode>(chunk.code[pc + 2]));
+                if (cmp && target >= 0) {
+                    out << "        Value *vars = &stack[base + " << slot << "];\n";
+                    out << "        int *counter = std::any_cast<int>(&vars[0].data);\n";
+                    out << "        const int *limit = std::any_cast<int>(&vars[1].data);\n";
+                    out << "        const int *step = std::any_cast<int>(&vars[2].data);\n";
+                    fast << "            *counter += *step;\n";
+                    fast << "            if (*counter " << cmp << " *limit) " << jump_to(target, pc) << "\n";
+                    emit_guarded(out, "counter && limit && step", fast.str(), op, pc, next, target);
+                } else {
+                    emit_helper(out, op, pc, next, target);
+                }
+                break;
+            }
+            default:
+                if (const char *cmp = int_operator(op)) {
+                    out << "        const int *a = sp >= 2 ? std::any_cast<int>(&stack[sp - 2].data) : nullptr;\n";
+                    out << "        const int *b = a ? std::any_cast<int>(&stack[sp - 1].data) : nullptr;\n";
+                    fast << "            Value result(*a " << cmp << " *b);\n";
+                    fast << "            stack[--sp - 1] = result;\n";
+                    emit_guarded(out, "a && b", fast.str(), op, pc, next, target);
+                } else if (const char *typed = typed_int_operator(op)) {
+                    out << "        int b = *std::any_cast<int>(&stack[sp - 1].data);\n";
+                    out << "        int a = *std::any_cast<int>(&stack[sp - 2].data);\n";
+                    out << "        stack[--sp - 1] = Value(a " << typed << " b);\n";
+                } else {
+                    emit_helper(out, op, pc, next, target);
+                }
+                break;
+        }
+
+        out << "    }\n";
+        pc = next;
+    }
+
+    // falling off the end leaves ip past the code; VM::run pops the frame
+    out << "    frame.ip = " << chunk.code.size() << ";\n";
+    out << "    return true;\n";
+    out << "}\n\n";
+}
+
+void emit_cpp(std::ostream &out, const Function::Ptr &main_func, uint64_t source_hash) {
+    // also compiles every lazy body, so it comes before the functions are walked
+    std::string module = bytecode_cache::serialize(source_hash, main_func);
+
+    std::vector<Function::Ptr> functions;
+    collect_functions(main_func, functions);
+
+    out << "// Generated by `interp --emit-cpp`. Build it against the runtime objects (see `make aot`).\n\n";
+    out << "#include \"aot.hpp\"\n";
+    out << "#include \"vm.hpp\"\n\n";
+    out << "static const jit::Helper *const H = VM::jit_helpers();\n";
+    out << "static constexpr size_t STACK_SIZE = std::tuple_size<decltype(GreenThread::stack)>::value;\n\n";
+
+    for (size_t i = 0; i < functions.size(); i++) {
+        emit_function(out, *functions[i], i);
+    }
+
+    out << "static const uint8_t MODULE[] = {";
+    for (size_t i = 0; i < module.size(); i++) {
+        out << (i % 16 == 0 ? "\n    " : " ") << static_cast<int>(static_cast<uint8_t>(module[i])) << ",";
+    }
+    out << "\n};\n\n";
+
+    out << "static const aot::Entry ENTRIES[] = {";
+    for (size_t i = 0; i < functions.size(); i++) {
+        out << (i % 8 == 0 ? "\n    " : " ") << "fn_" << i << ",";
+    }
+    out << "\n};\n\n";
+
+    out << "int main() {\n";
+    out << "    return aot::run_module(MODULE, sizeof(MODULE), " << source_hash << "ull, ENTRIES, "
+        << functions.size() << ");\n";
+    out << "}\n";
+}
+
+int run_module(const uint8_t *module, size_t size, uint64_t source_hash,
+               const Entry *entries, size_t entry_count) {
+    std::srand(std::time(nullptr));
+
+    auto main_func = bytecode_cache::deserialize(module, size, source_hash);
+    if (!main_func.get()) {
+        std::cerr << "Error: embedded module is malformed or from another interpreter version\n";
+        return 1;
+    }
+
+    std::vector<Function::Ptr> functions;
+    collect_functions(main_func, functions);
+    if (functions.size() != entry_count) {
+        std::cerr << "Error: embedded module does not match its compiled functions\n";
+        return 1;
+    }
+
+    for (size_t i = 0; i < functions.size(); i++) {
+        functions[i]->aot_code = entries[i];
+    }
+
+    VM vm;
+    Value result = vm.interpret(main_func);
+
+    if (result.is_null()) return 0;
+    if (result.is_int()) return result.as_int();
+
+    return result.is_truthy() ? 0 : 1;
+}
+
+}
@@ -0,0 +1,503 @@
+#include "ast_analysis.hpp"
+
+void MutationScanner::scan(const Expr &expr) {
+    std::visit(Overloaded{
+        [&](const BinaryExpr &e)   { scan(*e.left); scan(*e.right); },
+        [&](const LogicalExpr &e)  { scan(*e.left); scan(*e.right); },
+        [&](const UnaryExpr &e) {
+            if (e.op.type == TokenType::Increment || e.op.type == TokenType::Decrement) {
+                scan_target(*e.right);
+            }
+            scan(*e.right);
+        },
+        [&](const PostfixExpr &e)  { scan_target(*e.left); scan(*e.left); },
+        [&](const GroupingExpr &e) { scan(*e.grouped); },
+        [&](const LiteralExpr &)   {},
+        [&](const VariableExpr &)  {},
+        [&](const AssignExpr &e)   { names.insert(e.name.value); scan(*e.value); },
+        [&](const SetDotExpr &e) {
+            add_self_field(*e.target, e.key.value);
+            scan(*e.target);
+            scan(*e.value);
+        },
+        [&](const SetIndexExpr &e) { scan(*e.target); scan(*e.index); scan(*e.value); },
+        [&](const CallExpr &e) {
+            scan(*e.callee);
+            for (const auto &arg : e.args) scan(*arg);
+        },
+        [&](const ArrayExpr &e) {
+            for (const auto &el : e.elements) scan(*el);
+        },
+        [&](const ObjectExpr &e) {
+            for (const auto &[key, val] : e.items) scan(*val);
+        },
+        [&](const IndexExpr &e)    { scan(*e.target); scan(*e.index); },
+        [&](const DotExpr &e)      { scan(*e.target); },
+        [&](const TernaryExpr &e)  { scan(*e.condition); scan(*e.left); scan(*e.right); },
+        [&](const LambdaExpr &e)   { scan(*e.body); },
+        [&](const SelfExpr &)      {},
+        [&](const SpawnExpr &e) {
+            if (e.count) scan(*e.count);
+            scan(*e.statements);
+        }
+    }, expr);
+}
+
+void MutationScanner::scan(const Stmt &stmt) {
+    std::visit(Overloaded{
+        [&](const ExprStmt &s)  { scan(*s.expr); },
+        [&](const DispStmt &s)  { scan(*s.expr); },
+        [&](const LetStmt &s)   { if (s.initializer) scan(*s.initializer); },
+        [&](const BlockStmt &s) { scan(*s.statements); },
+        [&](const IfStmt &s) {
+            scan(*s.condition);
+            scan(*s.then_branch);
+            if (s.else_branch) scan(*s.else_branch);
+        },
+        [&](const WhileStmt &s)   { scan(*s.condition); scan(*s.body); },
+        [&](const ForEachStmt &s) { scan(*s.iterable); scan(*s.body); },
+        [&](const FunctionStmt &s) { scan(*s.body); },
+        [&](const ReturnStmt &s)  { if (s.value) scan(*s.value); },
+        [&](const StructStmt &s) {
+            for (const auto &m : s.methods) scan(*m);
+        },
+        [&](const CloseStmt &s)   { scan(*s.expr); },
+        [&](const SelectStmt &s) {
+            for (const auto &c : s.send_clauses) {
+                scan(*c.value_expr);
+                scan(*c.pipe_expr);
+                scan(*c.body);
+            }
+            for (const auto &c : s.recv_clauses) {
+                scan(*c.pipe_expr);
+                scan(*c.body);
+            }
+            if (s.default_body) scan(*s.default_body);
+        }
+    }, stmt);
+}
+
+void MutationScanner::scan(const std::vector<StmtPtr> &stmts) {
+    for (const auto &s : stmts) {
+        scan(*s);
+    }
+}
+
+void MutationScanner::scan_target(const Expr &target) {
+    if (auto var = std::get_if<VariableExpr>(&target)) {
+        names.insert(var->name.value);
+    } else if (auto dot = std::get_if<DotExpr>(&target)) {
+        add_self_field(*dot->target, dot->key.value);
+    }
+}
+
+void MutationScanner::add_self_field(const Expr &target, const std::string &field) {
+    if (!std::holds_alternative<SelfExpr>(target)) return;
+    if (std::find(self_fields.begin(), self_fields.end(), field) == self_fields.end()) {
+        self_fields.push_back(field);
+    }
+}
+
+static TokenType base_operator(TokenType op) {
+    switch (op) {
+        case TokenType::PlusEqual:  return TokenType::Plus;
+        case TokenType::MinusEqual: return TokenType::Minus;
+        case TokenType::MultEqual:  return TokenType::Mult;
+        case TokenType::DivEqual:   return TokenType::Div;
+        case TokenType::ModEqual:   return TokenType::Mod;
+        default:                    return op;
+    }
+}
+
+// Mixed int/float operands are widened to float, as Value's operators do
+StaticType operand_type(TokenType op, StaticType lhs, StaticType rhs) {
+    if (!is_numeric(lhs) || !is_numeric(rhs)) return StaticType::Any;
+
+    bool is_float = lhs == StaticType::Float || rhs == StaticType::Float;
+    switch (base_operator(op)) {
+        case TokenType::Plus:
+        case TokenType::Minus:
+        case TokenType::Mult:
+        case TokenType::Less:
+        case TokenType::LessEqual:
+        case TokenType::Greater:
+        case TokenType::GreaterEqual:
+            return is_float ? StaticType::Float : StaticType::Int;
+        case TokenType::Div:
+            return StaticType::Float; // '/' always divides as float
+        case TokenType::Mod:
+            return is_float ? StaticType::Any : StaticType::Int;
+        default:
+            return StaticType::Any;
+    }
+}
+
+StaticType result_type(TokenType op, StaticType lhs, StaticType rhs) {
+    switch (base_operator(op)) {
+        case TokenType::Equal:
+        case TokenType::NotEqual:
+        case TokenType::Less:
+        case TokenType::LessEqual:
+        case TokenType::Greater:
+        case TokenType::GreaterEqual:
+            return StaticType::Bool; // or an error
+        case TokenType::BitOr:
+        case TokenType::BitAnd:
+        case TokenType::BitXor:
+        case TokenType::BitShiftLeft:
+        case TokenType::BitShiftRight:
+            return StaticType::Int; // or an error
+        case TokenType::Plus:
+            if (lhs == StaticType::String && rhs == StaticType::String) return StaticType::String;
+            return operand_type(op, lhs, rhs);
+        case TokenType::LeftArrow:
+            return StaticType::Any;
+        default:
+            return operand_type(op, lhs, rhs);
+    }
+}
+
+void TypeInference::analyze_script(const std::vector<StmtPtr> &statements) {
+    run([&]() { infer(statements); }); // top-level variables are globals, never tracked
+}
+
+void TypeInference::analyze_function(const std::vector<Token> &params, const FunctionTypes &types,
+                                     const std::vector<StmtPtr> &body) {
+    run([&]() {
+        scopes.emplace_back();
+        for (size_t i = 0; i < params.size(); i++) {
+            StaticType type = i < types.params.size() ? types.params[i] : StaticType::Any;
+            write(declare(&params[i], params[i].value, type), type);
+        }
+
+        infer(body);
+    });
+}
+
+StaticType TypeInference::type_at(const void *site) const {
+    auto it = site_types.find(site);
+    return it != site_types.end() ? it->second : StaticType::Any;
+}
+
+// Pinning a variable invalidates what was inferred before the nested function
+// that writes it was found, so the walk is repeated until no variable is pinned
+void TypeInference::run(const std::function<void()> &walk) {
+    do {
+        pinned_new = false;
+        site_types.clear();
+        scopes.clear();
+        state.assign(variables.size(), StaticType::Any);
+        walk();
+    } while (pinned_new);
+}
+
+// Variables are identified by their declaring node, so a loop body walked
+// several times keeps the same variables
+int TypeInference::declare(const void *node, const std::string &name, StaticType declared) {
+    if (scopes.empty()) return -1; // global
+
+    auto [it, inserted] = declarations.emplace(node, static_cast<int>(variables.size()));
+    if (inserted) {
+        variables.push_back({ declared });
+        state.resize(variables.size(), StaticType::Any);
+    }
+
+    scopes.back().emplace_back(name, it->second);
+    return it->second;
+}
+
+int TypeInference::resolve(const std::string &name) const {
+    for (auto scope = scopes.rbegin(); scope != scopes.rend(); ++scope) {
+        for (auto var = scope->rbegin(); var != scope->rend(); ++var) {
+            if (var->first == name) return var->second;
+        }
+    }
+
+    return -1; // global or enclosing function
+}
+
+StaticType TypeInference::read(int var) const {
+    if (var < 0) return StaticType::Any;
+
+    const auto &v = variables[var];
+    if (v.declared != StaticType::Any) return v.declared; // enforced on every store
+    return v.pinned ? StaticType::Any : state[var];
+}
+
+void TypeInference::write(int var, StaticType type) {
+    if (var >= 0) state[var] = type;
+}
+
+void TypeInference::pin_writes(const MutationScanner &writes) {
+    for (const auto &name : writes.names) {
+        int var = resolve(name);
+        if (var >= 0 && !variables[var].pinned) {
+            variables[var].pinned = true;
+            pinned_new = true;
+        }
+    }
+}
+
+// Variables declared after `saved` was taken come back untyped
+void TypeInference::restore(const State &saved) {
+    state = saved;
+    state.resize(variables.size(), StaticType::Any);
+}
+
+// Merges the state of another path into the current one
+void TypeInference::join(const State &other) {
+    for (size_t i = 0; i < state.size(); i++) {
+        if (i >= other.size() || other[i] != state[i]) state[i] = StaticType::Any;
+    }
+}
+
+// Walks the loop until the state at the start of an iteration is a fixed point.
+// The loop exits right after its condition (if any) was evaluated.
+void TypeInference::loop(const std::function<void()> &condition, const std::function<void()> &body) {
+    State entry = state;
+    for (;;) {
+        State start = state;
+        if (condition) condition();
+
+        State exit = state;
+        body();
+
+        State next = state;
+        restore(entry);
+        join(next);
+
+        if (state == start) {
+            restore(exit);
+            return;
+        }
+    }
+}
+
+// A variable updated in place by `++`/`--`; returns its type before the update
+StaticType TypeInference::update(const void *site, const Expr &target) {
+    auto var = std::get_if<VariableExpr>(&target);
+    if (!var) {
+        infer(target);
+        return StaticType::Any;
+    }
+
+    int index = resolve(var->name.value);
+    StaticType type = read(index);
+    site_types[site] = type;
+
+    if (!is_numeric(type)) type = StaticType::Any;
+    write(index, type);
+    return type;
+}
+
+StaticType TypeInference::infer(const Expr &expr) {
+    return std::visit(Overloaded{
+        [&](const BinaryExpr &e) {
+            StaticType lhs = infer(*e.left);
+            StaticType rhs = infer(*e.right);
+            return result_type(e.op.type, lhs, rhs);
+        },
+        [&](const LogicalExpr &e) {
+            StaticType lhs = infer(*e.left);
+            State skipped = state;
+            StaticType rhs = infer(*e.right); // may not run
+            join(skipped);
+            return lhs == rhs ? lhs : StaticType::Any;
+        },
+        [&](const UnaryExpr &e) {
+            switch (e.op.type) {
+                case TokenType::Increment:
+                case TokenType::Decrement:
+                    return update(&e, *e.right);
+                case TokenType::Not:
+                    infer(*e.right);
+                    return StaticType::Bool;
+                case TokenType::Minus: {
+                    StaticType type = infer(*e.right);
+                    return is_numeric(type) ? type : StaticType::Any;
+                }
+                case TokenType::BitNot:
+                    infer(*e.right);
+                    return StaticType::Int; // or an error
+                default:
+                    infer(*e.right);
+                    return StaticType::Any;
+            }
+        },
+        [&](const PostfixExpr &e)  { return update(&e, *e.left); },
+        [&](const GroupingExpr &e) { return infer(*e.grouped); },
+        [&](const LiteralExpr &e) {
+            const Value &v = e.literal;
+            if (v.is_int())    return StaticType::Int;
+            if (v.is_float())  return StaticType::Float;
+            if (v.is_bool())   return StaticType::Bool;
+            if (v.is_string()) return StaticType::String;
+            return StaticType::Any;
+        },
+        [&](const VariableExpr &e) {
+            StaticType type = read(resolve(e.name.value));
+            site_types[&e] = type;
+            return type;
+        },
+        [&](const AssignExpr &e) {
+            int var = resolve(e.name.value);
+
+            StaticType type;
+            if (e.op.type == TokenType::Assign) {
+                type = infer(*e.value);
+            } else {
+                StaticType lhs = read(var);
+                site_types[&e] = lhs;
+                type = result_type(e.op.type, lhs, infer(*e.value));
+            }
+
+            write(var, type);
+            return read(var);
+        },
+        [&](const SetDotExpr &e) {
+            infer(*e.target);
+            infer(*e.value);
+            return StaticType::Any;
+        },
+        [&](const SetIndexExpr &e) {
+            infer(*e.target);
+            infer(*e.index);
+            infer(*e.value);
+            return StaticType::Any;
+        },
+        [&](const CallExpr &e) {
+            infer(*e.callee);
+            for (const auto &arg : e.args) infer(*arg);
+            return StaticType::Any;
+        },
+        [&](const ArrayExpr &e) {
+            for (const auto &el : e.elements) infer(*el);
+            return StaticType::Any;
+        },
+        [&](const ObjectExpr &e) {
+            for (const auto &[key, val] : e.items) infer(*val);
+            return StaticType::Any;
+        },
+        [&](const IndexExpr &e) {
+            infer(*e.target);
+            infer(*e.index);
+            return StaticType::Any;
+        },
+        [&](const DotExpr &e) {
+            infer(*e.target);
+            return StaticType::Any;
+        },
+        [&](const TernaryExpr &e) {
+            infer(*e.condition);
+            State before = state;
+            StaticType lhs = infer(*e.left);
+            State taken = state;
+            restore(before);
+            StaticType rhs = infer(*e.right);
+            join(taken);
+            return lhs == rhs ? lhs : StaticType::Any;
+        },
+        [&](const LambdaExpr &e) {
+            MutationScanner writes;
+            writes.scan(*e.body);
+            pin_writes(writes);
+            return StaticType::Any;
+        },
+        [&](const SelfExpr &) { return StaticType::Any; },
+        [&](const SpawnExpr &e) {
+            MutationScanner writes;
+            writes.scan(*e.statements);
+            pin_writes(writes);
+            if (e.count) infer(*e.count);
+            return StaticType::Any;
+        }
+    }, expr);
+}
+
+void TypeInference::infer(const Stmt &stmt) {
+    std::visit(Overloaded{
+        [&](const ExprStmt &s)  { infer(*s.expr); },
+        [&](const DispStmt &s)  { infer(*s.expr); },
+        [&](const LetStmt &s) {
+            StaticType type = s.initializer ? infer(*s.initializer) : StaticType::Any;
+            write(declare(&s, s.name.value, s.type), type);
+        },
+        [&](const BlockStmt &s) {
+            scopes.emplace_back();
+            infer(*s.statements);
+            scopes.pop_back();
+        },
+        [&](const IfStmt &s) {
+            infer(*s.condition);
+            State before = state;
+            infer(*s.then_branch);
+            State taken = state;
+            restore(before);
+            if (s.else_branch) infer(*s.else_branch);
+            join(taken);
+        },
+        [&](const WhileStmt &s) {
+            loop([&]() { infer(*s.condition); }, [&]() { infer(*s.body); });
+        },
+        [&](const ForEachStmt &s) {
+            scopes.emplace_back();
+            infer(*s.iterable);
+            declare(&s.iterator, s.iterator.value); // rewritten by the VM, never typed
+            if (s.index.value != "") declare(&s.index, s.index.value);
+            loop(nullptr, [&]() { infer(*s.body); });
+            scopes.pop_back();
+        },
+        [&](const FunctionStmt &s) {
+            declare(&s.name, s.name.value);
+            MutationScanner writes;
+            writes.scan(*s.body);
+            pin_writes(writes);
+        },
+        [&](const ReturnStmt &s) { if (s.value) infer(*s.value); },
+        [&](const StructStmt &s) {
+            declare(&s.name, s.name.value);
+
+            MutationScanner writes;
+            for (const auto &m : s.methods) {
+                declare(&std::get<FunctionStmt>(*m).name, std::get<FunctionStmt>(*m).name.value);
+                writes.scan(*m);
+            }
+            pin_writes(writes);
+        },
+        [&](const CloseStmt &s) { infer(*s.expr); },
+        [&](const SelectStmt &s) {
+            scopes.emplace_back();
+
+            for (const auto &c : s.recv_clauses) {
+                infer(*c.pipe_expr);
+                if (!c.discard) declare(&c.var_name, c.var_name.value);
+            }
+            for (const auto &c : s.send_clauses) {
+                infer(*c.pipe_expr);
+                infer(*c.value_expr);
+            }
+
+            // exactly one of the bodies runs
+            State before = state;
+            std::vector<State> taken;
+            auto body = [&](const StmtPtr &stmt) {
+                restore(before);
+                infer(*stmt);
+                taken.push_back(state);
+            };
+
+            for (const auto &c : s.recv_clauses) body(c.body);
+            for (const auto &c : s.send_clauses) body(c.body);
+            if (s.default_body) body(s.default_body);
+
+            for (const auto &other : taken) join(other);
+            scopes.pop_back();
+        }
+    }, stmt);
+}
+
+void TypeInference::infer(const std::vector<StmtPtr> &stmts) {
+    for (const auto &s : stmts) {
+        infer(*s);
+    }
+}
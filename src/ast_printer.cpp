@@ -153,7 +153,7 @@ std::string AstPrinter::print_lambda(const LambdaExpr &expr) {
     out << "(" << colored("fn", Color::Keyword) << " (";
 
     for (size_t i = 0; i < expr.params.size(); i++) {
-        out << colored(expr.params[i].value, Color::Ident);
+        out << colored(expr.params[i].value, Color::Ident) << annotation(expr.types.params[i]);
         if (i < expr.params.size() - 1) {
             out << " ";
         }
@@ -202,7 +202,12 @@ std::string AstPrinter::print_disp(const DispStmt &stmt) {
 }
 
 std::string AstPrinter::print_let(const LetStmt &stmt) {
-    return indent() + parenthesize(colored("let ", Color::Keyword) + colored(stmt.name.value, Color::Ident), stmt.initializer.get());
+    return indent() + parenthesize(colored("let ", Color::Keyword) + colored(stmt.name.value, Color::Ident) +
+                                   annotation(stmt.type), stmt.initializer.get());
+}
+
+std::string AstPrinter::annotation(StaticType type) {
+    return type == StaticType::Any ? "" : ":" + colored(static_type_name(type), Color::Keyword);
 }
 
 std::string AstPrinter::print_function(const FunctionStmt &stmt) {
@@ -211,13 +216,16 @@ std::string AstPrinter::print_function(const FunctionStmt &stmt) {
     out << indent() << "(" << colored("fn ", Color::Keyword) << colored(stmt.name.value, Color::Ident) << "(";
 
     for (size_t i = 0; i < stmt.params.size(); i++) {
-        out << colored(stmt.params[i].value, Color::Ident);
+        out << colored(stmt.params[i].value, Color::Ident) << annotation(stmt.types.params[i]);
         if (i < stmt.params.size() - 1) {
             out << " ";
         }
     }
 
     out << ")";
+    if (stmt.types.result != StaticType::Any) {
+        out << " -> " << colored(static_type_name(stmt.types.result), Color::Keyword);
+    }
 
     if (!stmt.body->empty()) {
         IndentGuard guard(indent_level);
@@ -1,13 +1,106 @@
 #include "bytecode.hpp"
 #include "value.hpp"
+#include "runtime.hpp"
 
-uint16_t Chunk::add_constant(const Value &v) {
-    for (uint16_t i = 0; i < constants.size(); i++) {
-        if (constants[i] == v) return i;
+// Scalars are keyed by type and value, so 1 and 1.0 stay distinct constants.
+// Anything else (e.g. folded array literals) gets an empty key and is never shared.
+std::string ConstantPool::key_of(const Value &v) {
+    if (v.is_null())   return "n";
+    if (v.is_int())    return "i" + std::to_string(v.as_int());
+    if (v.is_bool())   return v.as_bool() ? "t" : "f";
+    if (v.is_string()) return "s" + v.as_string();
+    if (v.is_float()) {
+        double d = v.as_float();
+        return "d" + std::string(reinterpret_cast<const char *>(&d), sizeof(d));
     }
 
-    constants.push_back(v);
-    return static_cast<uint16_t>(constants.size() - 1);
+    return "";
+}
+
+uint16_t ConstantPool::add(const Value &v) {
+    std::string key = key_of(v);
+    if (!key.empty()) {
+        auto it = index.find(key);
+        if (it != index.end() && it->second <= UINT16_MAX) return static_cast<uint16_t>(it->second);
+    }
+
+    if (narrow_size > UINT16_MAX) {
+        throw std::runtime_error("Too many names and object templates in one module");
+    }
+
+    uint32_t idx = narrow_size++;
+    if (idx < values.size()) {
+        values[idx] = v; // padding left by add_literal()
+    } else {
+        values.push_back(v);
+    }
+
+    if (!key.empty()) index[key] = idx; // also replaces a copy above 65535
+    return static_cast<uint16_t>(idx);
+}
+
+uint32_t ConstantPool::add_literal(const Value &v) {
+    std::string key = key_of(v);
+    if (!key.empty()) {
+        if (auto it = index.find(key); it != index.end()) return it->second;
+    }
+
+    if (narrow_literals < NARROW_LITERALS && narrow_size <= UINT16_MAX) {
+        narrow_literals++;
+        return add(v);
+    }
+
+    if (values.size() >= MAX_SIZE) {
+        throw std::runtime_error("Too many constants in one module");
+    }
+
+    // the unused part of the 16-bit range stays free for add()
+    if (values.size() <= UINT16_MAX) values.resize(UINT16_MAX + 1);
+
+    uint32_t idx = static_cast<uint32_t>(values.size());
+    values.push_back(v);
+    if (!key.empty()) index.emplace(std::move(key), idx);
+    return idx;
+}
+
+void ConstantPool::restore(const Value &v) {
+    uint32_t idx = static_cast<uint32_t>(values.size());
+    values.push_back(v);
+
+    std::string key = key_of(v);
+    if (!key.empty()) index.emplace(std::move(key), idx); // the lowest index wins
+    if (idx <= UINT16_MAX) narrow_size = idx + 1;
+}
+
+static Value copy_literal(const Value &v) {
+    if (v.is_array()) {
+        std::vector<Value> elements;
+        elements.reserve(v.as_array()->size());
+        for (const auto &el : v.as_array()->elements) elements.push_back(copy_literal(el));
+        return std::make_shared<Array>(elements);
+    }
+
+    if (v.is_object()) {
+        std::unordered_map<std::string, Value> items;
+        items.reserve(v.as_object()->size());
+        for (const auto &[key, val] : v.as_object()->items) items.emplace(key, copy_literal(val));
+        return std::make_shared<Object>(items);
+    }
+
+    return v;
+}
+
+Value ConstantPool::load(size_t i) const {
+    return copy_literal(values[i]);
+}
+
+uint16_t Chunk::add_function(const Value &func) {
+    if (functions.size() > UINT16_MAX) {
+        throw std::runtime_error("Too many nested functions");
+    }
+
+    functions.push_back(func);
+    return static_cast<uint16_t>(functions.size() - 1);
 }
 
 std::string opcode_to_string(OpCode op) {
@@ -17,6 +110,7 @@ std::string opcode_to_string(OpCode op) {
         case OP_TRUE: return "TRUE";
         case OP_FALSE: return "FALSE";
         case OP_CONST: return "CONST";
+        case OP_CONST_LONG: return "CONST_LONG";
         case OP_ICONST8: return "ICONST8";
         case OP_ICONST16: return "ICONST16";
         case OP_CLOSURE: return "CLOSURE";
@@ -25,12 +119,17 @@ std::string opcode_to_string(OpCode op) {
         case OP_LOAD_UPVALUE: return "LOAD_UPVALUE";
         case OP_STORE_UPVALUE: return "STORE_UPVALUE";
         case OP_CLOSE_UPVALUE: return "CLOSE_UPVALUE";
+        case OP_LOAD_CAPTURE: return "LOAD_CAPTURE";
+        case OP_LOAD_ENCLOSING: return "LOAD_ENCLOSING";
+        case OP_STORE_ENCLOSING: return "STORE_ENCLOSING";
         case OP_LOAD_GLOBAL: return "LOAD_GLOBAL";
         case OP_STORE_GLOBAL: return "STORE_GLOBAL";
         case OP_LOAD_INDEX: return "LOAD_INDEX";
         case OP_STORE_INDEX: return "STORE_INDEX";
         case OP_LOAD_FIELD: return "LOAD_FIELD";
         case OP_STORE_FIELD: return "STORE_FIELD";
+        case OP_LOAD_SLOT: return "LOAD_SLOT";
+        case OP_STORE_SLOT: return "STORE_SLOT";
         case OP_ADD: return "ADD";
         case OP_SUB: return "SUB";
         case OP_MUL: return "MUL";
@@ -50,19 +149,40 @@ std::string opcode_to_string(OpCode op) {
         case OP_BIT_XOR: return "BIT_XOR";
         case OP_SHIFT_LEFT: return "SHIFT_LEFT";
         case OP_SHIFT_RIGHT: return "SHIFT_RIGHT";
+        case OP_ADD_INT: return "ADD_INT";
+        case OP_SUB_INT: return "SUB_INT";
+        case OP_MUL_INT: return "MUL_INT";
+        case OP_MOD_INT: return "MOD_INT";
+        case OP_LT_INT: return "LT_INT";
+        case OP_LE_INT: return "LE_INT";
+        case OP_GT_INT: return "GT_INT";
+        case OP_GE_INT: return "GE_INT";
+        case OP_ADD_FLOAT: return "ADD_FLOAT";
+        case OP_SUB_FLOAT: return "SUB_FLOAT";
+        case OP_MUL_FLOAT: return "MUL_FLOAT";
+        case OP_DIV_FLOAT: return "DIV_FLOAT";
+        case OP_LT_FLOAT: return "LT_FLOAT";
+        case OP_LE_FLOAT: return "LE_FLOAT";
+        case OP_GT_FLOAT: return "GT_FLOAT";
+        case OP_GE_FLOAT: return "GE_FLOAT";
+        case OP_CHECK_TYPE: return "CHECK_TYPE";
         case OP_DUP: return "DUP";
         case OP_DUP2: return "DUP2";
         case OP_JUMP: return "JUMP";
         case OP_JUMP_IF_FALSE: return "JUMP_IF_FALSE";
         case OP_JUMP_IF_TRUE: return "JUMP_IF_TRUE";
+        case OP_FOR_PREP: return "FOR_PREP";
+        case OP_FOR_LOOP: return "FOR_LOOP";
         case OP_CALL: return "CALL";
         case OP_MAKE_ARRAY: return "MAKE_ARRAY";
         case OP_MAKE_OBJECT: return "MAKE_OBJECT";
+        case OP_MAKE_OBJECT_FROM_TEMPLATE: return "MAKE_OBJECT_FROM_TEMPLATE";
         case OP_POP: return "POP";
         case OP_PRINT: return "PRINT";
         case OP_RETURN: return "RETURN";
         case OP_STRUCT: return "STRUCT";
         case OP_METHOD: return "METHOD";
+        case OP_FIELD: return "FIELD";
         case OP_SPAWN: return "SPAWN";
         case OP_GET_ITER: return "GET_ITER";
         case OP_ITER_NEXT: return "ITER_NEXT";
@@ -78,3 +198,77 @@ std::string opcode_to_string(OpCode op) {
         default: return "UNKNOWN";
     }
 }
+
+size_t instruction_length(const Chunk &chunk, size_t offset) {
+    switch (static_cast<OpCode>(chunk.code[offset])) {
+        case OP_ICONST8:
+        case OP_LOAD_LOCAL:
+        case OP_STORE_LOCAL:
+        case OP_LOAD_UPVALUE:
+        case OP_STORE_UPVALUE:
+        case OP_LOAD_CAPTURE:
+        case OP_CALL:
+        case OP_LOAD_ITER_INDEX:
+        case OP_SELECT_BEGIN:
+            return 2;
+        case OP_DEFINE_GLOBAL:
+        case OP_CONST:
+        case OP_ICONST16:
+        case OP_LOAD_ENCLOSING:
+        case OP_STORE_ENCLOSING:
+        case OP_LOAD_GLOBAL:
+        case OP_STORE_GLOBAL:
+        case OP_LOAD_FIELD:
+        case OP_STORE_FIELD:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_MAKE_ARRAY:
+        case OP_MAKE_OBJECT:
+        case OP_MAKE_OBJECT_FROM_TEMPLATE:
+        case OP_STRUCT:
+        case OP_METHOD:
+        case OP_FIELD:
+        case OP_SELECT_SEND:
+        case OP_SELECT_DEFAULT:
+        case OP_CHECK_TYPE:
+            return 3;
+        case OP_ITER_NEXT:
+        case OP_CONST_LONG:
+        case OP_SELECT_RECV:
+        case OP_LOAD_SLOT:
+        case OP_STORE_SLOT:
+            return 4;
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:
+            return 5;
+        case OP_CLOSURE: {
+            uint16_t idx = (static_cast<uint16_t>(chunk.code[offset + 1]) << 8) | chunk.code[offset + 2];
+            return 3 + 2 * chunk.functions[idx].as_function()->upvalue_count; // (kind, index) pairs
+        }
+        default:
+            return 1;
+    }
+}
+
+int branch_target(const Chunk &chunk, size_t offset) {
+    size_t next = offset + instruction_length(chunk, offset);
+    auto u16_at = [&](size_t at) {
+        return static_cast<uint16_t>((chunk.code[at] << 8) | chunk.code[at + 1]);
+    };
+
+    switch (static_cast<OpCode>(chunk.code[offset])) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            return static_cast<int>(next) + static_cast<int16_t>(u16_at(offset + 1));
+        case OP_FOR_PREP:
+            return static_cast<int>(next) + u16_at(offset + 3);
+        case OP_FOR_LOOP:
+            return static_cast<int>(next) + static_cast<int16_t>(u16_at(offset + 3));
+        case OP_ITER_NEXT:
+            return static_cast<int>(next) + u16_at(offset + 2);
+        default:
+            return -1;
+    }
+}
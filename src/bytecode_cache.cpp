@@ -0,0 +1,230 @@
+#include "bytecode_cache.hpp"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace bytecode_cache {
+
+static const char MAGIC[4] = { 'D', 'O', 'G', 'C' };
+
+enum ValueTag : uint8_t { TAG_NULL, TAG_INT, TAG_FLOAT, TAG_BOOL, TAG_STRING, TAG_ARRAY };
+
+struct Writer {
+    std::string out;
+
+    template <typename T>
+    void write(T v) { out.append(reinterpret_cast<const char *>(&v), sizeof(T)); }
+
+    void write_bytes(const void *data, size_t size) {
+        write(static_cast<uint32_t>(size));
+        out.append(static_cast<const char *>(data), size);
+    }
+
+    void write_value(const Value &v) {
+        if (v.is_null()) {
+            write(TAG_NULL);
+        } else if (v.is_int()) {
+            write(TAG_INT);
+            write(static_cast<int32_t>(v.as_int()));
+        } else if (v.is_float()) {
+            write(TAG_FLOAT);
+            write(v.as_float());
+        } else if (v.is_bool()) {
+            write(TAG_BOOL);
+            write(static_cast<uint8_t>(v.as_bool()));
+        } else if (v.is_string()) {
+            write(TAG_STRING);
+            write_bytes(v.as_string().data(), v.as_string().size());
+        } else if (v.is_array()) {
+            write(TAG_ARRAY);
+            write(static_cast<uint32_t>(v.as_array()->size()));
+            for (const auto &elem : *v.as_array()) {
+                write_value(elem);
+            }
+        } else {
+            throw std::runtime_error("Cannot cache constant of type " + v.type_name());
+        }
+    }
+
+    void write_function(const Function &func) {
+        write_bytes(func.name.data(), func.name.size());
+        write(static_cast<int32_t>(func.arity));
+        write(static_cast<int32_t>(func.upvalue_count));
+        write_bytes(func.chunk.code.data(), func.chunk.code.size());
+
+        write(static_cast<uint32_t>(func.chunk.functions.size()));
+        for (const auto &nested : func.chunk.functions) {
+            write_function(*nested.as_function());
+        }
+    }
+};
+
+// Reads straight out of the mapped file; every read is bounds checked.
+struct Reader {
+    const uint8_t *pos;
+    const uint8_t *end;
+
+    template <typename T>
+    T read() {
+        if (static_cast<size_t>(end - pos) < sizeof(T)) throw std::runtime_error("Truncated bytecode cache");
+        T v;
+        std::memcpy(&v, pos, sizeof(T));
+        pos += sizeof(T);
+        return v;
+    }
+
+    std::string_view read_bytes() {
+        uint32_t size = read<uint32_t>();
+        if (static_cast<size_t>(end - pos) < size) throw std::runtime_error("Truncated bytecode cache");
+        std::string_view bytes(reinterpret_cast<const char *>(pos), size);
+        pos += size;
+        return bytes;
+    }
+
+    Value read_value() {
+        switch (read<uint8_t>()) {
+            case TAG_NULL:   return {};
+            case TAG_INT:    return static_cast<int>(read<int32_t>());
+            case TAG_FLOAT:  return read<double>();
+            case TAG_BOOL:   return read<uint8_t>() != 0;
+            case TAG_STRING: return std::string(read_bytes());
+            case TAG_ARRAY: {
+                uint32_t count = read<uint32_t>();
+                std::vector<Value> elements;
+                elements.reserve(count);
+                for (uint32_t i = 0; i < count; i++) {
+                    elements.push_back(read_value());
+                }
+                return std::make_shared<Array>(elements);
+            }
+            default:
+                throw std::runtime_error("Invalid constant tag in bytecode cache");
+        }
+    }
+
+    Function::Ptr read_function(const ConstantPool::Ptr &constants) {
+        std::string name(read_bytes());
+        int arity = read<int32_t>();
+
+        auto func = std::make_shared<Function>(name, arity);
+        func->upvalue_count = read<int32_t>();
+        func->chunk.constants = constants;
+
+        auto code = read_bytes();
+        func->chunk.code.assign(code.begin(), code.end());
+
+        uint32_t nested_count = read<uint32_t>();
+        for (uint32_t i = 0; i < nested_count; i++) {
+            func->chunk.add_function(read_function(constants));
+        }
+
+        return func;
+    }
+};
+
+uint64_t hash_source(const std::string &source) {
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (unsigned char c : source) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+std::string path_for(const std::string &source_path) {
+    return source_path + "c";
+}
+
+Function::Ptr deserialize(const uint8_t *data, size_t size, uint64_t source_hash) {
+    try {
+        Reader reader { data, data + size };
+
+        char magic[4];
+        for (char &c : magic) c = static_cast<char>(reader.read<uint8_t>());
+
+        if (std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            reader.read<uint32_t>() != VERSION ||
+            reader.read<uint64_t>() != source_hash) {
+            return nullptr;
+        }
+
+        auto constants = std::make_shared<ConstantPool>();
+        uint32_t count = reader.read<uint32_t>();
+        for (uint32_t i = 0; i < count; i++) {
+            constants->restore(reader.read_value());
+        }
+
+        return reader.read_function(constants);
+    } catch (const std::runtime_error &) {
+        return nullptr;
+    }
+}
+
+Function::Ptr load(const std::string &path, uint64_t source_hash) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return nullptr;
+
+    auto main_func = deserialize(static_cast<const uint8_t *>(data), size, source_hash);
+
+    munmap(data, size);
+    return main_func;
+}
+
+std::string serialize(uint64_t source_hash, const Function::Ptr &main_func) {
+    Writer writer;
+    main_func->compile_all(); // the cache must hold every body
+
+    for (char c : MAGIC) writer.write(static_cast<uint8_t>(c));
+    writer.write(VERSION);
+    writer.write(source_hash);
+
+    const auto &constants = *main_func->chunk.constants;
+    writer.write(static_cast<uint32_t>(constants.size()));
+    for (const auto &v : constants.values) {
+        writer.write_value(v);
+    }
+
+    writer.write_function(*main_func);
+    return std::move(writer.out);
+}
+
+bool store(const std::string &path, uint64_t source_hash, const Function::Ptr &main_func) {
+    std::string module;
+    try {
+        module = serialize(source_hash, main_func);
+    } catch (const std::runtime_error &) {
+        return false;
+    }
+
+    // write to a temporary file first so a concurrent run never maps a partial cache
+    std::string tmp_path = path + ".tmp";
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!file) return false;
+
+    file.write(module.data(), static_cast<std::streamsize>(module.size()));
+    file.close();
+
+    if (!file || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+}
@@ -1,7 +1,12 @@
 #include "codegen.hpp"
 
 Function::Ptr Codegen::compile(const std::shared_ptr<std::vector<StmtPtr>> &statements) {
+    constants = std::make_shared<ConstantPool>();
+    global_types = std::make_shared<GlobalTypes>();
+    stats = std::make_shared<Stats>();
     begin_function("$main", 0);
+    scopes->mutations.scan(*statements);
+    scopes->inference.analyze_script(*statements);
 
     for (const auto &s : *statements) {
         generate(*s);
@@ -12,6 +17,7 @@ Function::Ptr Codegen::compile(const std::shared_ptr<std::vector<StmtPtr>> &stat
 
 void Codegen::begin_function(const std::string &name, int arity, bool is_method) {
     auto new_func = std::make_shared<Function>(name, arity);
+    new_func->chunk.constants = constants; // all functions of the module share one pool
     auto new_scope = std::make_shared<ScopeManager>(scopes, is_method);
     function_stack.push_back(new_func);
     curr = new_func;
@@ -33,6 +39,64 @@ Function::Ptr Codegen::end_function(bool is_init) {
     return finished_func;
 }
 
+// Functions declared at the top level of the script can only see globals, so
+// their bodies need nothing from the enclosing compiler and can wait for a call
+bool Codegen::can_compile_lazily() const {
+    return scopes && !scopes->parent && scopes->depth() == 0;
+}
+
+Function::Ptr Codegen::make_lazy_function(const std::string &name, const std::vector<Token> &params,
+                                          const std::shared_ptr<std::vector<StmtPtr>> &body, const FunctionTypes &types,
+                                          bool is_method, const std::vector<std::string> &self_fields) {
+    auto func = std::make_shared<Function>(name, static_cast<int>(params.size()));
+    func->chunk.constants = constants;
+
+    func->compile_body = [constants = constants, global_types = global_types, stats = stats,
+                          params, body, types, is_method, self_fields](Function &func) {
+        Codegen gen;
+        gen.constants = constants;
+        gen.global_types = global_types;
+        gen.stats = stats;
+        gen.begin_function(func.name, func.arity, is_method);
+        gen.scopes->self_fields = self_fields;
+        gen.generate_function_body(params, *body, types);
+
+        auto compiled = gen.end_function(is_method && func.name == "init");
+        func.chunk.code = std::move(compiled->chunk.code);
+        func.chunk.functions = std::move(compiled->chunk.functions);
+    };
+
+    return func;
+}
+
+void Codegen::generate_function_body(const std::vector<Token> &params, const std::vector<StmtPtr> &body,
+                                     const FunctionTypes &types) {
+    scopes->mutations.scan(body);
+    scopes->inference.analyze_function(params, types, body);
+    scopes->return_type = types.result;
+    begin_scope();
+
+    // Declare and initialize parameters as locals in the nested state
+    for (size_t i = 0; i < params.size(); i++) {
+        declare_variable(params[i]); // adds to state->Locals
+        mark_initialized();
+
+        // annotated parameters are checked once on entry, in their slots
+        StaticType type = i < types.params.size() ? types.params[i] : StaticType::Any;
+        if (type != StaticType::Any) {
+            scopes->locals.back().type = type;
+            emit_type_check(type, static_cast<uint8_t>(scopes->locals.size() - 1));
+        }
+    }
+
+    // Compile the body of the nested function
+    for (const auto &s : body) {
+        generate(*s);
+    }
+
+    end_scope();
+}
+
 void Codegen::generate(const Expr &expr) {
     std::visit(Overloaded{
         [&](const BinaryExpr &e)    { generate_binary(e);    },
@@ -89,9 +153,15 @@ inline uint16_t Codegen::make_constant(const Value &v) {
 }
 
 void Codegen::emit_constant(const Value &v) {
-    uint16_t idx = make_constant(v);
-    emit(OP_CONST);
-    emit(idx);
+    uint32_t idx = curr->chunk.add_literal(v);
+    if (idx <= UINT16_MAX) {
+        emit(OP_CONST);
+        emit(static_cast<uint16_t>(idx));
+    } else {
+        emit(OP_CONST_LONG);
+        emit(static_cast<uint8_t>(idx >> 16));
+        emit(static_cast<uint16_t>(idx & 0xFFFF));
+    }
 }
 
 void Codegen::emit_iconst8(int8_t v) {
@@ -110,6 +180,9 @@ void Codegen::emit_return(bool is_init) {
         emit(static_cast<uint8_t>(0)); // load 'self'
     } else {
         emit(OP_NULL);
+        if (scopes->return_type != StaticType::Any) {
+            emit_type_check(scopes->return_type); // falling off the end of a typed function
+        }
     }
 
     emit(OP_RETURN);
@@ -132,6 +205,17 @@ void Codegen::emit_load_var(const Token &name) {
             emit(static_cast<uint8_t>(res.index));
             return;
         }
+        case ScopeManager::VarType::Capture: {
+            emit(OP_LOAD_CAPTURE);
+            emit(static_cast<uint8_t>(res.index));
+            return;
+        }
+        case ScopeManager::VarType::Enclosing: {
+            emit(OP_LOAD_ENCLOSING);
+            emit(static_cast<uint8_t>(res.depth));
+            emit(static_cast<uint8_t>(res.index));
+            return;
+        }
         case ScopeManager::VarType::Global: {
             uint16_t name_idx = make_constant(name.value);
             emit(OP_LOAD_GLOBAL);
@@ -141,7 +225,14 @@ void Codegen::emit_load_var(const Token &name) {
     }
 }
 
-void Codegen::emit_store_var(const Token &name) {
+// Checks the value on top of the stack against the variable's declared type,
+// unless the compiler already knows it is `value_type`
+void Codegen::emit_store_var(const Token &name, StaticType value_type) {
+    StaticType type = declared_type(name);
+    if (type != StaticType::Any && type != value_type) {
+        emit_type_check(type);
+    }
+
     auto res = resolve_variable(name);
     switch (res.type) {
         case ScopeManager::VarType::Local: {
@@ -154,6 +245,16 @@ void Codegen::emit_store_var(const Token &name) {
             emit(static_cast<uint8_t>(res.index));
             return;
         }
+        case ScopeManager::VarType::Capture: {
+            // only variables that are never assigned are captured by value
+            throw std::runtime_error("Cannot assign to captured copy of: " + name.value);
+        }
+        case ScopeManager::VarType::Enclosing: {
+            emit(OP_STORE_ENCLOSING);
+            emit(static_cast<uint8_t>(res.depth));
+            emit(static_cast<uint8_t>(res.index));
+            return;
+        }
         case ScopeManager::VarType::Global: {
             uint16_t name_idx = make_constant(name.value);
             emit(OP_STORE_GLOBAL);
@@ -163,18 +264,214 @@ void Codegen::emit_store_var(const Token &name) {
     }
 }
 
-void Codegen::emit_compound_op(const Token &op) {
+static OpCode compound_opcode(const Token &op) {
     switch (op.type) {
-        case TokenType::PlusEqual:  emit(OP_ADD); break;
-        case TokenType::MinusEqual: emit(OP_SUB); break;
-        case TokenType::MultEqual:  emit(OP_MUL); break;
-        case TokenType::DivEqual:   emit(OP_DIV); break;
-        case TokenType::ModEqual:   emit(OP_MOD); break;
+        case TokenType::PlusEqual:  return OP_ADD;
+        case TokenType::MinusEqual: return OP_SUB;
+        case TokenType::MultEqual:  return OP_MUL;
+        case TokenType::DivEqual:   return OP_DIV;
+        case TokenType::ModEqual:   return OP_MOD;
         default:
             throw std::runtime_error("Unsupported compound assignment in codegen: " + op.value);
     }
 }
 
+static OpCode binary_opcode(const Token &op) {
+    switch (op.type) {
+        case TokenType::Plus:          return OP_ADD;
+        case TokenType::Minus:         return OP_SUB;
+        case TokenType::Mult:          return OP_MUL;
+        case TokenType::Div:           return OP_DIV;
+        case TokenType::Mod:           return OP_MOD;
+        case TokenType::Greater:       return OP_GT;
+        case TokenType::Less:          return OP_LT;
+        case TokenType::GreaterEqual:  return OP_GE;
+        case TokenType::LessEqual:     return OP_LE;
+        case TokenType::Equal:         return OP_EQ;
+        case TokenType::NotEqual:      return OP_NEQ;
+        case TokenType::BitOr:         return OP_BIT_OR;
+        case TokenType::BitAnd:        return OP_BIT_AND;
+        case TokenType::BitXor:        return OP_BIT_XOR;
+        case TokenType::BitShiftLeft:  return OP_SHIFT_LEFT;
+        case TokenType::BitShiftRight: return OP_SHIFT_RIGHT;
+        case TokenType::LeftArrow:     return OP_SEND_PIPE;
+        default:
+            throw std::runtime_error("Unknown binary operator in codegen: " + op.value);
+    }
+}
+
+static OpCode typed_opcode(OpCode op, StaticType operands) {
+    if (operands == StaticType::Int) {
+        switch (op) {
+            case OP_ADD: return OP_ADD_INT;
+            case OP_SUB: return OP_SUB_INT;
+            case OP_MUL: return OP_MUL_INT;
+            case OP_MOD: return OP_MOD_INT;
+            case OP_LT:  return OP_LT_INT;
+            case OP_LE:  return OP_LE_INT;
+            case OP_GT:  return OP_GT_INT;
+            case OP_GE:  return OP_GE_INT;
+            default:     break;
+        }
+    } else if (operands == StaticType::Float) {
+        switch (op) {
+            case OP_ADD: return OP_ADD_FLOAT;
+            case OP_SUB: return OP_SUB_FLOAT;
+            case OP_MUL: return OP_MUL_FLOAT;
+            case OP_DIV: return OP_DIV_FLOAT;
+            case OP_LT:  return OP_LT_FLOAT;
+            case OP_LE:  return OP_LE_FLOAT;
+            case OP_GT:  return OP_GT_FLOAT;
+            case OP_GE:  return OP_GE_FLOAT;
+            default:     break;
+        }
+    }
+
+    return op;
+}
+
+void Codegen::emit_compound_op(const Token &op) {
+    emit(compound_opcode(op));
+}
+
+void Codegen::emit_type_check(StaticType type, uint8_t slot) {
+    emit(OP_CHECK_TYPE);
+    emit(static_cast<uint8_t>(type));
+    emit(slot);
+}
+
+// The initial value of `let x: type;`
+void Codegen::emit_default_value(StaticType type) {
+    switch (type) {
+        case StaticType::Int:    emit_iconst8(0);                break;
+        case StaticType::Float:  emit_constant(0.0);             break;
+        case StaticType::Bool:   emit(OP_FALSE);                 break;
+        case StaticType::String: emit_constant(std::string("")); break;
+        default:                 emit(OP_NULL);                  break;
+    }
+}
+
+// Adds (OP_ADD) or subtracts (OP_SUB) one from the value on top of the stack,
+// which is known to be of `type`; returns the type of the result
+StaticType Codegen::emit_step(OpCode op, StaticType type) {
+    if (type == StaticType::Float) {
+        emit_constant(1.0);
+    } else {
+        emit_iconst8(1);
+    }
+
+    emit_arithmetic(op, type);
+    return is_numeric(type) ? type : StaticType::Any;
+}
+
+// Emits the typed form of `op` when its operands are known to be of `operands`
+void Codegen::emit_arithmetic(OpCode op, StaticType operands) {
+    OpCode typed = typed_opcode(op, operands);
+    if (typed != op) stats->specialized_sites++;
+    emit(typed);
+}
+
+// The type an expression is known to evaluate to, or Any
+StaticType Codegen::static_type_of(const Expr &expr) {
+    if (auto lit = std::get_if<LiteralExpr>(&expr)) {
+        const Value &v = lit->literal;
+        if (v.is_int())    return StaticType::Int;
+        if (v.is_float())  return StaticType::Float;
+        if (v.is_bool())   return StaticType::Bool;
+        if (v.is_string()) return StaticType::String;
+        return StaticType::Any;
+    }
+
+    if (auto group = std::get_if<GroupingExpr>(&expr)) {
+        return static_type_of(*group->grouped);
+    }
+
+    if (auto var = std::get_if<VariableExpr>(&expr)) {
+        return variable_type(var->name, var);
+    }
+
+    if (auto assign = std::get_if<AssignExpr>(&expr)) {
+        StaticType type = declared_type(assign->name);
+        if (type != StaticType::Any) return type;
+        if (assign->op.type == TokenType::Assign) return static_type_of(*assign->value);
+        return result_type(assign->op.type, variable_type(assign->name, assign), static_type_of(*assign->value));
+    }
+
+    if (auto unary = std::get_if<UnaryExpr>(&expr)) {
+        switch (unary->op.type) {
+            case TokenType::Not:
+                return StaticType::Bool;
+            case TokenType::Minus: {
+                StaticType type = static_type_of(*unary->right);
+                return is_numeric(type) ? type : StaticType::Any;
+            }
+            case TokenType::BitNot:
+                return static_type_of(*unary->right) == StaticType::Int ? StaticType::Int : StaticType::Any;
+            case TokenType::Increment:
+            case TokenType::Decrement: {
+                auto var = std::get_if<VariableExpr>(&*unary->right);
+                StaticType type = var ? variable_type(var->name, unary) : StaticType::Any;
+                return is_numeric(type) ? type : StaticType::Any;
+            }
+            default:
+                return StaticType::Any;
+        }
+    }
+
+    if (auto postfix = std::get_if<PostfixExpr>(&expr)) {
+        auto var = std::get_if<VariableExpr>(&*postfix->left);
+        StaticType type = var ? variable_type(var->name, postfix) : StaticType::Any;
+        return is_numeric(type) ? type : StaticType::Any;
+    }
+
+    if (auto binary = std::get_if<BinaryExpr>(&expr)) {
+        return result_type(binary->op.type, static_type_of(*binary->left), static_type_of(*binary->right));
+    }
+
+    if (auto ternary = std::get_if<TernaryExpr>(&expr)) {
+        StaticType type = static_type_of(*ternary->left);
+        return type == static_type_of(*ternary->right) ? type : StaticType::Any;
+    }
+
+    return StaticType::Any;
+}
+
+// Type of a variable where `site` reads or updates it: the declared type, or the
+// one type inference proved for a local of this function. Globals are never
+// trusted (see global_types).
+StaticType Codegen::variable_type(const Token &name, const void *site) {
+    auto res = resolve_variable(name);
+    if (res.static_type != StaticType::Any || res.type != ScopeManager::VarType::Local) return res.static_type;
+
+    return scopes->inference.type_at(site);
+}
+
+// Type every store to the variable is checked against
+StaticType Codegen::declared_type(const Token &name) {
+    auto res = resolve_variable(name);
+    if (res.type != ScopeManager::VarType::Global) return res.static_type;
+
+    auto it = global_types->find(name.value);
+    return it != global_types->end() ? it->second : StaticType::Any;
+}
+
+// Generates `expr` and makes sure the value it leaves on the stack is of `type`,
+// widening ints to float where needed
+void Codegen::generate_typed(const Expr &expr, StaticType type) {
+    StaticType actual = static_type_of(expr);
+
+    auto lit = std::get_if<LiteralExpr>(&expr);
+    if (type == StaticType::Float && lit && lit->literal.is_int()) {
+        emit_constant(static_cast<double>(lit->literal.as_int()));
+        return;
+    }
+
+    generate(expr);
+    if (type != StaticType::Any && actual != type) {
+        emit_type_check(type);
+    }
+}
+
 int Codegen::emit_jump(OpCode op) {
     emit(op);
     emit(static_cast<uint16_t>(0xFFFF)); // placeholder
@@ -211,13 +508,23 @@ void Codegen::define_variable(const Token &name) {
     emit(name_idx);
 }
 
+// Slot of `self.field` in a method of a struct whose layout has the field, or -1
+int Codegen::self_slot(const Expr &target, const std::string &field) {
+    if (!std::holds_alternative<SelfExpr>(target)) return -1;
+
+    const auto &fields = scopes->self_fields;
+    auto it = std::find(fields.begin(), fields.end(), field);
+    return it != fields.end() ? static_cast<int>(it - fields.begin()) : -1;
+}
+
 void Codegen::emit_closure(const Function::Ptr &func, const std::vector<ScopeManager::Upvalue> &upvalues) {
-    uint16_t func_idx = make_constant(func);
+    uint16_t func_idx = curr->chunk.add_function(func);
     emit(OP_CLOSURE);
     emit(func_idx);
 
+    // descriptor kind: 0/1 share an enclosing upvalue/local, 2/3 copy an enclosing capture/local
     for (const auto &upvalue : upvalues) {
-        emit(static_cast<uint8_t>(upvalue.is_local ? 1 : 0));
+        emit(static_cast<uint8_t>((upvalue.by_value ? 2 : 0) + (upvalue.is_local ? 1 : 0)));
         emit(static_cast<uint8_t>(upvalue.index));
     }
 }
@@ -235,15 +542,25 @@ void Codegen::generate_disp(const DispStmt &stmt) {
 void Codegen::generate_let(const LetStmt &stmt) {
     declare_variable(stmt.name);
     if (stmt.initializer) {
-        generate(*stmt.initializer);   // push initializer value
+        generate_typed(*stmt.initializer, stmt.type); // push initializer value
+    } else {
+        emit_default_value(stmt.type); // null, or the zero value of the declared type
+    }
+
+    if (scopes->depth() > 0) {
+        scopes->locals.back().type = stmt.type;
+    } else if (stmt.type != StaticType::Any) {
+        (*global_types)[stmt.name.value] = stmt.type;
     } else {
-        emit(OP_NULL);    // push default null value
+        global_types->erase(stmt.name.value);
     }
 
     define_variable(stmt.name);
 }
 
 void Codegen::generate_block(const BlockStmt &stmt) {
+    if (generate_counted_loop(stmt)) return;
+
     begin_scope();
 
     for (const auto &s : *stmt.statements) {
@@ -284,39 +601,192 @@ void Codegen::generate_while(const WhileStmt &stmt) {
     emit(OP_POP); // pop condition value
 }
 
-void Codegen::generate_foreach(const ForEachStmt &stmt) {
-    generate(*stmt.iterable); // push iterable
-    emit(OP_GET_ITER);        // get iterator
+// Recognizes the desugared form of `for let i = a; i < b; i++ { ... }` (see desugar_for)
+// and compiles it to a FOR_PREP/FOR_LOOP pair. The limit and the step are evaluated once
+// into hidden locals, so both must be loop invariant and the body must not write the counter.
+bool Codegen::generate_counted_loop(const BlockStmt &stmt) {
+    const auto &stmts = *stmt.statements;
+    if (stmts.size() != 2) return false;
+
+    auto init = std::get_if<LetStmt>(&*stmts[0]);
+    auto loop = std::get_if<WhileStmt>(&*stmts[1]);
+    if (!init || !init->initializer || !loop) return false;
+
+    const std::string &counter = init->name.value;
+
+    // condition: counter (< | <= | > | >=) limit
+    auto cond = std::get_if<BinaryExpr>(&*loop->condition);
+    if (!cond) return false;
+
+    auto cond_var = std::get_if<VariableExpr>(&*cond->left);
+    if (!cond_var || cond_var->name.value != counter) return false;
+
+    OpCode cmp;
+    switch (cond->op.type) {
+        case TokenType::Less:         cmp = OP_LT; break;
+        case TokenType::LessEqual:    cmp = OP_LE; break;
+        case TokenType::Greater:      cmp = OP_GT; break;
+        case TokenType::GreaterEqual: cmp = OP_GE; break;
+        default: return false;
+    }
+
+    // body: { <loop body> <step>; }
+    auto body = std::get_if<BlockStmt>(&*loop->body);
+    if (!body || body->statements->size() != 2) return false;
+
+    auto step_stmt = std::get_if<ExprStmt>(&*(*body->statements)[1]);
+    if (!step_stmt) return false;
+
+    // step: counter++, ++counter, counter--, --counter, counter += step, counter -= step
+    const Expr *step = nullptr;
+    bool negate = false;
+
+    if (auto post = std::get_if<PostfixExpr>(&*step_stmt->expr)) {
+        auto var = std::get_if<VariableExpr>(&*post->left);
+        if (!var || var->name.value != counter) return false;
+        negate = post->op.type == TokenType::Decrement;
+    } else if (auto pre = std::get_if<UnaryExpr>(&*step_stmt->expr)) {
+        if (pre->op.type != TokenType::Increment && pre->op.type != TokenType::Decrement) return false;
+        auto var = std::get_if<VariableExpr>(&*pre->right);
+        if (!var || var->name.value != counter) return false;
+        negate = pre->op.type == TokenType::Decrement;
+    } else if (auto assign = std::get_if<AssignExpr>(&*step_stmt->expr)) {
+        if (assign->name.value != counter) return false;
+        if (assign->op.type != TokenType::PlusEqual && assign->op.type != TokenType::MinusEqual) return false;
+        step = assign->value.get();
+        negate = assign->op.type == TokenType::MinusEqual;
+    } else {
+        return false;
+    }
+
+    const Stmt &loop_body = *(*body->statements)[0];
+
+    MutationScanner mutated;
+    mutated.scan(loop_body);
+    if (mutated.mutates(counter)) return false;
+    if (!is_loop_invariant(*cond->right, mutated, counter)) return false;
+    if (step && !is_loop_invariant(*step, mutated, counter)) return false;
 
     begin_scope();
 
+    generate_let(*init);
+    uint8_t slot = static_cast<uint8_t>(scopes->locals.size() - 1);
+
+    // hidden locals: limit at slot + 1, step at slot + 2
+    declare_variable(Token(TokenType::Identifier, "(for limit)", init->name.line));
+    generate(*cond->right);
+    mark_initialized();
+
+    // the step must keep a typed counter's type
+    StaticType counter_type = scopes->locals[slot].type;
+    declare_variable(Token(TokenType::Identifier, "(for step)", init->name.line));
+    if (step) {
+        generate_typed(*step, counter_type);
+        if (negate) emit(OP_NEG);
+    } else if (counter_type == StaticType::Float) {
+        emit_constant(negate ? -1.0 : 1.0);
+    } else {
+        emit_iconst8(negate ? -1 : 1);
+    }
+    mark_initialized();
+
+    emit(OP_FOR_PREP);
+    emit(slot);
+    emit(static_cast<uint8_t>(cmp));
+    emit(static_cast<uint16_t>(0xFFFF)); // placeholder
+    int exit_jump = static_cast<int>(curr->chunk.code.size()) - 2;
+
     int loop_start = static_cast<int>(curr->chunk.code.size());
+    generate(loop_body);
 
-    emit(OP_ITER_NEXT);
-    int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit(OP_POP); // pop iterator result
+    emit(OP_FOR_LOOP);
+    emit(slot);
+    emit(static_cast<uint8_t>(cmp));
+    emit(static_cast<uint16_t>(loop_start - (static_cast<int>(curr->chunk.code.size()) + 2)));
+
+    patch_jump(exit_jump);
+
+    end_scope();
+    return true;
+}
+
+// Pure expressions over literals and plain locals that the loop body never writes.
+// Globals and captured locals are excluded since any call could change them.
+bool Codegen::is_loop_invariant(const Expr &expr, const MutationScanner &mutated, const std::string &counter) {
+    if (std::holds_alternative<LiteralExpr>(expr)) return true;
+
+    if (auto group = std::get_if<GroupingExpr>(&expr)) {
+        return is_loop_invariant(*group->grouped, mutated, counter);
+    }
+
+    if (auto var = std::get_if<VariableExpr>(&expr)) {
+        if (var->name.value == counter || mutated.mutates(var->name.value)) return false;
 
-    // store iterator value in loop variable
+        int local = scopes->resolve_local(var->name);
+        return local != -1 && !scopes->locals[local].is_captured;
+    }
+
+    if (auto unary = std::get_if<UnaryExpr>(&expr)) {
+        if (unary->op.type != TokenType::Minus && unary->op.type != TokenType::BitNot) return false;
+        return is_loop_invariant(*unary->right, mutated, counter);
+    }
+
+    if (auto binary = std::get_if<BinaryExpr>(&expr)) {
+        if (binary->op.type == TokenType::LeftArrow) return false;
+        return is_loop_invariant(*binary->left, mutated, counter) &&
+               is_loop_invariant(*binary->right, mutated, counter);
+    }
+
+    return false;
+}
+
+// The iteration state lives in two hidden locals: the iterable itself (slot) and the
+// position (slot + 1). The loop variable and the optional index follow them, so
+// ITER_NEXT and LOAD_ITER_INDEX can write straight into their slots.
+void Codegen::generate_foreach(const ForEachStmt &stmt) {
+    begin_scope();
+
+    size_t line = stmt.iterator.line;
+
+    declare_variable(Token(TokenType::Identifier, "(for iterable)", line));
+    generate(*stmt.iterable);
+    mark_initialized();
+    uint8_t slot = static_cast<uint8_t>(scopes->locals.size() - 1);
+
+    declare_variable(Token(TokenType::Identifier, "(for position)", line));
+    emit(OP_GET_ITER);
+    mark_initialized();
+
+    // both are rewritten by the VM on every iteration
     declare_variable(stmt.iterator);
-    emit(OP_STORE_LOCAL);
-    emit(static_cast<uint8_t>(scopes->locals.size() - 1)); // iterator variable index
+    scopes->locals.back().is_final = false;
+    emit(OP_NULL);
     mark_initialized();
 
-    // if index variable is provided
-    if (stmt.index.value != "") {
+    bool has_index = stmt.index.value != "";
+    if (has_index) {
         declare_variable(stmt.index);
-        // load current index from iterator (assumed to be on stack)
-        emit(OP_LOAD_ITER_INDEX);
-        emit(OP_STORE_LOCAL);
-        emit(static_cast<uint8_t>(scopes->locals.size() - 1)); // index variable index
+        scopes->locals.back().is_final = false;
+        emit(OP_NULL);
         mark_initialized();
     }
 
+    int loop_start = static_cast<int>(curr->chunk.code.size());
+
+    emit(OP_ITER_NEXT);
+    emit(slot);
+    emit(static_cast<uint16_t>(0xFFFF)); // placeholder
+    int exit_jump = static_cast<int>(curr->chunk.code.size()) - 2;
+
+    if (has_index) {
+        emit(OP_LOAD_ITER_INDEX);
+        emit(slot);
+    }
+
     generate(*stmt.body);
 
     emit_loop(loop_start);
     patch_jump(exit_jump);
-    emit(OP_POP); // pop iterator result
 
     end_scope();
 }
@@ -325,31 +795,29 @@ void Codegen::generate_function(const FunctionStmt &stmt) {
     declare_variable(stmt.name);
     mark_initialized();
 
-    // Start compiling nested function into a new State
-    begin_function(stmt.name.value, static_cast<int>(stmt.params.size()));
-    begin_scope();
-
-    // Declare and initialize parameters as locals in the nested state
-    for (const auto &param : stmt.params) {
-        declare_variable(param); // adds to state->Locals
-        mark_initialized();
-    }
+    // The slot is filled only after the closure is created, so a recursive
+    // reference from the body must not copy it
+    int local = (scopes->depth() > 0) ? static_cast<int>(scopes->locals.size()) - 1 : -1;
+    if (local != -1) scopes->locals[local].is_final = false;
 
-    // Compile the body of the nested function
-    for (const auto &s : *stmt.body) {
-        generate(*s);
-    }
+    if (can_compile_lazily()) {
+        emit_closure(make_lazy_function(stmt.name.value, stmt.params, stmt.body, stmt.types), {});
+    } else {
+        // Start compiling nested function into a new State
+        begin_function(stmt.name.value, static_cast<int>(stmt.params.size()));
+        generate_function_body(stmt.params, *stmt.body, stmt.types);
 
-    end_scope();
+        // Capture the upvalues from the nested function's scope manager
+        auto nested_upvalues = scopes->upvalues;
 
-    // Capture the upvalues from the nested function's scope manager
-    auto nested_upvalues = scopes->upvalues;
+        // Finish the nested function and retrieve the completed FunctionPtr.
+        auto finished_func = end_function();
 
-    // Finish the nested function and retrieve the completed FunctionPtr.
-    auto finished_func = end_function();
+        // Emit the closure creation in the enclosing function
+        emit_closure(finished_func, nested_upvalues);
+    }
 
-    // Emit the closure creation in the enclosing function
-    emit_closure(finished_func, nested_upvalues);
+    if (local != -1) scopes->locals[local].is_final = !scopes->mutations.mutates(stmt.name.value);
 
     // Finally, define the function name in the parent scope (local or global)
     define_variable(stmt.name);
@@ -357,9 +825,12 @@ void Codegen::generate_function(const FunctionStmt &stmt) {
 
 void Codegen::generate_return(const ReturnStmt &stmt) {
     if (stmt.value) {
-        generate(*stmt.value); // push return value
+        generate_typed(*stmt.value, scopes->return_type); // push return value
     } else {
         emit(OP_NULL); // default return value
+        if (scopes->return_type != StaticType::Any) {
+            emit_type_check(scopes->return_type);
+        }
     }
 
     emit(OP_RETURN);
@@ -380,36 +851,45 @@ void Codegen::generate_struct(const StructStmt &stmt) {
     emit(OP_LOAD_GLOBAL);
     emit(name_idx);
 
-    for (const auto &m : stmt.methods) {
-        auto method = std::get<FunctionStmt>(*m);
+    // The instance layout: every field the methods assign through `self`, those
+    // assigned by init first
+    MutationScanner writes;
+    for (bool init : { true, false }) {
+        for (const auto &m : stmt.methods) {
+            if ((std::get<FunctionStmt>(*m).name.value == "init") == init) writes.scan(*m);
+        }
+    }
 
-        declare_variable(method.name);
+    std::vector<std::string> fields = writes.self_fields;
+    if (fields.size() > 256) fields.resize(256);
 
-        // Compile method function
-        begin_function(method.name.value, static_cast<int>(method.params.size()), true);
-        begin_scope();
+    for (const auto &field : fields) {
+        emit(OP_FIELD);
+        emit(make_constant(field));
+    }
 
-        // Declare and initialize parameters as locals in the method
-        for (const auto &param : method.params) {
-            declare_variable(param); // adds to state->Locals
-            mark_initialized();
-        }
+    for (const auto &m : stmt.methods) {
+        auto method = std::get<FunctionStmt>(*m);
 
-        // Compile the body of the method
-        for (const auto &s : *method.body) {
-            generate(*s);
-        }
+        declare_variable(method.name);
 
-        end_scope();
+        if (can_compile_lazily()) {
+            emit_closure(make_lazy_function(method.name.value, method.params, method.body, method.types, true, fields), {});
+        } else {
+            // Compile method function
+            begin_function(method.name.value, static_cast<int>(method.params.size()), true);
+            scopes->self_fields = fields;
+            generate_function_body(method.params, *method.body, method.types);
 
-        // Capture the upvalues from the method's scope manager
-        auto method_upvalues = scopes->upvalues;
+            // Capture the upvalues from the method's scope manager
+            auto method_upvalues = scopes->upvalues;
 
-        // Finish the method function and retrieve the completed FunctionPtr.
-        auto finished_method = end_function(method.name.value == "init");
+            // Finish the method function and retrieve the completed FunctionPtr.
+            auto finished_method = end_function(method.name.value == "init");
 
-        // Emit the closure creation for the method
-        emit_closure(finished_method, method_upvalues);
+            // Emit the closure creation for the method
+            emit_closure(finished_method, method_upvalues);
+        }
 
         uint16_t method_name_idx = make_constant(method.name.value);
         emit(OP_METHOD);
@@ -531,30 +1011,11 @@ void Codegen::generate_binary(const BinaryExpr &expr) {
         }
     }
 
-    generate(*expr.left);
-    generate(*expr.right);
+    StaticType operands = operand_type(expr.op.type, static_type_of(*expr.left), static_type_of(*expr.right));
 
-    switch (expr.op.type) {
-        case TokenType::Plus:          emit(OP_ADD);         break;
-        case TokenType::Minus:         emit(OP_SUB);         break;
-        case TokenType::Mult:          emit(OP_MUL);         break;
-        case TokenType::Div:           emit(OP_DIV);         break;
-        case TokenType::Mod:           emit(OP_MOD);         break;
-        case TokenType::Greater:       emit(OP_GT);          break;
-        case TokenType::Less:          emit(OP_LT);          break;
-        case TokenType::GreaterEqual:  emit(OP_GE);          break;
-        case TokenType::LessEqual:     emit(OP_LE);          break;
-        case TokenType::Equal:         emit(OP_EQ);          break;
-        case TokenType::NotEqual:      emit(OP_NEQ);         break;
-        case TokenType::BitOr:         emit(OP_BIT_OR);      break;
-        case TokenType::BitAnd:        emit(OP_BIT_AND);     break;
-        case TokenType::BitXor:        emit(OP_BIT_XOR);     break;
-        case TokenType::BitShiftLeft:  emit(OP_SHIFT_LEFT);  break;
-        case TokenType::BitShiftRight: emit(OP_SHIFT_RIGHT); break;
-        case TokenType::LeftArrow:     emit(OP_SEND_PIPE);   break;
-        default:
-            throw std::runtime_error("Unknown binary operator in codegen: " + expr.op.value);
-    }
+    generate_typed(*expr.left, operands);
+    generate_typed(*expr.right, operands);
+    emit_arithmetic(binary_opcode(expr.op), operands);
 }
 
 void Codegen::generate_logical(const LogicalExpr &expr) {
@@ -635,9 +1096,7 @@ void Codegen::generate_unary(const UnaryExpr &expr) {
             auto op_type = expr.op.type == TokenType::Increment ? OP_ADD : OP_SUB;
             if (auto var = std::get_if<VariableExpr>(&*expr.right)) {
                 emit_load_var(var->name);
-                emit_iconst8(1);
-                emit(op_type);
-                emit_store_var(var->name);
+                emit_store_var(var->name, emit_step(op_type, variable_type(var->name, &expr)));
             }
             else if (auto idx = std::get_if<IndexExpr>(&*expr.right)) {
                 generate(*idx->target);
@@ -652,12 +1111,15 @@ void Codegen::generate_unary(const UnaryExpr &expr) {
                 generate(*dot->target);
                 emit(OP_DUP);
                 uint16_t field_idx = make_constant(dot->key.value);
-                emit(OP_LOAD_FIELD);
+                int slot = self_slot(*dot->target, dot->key.value);
+                emit(slot >= 0 ? OP_LOAD_SLOT : OP_LOAD_FIELD);
                 emit(field_idx);
+                if (slot >= 0) emit(static_cast<uint8_t>(slot));
                 emit_iconst8(1);
                 emit(op_type);
-                emit(OP_STORE_FIELD);
+                emit(slot >= 0 ? OP_STORE_SLOT : OP_STORE_FIELD);
                 emit(field_idx);
+                if (slot >= 0) emit(static_cast<uint8_t>(slot));
             }
             else {
                 throw std::runtime_error("Invalid target for unary operator");
@@ -680,9 +1142,7 @@ void Codegen::generate_postfix(const PostfixExpr &expr) {
     if (auto var = std::get_if<VariableExpr>(&*expr.left)) {
         emit_load_var(var->name);
         emit(OP_DUP);
-        emit_iconst8(1);
-        emit(op_type);
-        emit_store_var(var->name);
+        emit_store_var(var->name, emit_step(op_type, variable_type(var->name, &expr)));
         emit(OP_POP);
     }
     else if (auto idx = std::get_if<IndexExpr>(&*expr.left)) {
@@ -700,13 +1160,16 @@ void Codegen::generate_postfix(const PostfixExpr &expr) {
         generate(*dot->target);
         emit(OP_DUP);
         uint16_t field_idx = make_constant(dot->key.value);
+        int slot = self_slot(*dot->target, dot->key.value);
         std::cout << "Generating dot access for field: " << dot->key.value << " (const idx " << field_idx << ")\n";
-        emit(OP_LOAD_FIELD);
+        emit(slot >= 0 ? OP_LOAD_SLOT : OP_LOAD_FIELD);
         emit(field_idx);
+        if (slot >= 0) emit(static_cast<uint8_t>(slot));
         emit_iconst8(1);
         emit(op_type);
-        emit(OP_STORE_FIELD);
+        emit(slot >= 0 ? OP_STORE_SLOT : OP_STORE_FIELD);
         emit(field_idx);
+        if (slot >= 0) emit(static_cast<uint8_t>(slot));
         emit_iconst8(1);
         emit(op_type == OP_ADD ? OP_SUB : OP_ADD); // reverse the operation to get original value
     }
@@ -740,33 +1203,46 @@ void Codegen::generate_grouping(const GroupingExpr &expr) {
 
 void Codegen::generate_assign(const AssignExpr &expr) {
     if (expr.op.type == TokenType::Assign) {
-        generate(*expr.value);             // push RHS
-    } else {
-        emit_load_var(expr.name);          // push LHS value
-        generate(*expr.value);             // push RHS
-        emit_compound_op(expr.op);         // apply +, -, *, / etc.
+        StaticType type = declared_type(expr.name);
+        generate_typed(*expr.value, type); // push RHS
+        emit_store_var(expr.name, type);
+        return;
     }
 
-    emit_store_var(expr.name);
+    StaticType lhs = variable_type(expr.name, &expr);
+    StaticType rhs = static_type_of(*expr.value);
+    StaticType operands = operand_type(expr.op.type, lhs, rhs);
+
+    emit_load_var(expr.name);              // push LHS value
+    if (operands == StaticType::Float && lhs == StaticType::Int) {
+        emit_type_check(operands);         // widen to float
+    }
+    generate_typed(*expr.value, operands); // push RHS
+    emit_arithmetic(compound_opcode(expr.op), operands); // apply +, -, *, / etc.
+
+    emit_store_var(expr.name, result_type(expr.op.type, lhs, rhs));
 }
 
 void Codegen::generate_set_dot(const SetDotExpr &expr) {
     generate(*expr.target);                // push container
 
     uint16_t field_idx = make_constant(expr.key.value);
+    int slot = self_slot(*expr.target, expr.key.value);
 
     if (expr.op.type == TokenType::Assign) {
         generate(*expr.value);             // push RHS
     } else {
         emit(OP_DUP);              // duplicate container for reload
-        emit(OP_LOAD_FIELD);       // load container.key
+        emit(slot >= 0 ? OP_LOAD_SLOT : OP_LOAD_FIELD); // load container.key
         emit(field_idx);
+        if (slot >= 0) emit(static_cast<uint8_t>(slot));
         generate(*expr.value);             // push RHS
         emit_compound_op(expr.op);         // apply op
     }
 
-    emit(OP_STORE_FIELD);          // container.key = value
+    emit(slot >= 0 ? OP_STORE_SLOT : OP_STORE_FIELD); // container.key = value
     emit(field_idx);
+    if (slot >= 0) emit(static_cast<uint8_t>(slot));
 }
 
 void Codegen::generate_set_index(const SetIndexExpr &expr) {
@@ -786,7 +1262,17 @@ void Codegen::generate_set_index(const SetIndexExpr &expr) {
 }
 
 void Codegen::generate_call(const CallExpr &expr) {
-    generate(*expr.callee);          // push function
+    // `(fn (...) { ... })(...)` is called right away and never escapes
+    const Expr *callee = expr.callee.get();
+    while (auto group = std::get_if<GroupingExpr>(callee)) {
+        callee = group->grouped.get();
+    }
+
+    if (auto lambda = std::get_if<LambdaExpr>(callee)) {
+        generate_lambda(*lambda, true);
+    } else {
+        generate(*expr.callee);      // push function
+    }
 
     for (const auto &arg : expr.args) {
         generate(*arg);              // push arguments in order
@@ -805,16 +1291,17 @@ void Codegen::generate_array(const ArrayExpr &expr) {
     emit(static_cast<uint16_t>(expr.elements.size()));
 }
 
+// The keys of a literal are known here, so they go into a template constant
+// and only the values are pushed
 void Codegen::generate_object(const ObjectExpr &expr) {
+    std::vector<Value> keys;
     for (auto &[key, val] : expr.items) {
         generate(*val);              // push value
-        uint16_t key_idx = make_constant(key);
-        emit(OP_CONST); // push key
-        emit(key_idx);
+        keys.push_back(key);
     }
 
-    emit(OP_MAKE_OBJECT);
-    emit(static_cast<uint16_t>(expr.items.size()));
+    emit(OP_MAKE_OBJECT_FROM_TEMPLATE);
+    emit(make_constant(std::make_shared<Array>(keys)));
 }
 
 void Codegen::generate_index(const IndexExpr &expr) {
@@ -826,6 +1313,14 @@ void Codegen::generate_index(const IndexExpr &expr) {
 void Codegen::generate_dot(const DotExpr &expr) {
     generate(*expr.target);         // push container
     uint16_t field_idx = make_constant(expr.key.value);
+
+    if (int slot = self_slot(*expr.target, expr.key.value); slot >= 0) {
+        emit(OP_LOAD_SLOT);         // push self.key from its slot
+        emit(field_idx);
+        emit(static_cast<uint8_t>(slot));
+        return;
+    }
+
     emit(OP_LOAD_FIELD);    // push container.key
     emit(field_idx);
 }
@@ -844,23 +1339,17 @@ void Codegen::generate_ternary(const TernaryExpr &expr) {
     patch_jump(jump_end);
 }
 
-void Codegen::generate_lambda(const LambdaExpr &expr) {
-    // Start compiling nested function into a new State
-    begin_function("_", static_cast<int>(expr.params.size()));
-    begin_scope();
-
-    // Declare and initialize parameters as locals in the nested state
-    for (const auto &param : expr.params) {
-        declare_variable(param); // adds to state->Locals
-        mark_initialized();
-    }
-
-    // Compile the body of the nested function
-    for (const auto &s : *expr.body) {
-        generate(*s);
+void Codegen::generate_lambda(const LambdaExpr &expr, bool is_inline) {
+    // an immediately invoked lambda runs right away, so deferring it gains nothing
+    if (!is_inline && can_compile_lazily()) {
+        emit_closure(make_lazy_function("_", expr.params, expr.body, expr.types), {});
+        return;
     }
 
-    end_scope();
+    // Start compiling nested function into a new State
+    begin_function("_", static_cast<int>(expr.params.size()));
+    scopes->is_inline = is_inline;
+    generate_function_body(expr.params, *expr.body, expr.types);
 
     // Capture the upvalues from the nested function's scope manager
     auto nested_upvalues = scopes->upvalues;
@@ -878,6 +1367,8 @@ void Codegen::generate_self(const SelfExpr &expr) {
 
 void Codegen::generate_spawn(const SpawnExpr &expr) {
     begin_function("lambda_spawn", 0);
+    scopes->mutations.scan(*expr.statements);
+    scopes->inference.analyze_function({}, {}, *expr.statements);
     begin_scope();
 
     for (const auto &s : *expr.statements) {
@@ -905,7 +1396,7 @@ void Codegen::disassemble_function(const Function::Ptr &func) {
     std::cout << "Arity: " << func->arity << ", Upvalues: " << func->upvalue_count << "\n";
     
     const auto &code = func->chunk.code;
-    const auto &constants = func->chunk.constants;
+    const auto &constants = *func->chunk.constants;
     
     for (size_t i = 0; i < code.size(); ) {
         printf("%04zu ", i);
@@ -924,11 +1415,12 @@ void Codegen::disassemble_function(const Function::Ptr &func) {
             case OP_DEFINE_GLOBAL:
             case OP_LOAD_FIELD:
             case OP_STORE_FIELD:
-            case OP_CLOSURE:
             case OP_STRUCT:
             case OP_METHOD:
+            case OP_FIELD:
             case OP_MAKE_ARRAY:
-            case OP_MAKE_OBJECT: {
+            case OP_MAKE_OBJECT:
+            case OP_MAKE_OBJECT_FROM_TEMPLATE: {
                 if (i + 1 < code.size()) {
                     uint16_t idx = (static_cast<uint16_t>(code[i]) << 8) | code[i + 1];
                     printf(" #%u", idx);
@@ -939,12 +1431,39 @@ void Codegen::disassemble_function(const Function::Ptr &func) {
                 }
                 break;
             }
+            case OP_CONST_LONG: {
+                if (i + 2 < code.size()) {
+                    uint32_t idx = (static_cast<uint32_t>(code[i]) << 16) | (code[i + 1] << 8) | code[i + 2];
+                    printf(" #%u", idx);
+                    if (idx < constants.size()) {
+                        std::cout << " (" << constants[idx] << ")";
+                    }
+                    i += 3;
+                }
+                break;
+            }
+            case OP_CLOSURE: {
+                if (i + 1 < code.size()) {
+                    uint16_t idx = (static_cast<uint16_t>(code[i]) << 8) | code[i + 1];
+                    printf(" #%u", idx);
+                    i += 2;
+                    if (idx < func->chunk.functions.size()) {
+                        auto nested = func->chunk.functions[idx].as_function();
+                        std::cout << " " << nested->to_string();
+                        if (nested->compile_body) std::cout << " (lazy)";
+                        i += 2 * nested->upvalue_count; // (is_local, index) pairs
+                    }
+                }
+                break;
+            }
             case OP_LOAD_LOCAL:
             case OP_STORE_LOCAL:
             case OP_LOAD_UPVALUE:
             case OP_STORE_UPVALUE:
+            case OP_LOAD_CAPTURE:
             case OP_CALL:
             case OP_ICONST8:
+            case OP_LOAD_ITER_INDEX:
             case OP_SELECT_BEGIN: {
                 if (i < code.size()) {
                     printf(" %u", code[i]);
@@ -965,6 +1484,52 @@ void Codegen::disassemble_function(const Function::Ptr &func) {
                 }
                 break;
             }
+            case OP_FOR_PREP:
+            case OP_FOR_LOOP: {
+                if (i + 3 < code.size()) {
+                    int16_t offset = static_cast<int16_t>((static_cast<uint16_t>(code[i + 2]) << 8) | code[i + 3]);
+                    printf(" slot:%u %s %d", code[i], opcode_to_string(static_cast<OpCode>(code[i + 1])).c_str(), offset);
+                    i += 4;
+                }
+                break;
+            }
+            case OP_LOAD_ENCLOSING:
+            case OP_STORE_ENCLOSING: {
+                if (i + 1 < code.size()) {
+                    printf(" depth:%u slot:%u", code[i], code[i + 1]);
+                    i += 2;
+                }
+                break;
+            }
+            case OP_LOAD_SLOT:
+            case OP_STORE_SLOT: {
+                if (i + 2 < code.size()) {
+                    uint16_t idx = (static_cast<uint16_t>(code[i]) << 8) | code[i + 1];
+                    printf(" #%u", idx);
+                    if (idx < constants.size()) {
+                        std::cout << " (" << constants[idx] << ")";
+                    }
+                    printf(" slot:%u", code[i + 2]);
+                    i += 3;
+                }
+                break;
+            }
+            case OP_CHECK_TYPE: {
+                if (i + 1 < code.size()) {
+                    std::cout << " " << static_type_name(static_cast<StaticType>(code[i]));
+                    if (code[i + 1] != 0xFF) printf(" slot:%u", code[i + 1]);
+                    i += 2;
+                }
+                break;
+            }
+            case OP_ITER_NEXT: {
+                if (i + 2 < code.size()) {
+                    uint16_t offset = (static_cast<uint16_t>(code[i + 1]) << 8) | code[i + 2];
+                    printf(" slot:%u %u", code[i], offset);
+                    i += 3;
+                }
+                break;
+            }
             case OP_SELECT_RECV: {
                 if (i + 2 <= code.size()) {
                     uint16_t offset = (static_cast<uint16_t>(code[i]) << 8) | code[i + 1];
@@ -0,0 +1,496 @@
+#include "jit.hpp"
+#include "vm.hpp"
+
+#include <cstring>
+#include <sys/mman.h>
+
+ExecutableMemory::ExecutableMemory(const std::vector<uint8_t> &code)
+    : ExecutableMemory(code.size(), [&](uint8_t *memory) { std::memcpy(memory, code.data(), code.size()); }) {}
+
+ExecutableMemory::ExecutableMemory(size_t size, const std::function<void(uint8_t *memory)> &fill) : size(size) {
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("Could not allocate memory for native code");
+    }
+
+    fill(static_cast<uint8_t *>(mem));
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        throw std::runtime_error("Could not make native code executable");
+    }
+
+    memory = static_cast<uint8_t *>(mem);
+}
+
+ExecutableMemory::~ExecutableMemory() {
+    if (memory) munmap(memory, size);
+}
+
+namespace jit {
+
+bool parse_mode(const std::string &name, Mode &mode) {
+    if (name == "off")           mode = Mode::Off;
+    else if (name == "baseline") mode = Mode::Baseline;
+    else if (name == "stencil")  mode = Mode::Stencil;
+    else if (name == "trace")    mode = Mode::Trace;
+    else return false;
+
+    return true;
+}
+
+const ValueTags &value_tags() {
+    static const ValueTags tags = [] {
+        static_assert(sizeof(Value) == 2 * sizeof(void *), "templates address a Value as tag + payload");
+
+        auto word = [](const Value &v, size_t i) {
+            uint64_t w;
+            std::memcpy(&w, reinterpret_cast<const char *>(&v) + i * sizeof(w), sizeof(w));
+            return w;
+        };
+
+        Value a(0x5a5a5a5a), b(-7), t(true), f(false), null;
+        bool inline_ints = word(a, 0) == word(b, 0) && static_cast<uint32_t>(word(a, 1)) == 0x5a5a5a5a &&
+                           static_cast<int32_t>(word(b, 1)) == -7;
+        bool inline_bools = word(t, 0) == word(f, 0) && (word(t, 1) & 0xff) == 1 && (word(f, 1) & 0xff) == 0;
+
+        ValueTags probed;
+        if (inline_ints && inline_bools && word(null, 0) == 0 && word(a, 0) != word(t, 0)) {
+            probed.int_tag = reinterpret_cast<const void *>(word(a, 0));
+            probed.bool_tag = reinterpret_cast<const void *>(word(t, 0));
+        }
+        return probed;
+    }();
+
+    return tags;
+}
+
+bool NativeCode::enter(VM &vm, int ip) const {
+    if (ip < 0 || static_cast<size_t>(ip) >= entries.size() || entries[ip] < 0) return false;
+
+    GreenThread &thread = *vm.current_thread;
+    CallFrame &frame = thread.frames.back();
+    NativeFrame native { thread.stack.data(), &thread.stack_size, thread.stack.size(),
+                         thread.stack.data() + frame.base, &frame.ip, &thread.budget, value_tags() };
+
+    // the prologue at offset 0 saves what it uses, loads the frame and jumps to the entry
+    using Entry = void (*)(VM *vm, const uint8_t *target, NativeFrame *frame);
+    auto entry = reinterpret_cast<Entry>(code.memory);
+    entry(&vm, code.memory + entries[ip], &native);
+    return true;
+}
+
+#if defined(__x86_64__)
+
+// The fixed templates. Registers: rbx holds the VM for the whole run, rbp the
+// NativeFrame, r12 the stack, r13 the stack size's address, r14 the locals and
+// r15 the int tag; rdi/esi/edx carry the helper arguments. The stack size stays
+// in memory, where helpers update it.
+struct Assembler : X86Assembler {
+    static constexpr Reg FRAME = EBP, STACK = R12, SIZE = R13, LOCALS = R14, INT_TAG = R15;
+    static constexpr int32_t PAYLOAD = sizeof(void *); // a Value's storage, after its tag
+    static constexpr size_t CAPACITY = std::tuple_size<decltype(GreenThread::stack)>::value;
+
+    std::vector<std::pair<size_t, int>> branch_fixups; // rel32 position, bytecode target
+    std::vector<size_t> exit_fixups;                   // rel32 positions jumping to the exit
+    std::vector<size_t> guards;                        // the current template's jumps to its slow path
+
+    void prologue() {
+        bytes({ 0x53 });                   // push rbx
+        bytes({ 0x55 });                   // push rbp
+        bytes({ 0x41, 0x54 });             // push r12
+        bytes({ 0x41, 0x55 });             // push r13
+        bytes({ 0x41, 0x56 });             // push r14
+        bytes({ 0x41, 0x57 });             // push r15
+        bytes({ 0x48, 0x83, 0xec, 0x08 }); // sub rsp, 8 (keeps calls 16-byte aligned)
+        bytes({ 0x48, 0x89, 0xfb });       // mov rbx, rdi
+        bytes({ 0x48, 0x89, 0xd5 });       // mov rbp, rdx
+        load64(STACK, FRAME, offsetof(NativeFrame, stack));
+        load64(SIZE, FRAME, offsetof(NativeFrame, stack_size));
+        load64(LOCALS, FRAME, offsetof(NativeFrame, locals));
+        load64(INT_TAG, FRAME, offsetof(NativeFrame, tags) + offsetof(ValueTags, int_tag));
+        bytes({ 0xff, 0xe6 });             // jmp rsi
+    }
+
+    void call_helper(Helper helper, uint32_t pc, uint32_t next) {
+        bytes({ 0x48, 0x89, 0xdf }); // mov rdi, rbx
+        mov_imm(ESI, pc);
+        mov_imm(EDX, next);
+        call_abs(reinterpret_cast<const void *>(helper));
+    }
+
+    void branch_if_taken(int target) {
+        bytes({ 0x83, 0xf8, BRANCH }); // cmp eax, BRANCH
+        branch_fixups.emplace_back(jcc(EQ), target);
+    }
+
+    void exit_unless_next() {
+        test_eax();
+        exit_fixups.push_back(jcc(NE));
+    }
+
+    // The whole instruction through its helper
+    void run_helper(Helper helper, uint32_t pc, uint32_t next, int target) {
+        call_helper(helper, pc, next);
+        if (target >= 0) branch_if_taken(target);
+        exit_unless_next();
+    }
+
+    void write_ip(uint32_t ip) {
+        load64(ECX, FRAME, offsetof(NativeFrame, ip));
+        mem({ 0xc7 }, false, 0, ECX, 0); // mov dword [rcx], ip
+        u32(ip);
+    }
+
+    void epilogue() {
+        bytes({ 0x48, 0x83, 0xc4, 0x08 }); // add rsp, 8
+        bytes({ 0x41, 0x5f });             // pop r15
+        bytes({ 0x41, 0x5e });             // pop r14
+        bytes({ 0x41, 0x5d });             // pop r13
+        bytes({ 0x41, 0x5c });             // pop r12
+        bytes({ 0x5d });                   // pop rbp
+        bytes({ 0x5b });                   // pop rbx
+        bytes({ 0xc3 });                   // ret
+    }
+
+    void load64(Reg r, Reg base, int32_t disp)  { mem({ 0x8b }, true, r, base, disp); } // mov r64, [base + disp]
+    void store64(Reg base, int32_t disp, Reg r) { mem({ 0x89 }, true, r, base, disp); } // mov [base + disp], r64
+
+    void guard(Cond cc) { guards.push_back(jcc(cc)); }
+
+    // rax = stack size, rdx = &stack[size], just past the top
+    void load_top() {
+        load64(EAX, SIZE, 0);
+        reg_reg({ 0x8b }, true, EDX, EAX);            // mov rdx, rax
+        reg_reg({ 0xc1 }, true, 4, EDX);              // shl rdx, 4
+        code.push_back(4);
+        reg_reg({ 0x01 }, true, STACK, EDX);          // add rdx, r12
+    }
+
+    void need(int8_t values) {                        // cmp rax, values
+        reg_reg({ 0x83 }, true, 7, EAX);
+        code.push_back(static_cast<uint8_t>(values));
+        guard(LT);
+    }
+
+    void room() {                                     // cmp rax, CAPACITY
+        bytes({ 0x48, 0x3d });
+        u32(static_cast<uint32_t>(CAPACITY));
+        guard(GE);
+    }
+
+    void grow(int by) { mem({ 0xff }, true, by > 0 ? 0 : 1, SIZE, 0); } // inc/dec qword [r13]
+
+    // the local's slot must lie below the top, as VM::execute checks
+    void local_in_range(int32_t disp) {
+        mem({ 0x8d }, true, ESI, LOCALS, disp);       // lea rsi, [r14 + disp]
+        reg_reg({ 0x39 }, true, EDX, ESI);            // cmp rsi, rdx
+        guard(AE);
+    }
+
+    void is_int(Reg base, int32_t disp) {             // cmp [base + disp], r15
+        mem({ 0x39 }, true, INT_TAG, base, disp);
+        guard(NE);
+    }
+
+    void cmp_bool_tag(Reg r) {                        // cmp r, [rbp + bool_tag]
+        mem({ 0x3b }, true, r, FRAME, offsetof(NativeFrame, tags) + offsetof(ValueTags, bool_tag));
+    }
+
+    // Ints and bools copy as plain bytes
+    void is_scalar(Reg base, int32_t disp) {
+        load64(ECX, base, disp);
+        reg_reg({ 0x39 }, true, INT_TAG, ECX);        // cmp rcx, r15
+        size_t done = jcc(EQ);
+        cmp_bool_tag(ECX);
+        guard(NE);
+        patch_rel32(done, size());
+    }
+
+    // Null, int and bool slots own nothing, so they can be written over as is.
+    // Slots above the top may still hold a popped value.
+    void overwritable(Reg base, int32_t disp) {
+        load64(ESI, base, disp);
+        reg_reg({ 0x85 }, true, ESI, ESI);            // test rsi, rsi
+        size_t empty = jcc(EQ);
+        reg_reg({ 0x39 }, true, INT_TAG, ESI);        // cmp rsi, r15
+        size_t scalar = jcc(EQ);
+        cmp_bool_tag(ESI);
+        guard(NE);
+        patch_rel32(empty, size());
+        patch_rel32(scalar, size());
+    }
+
+    void copy(Reg to, int32_t to_disp, Reg from, int32_t from_disp) {
+        load64(ECX, from, from_disp);
+        store64(to, to_disp, ECX);
+        load64(ECX, from, from_disp + PAYLOAD);
+        store64(to, to_disp + PAYLOAD, ECX);
+    }
+
+    enum Scalar { Null, Int, Bool };
+
+    void push_scalar(Scalar type, int32_t payload) {
+        load_top();
+        room();
+        overwritable(EDX, 0);
+        if (type == Null) {
+            mem({ 0xc7 }, true, 0, EDX, 0);           // mov qword [rdx], 0
+            u32(0);
+        } else if (type == Int) {
+            store64(EDX, 0, INT_TAG);
+        } else {
+            load64(ECX, FRAME, offsetof(NativeFrame, tags) + offsetof(ValueTags, bool_tag));
+            store64(EDX, 0, ECX);
+        }
+        mem({ 0xc7 }, false, 0, EDX, PAYLOAD);        // mov dword [rdx + 8], payload
+        u32(static_cast<uint32_t>(payload));
+        grow(1);
+    }
+
+    void push_constant(const Value &v) {
+        if (v.is_int()) push_scalar(Int, v.as_int());
+        else push_scalar(Bool, v.as_bool());
+    }
+
+    // Both operands ints; `body` leaves the lhs slot holding the result
+    template <typename Body>
+    void int_binary(Body body) {
+        load_top();
+        need(2);
+        is_int(EDX, -32);
+        is_int(EDX, -16);
+        load(EAX, EDX, -32 + PAYLOAD);
+        body();
+        grow(-1);
+    }
+
+    void load(Reg r, Reg base, int32_t disp) { mem({ 0x8b }, false, r, base, disp); } // mov r32, [base + disp]
+
+    void int_arith(std::initializer_list<uint8_t> opcode) {
+        int_binary([&] {
+            mem(opcode, false, EAX, EDX, -16 + PAYLOAD);              // op eax, [rhs]
+            mem({ 0x89 }, false, EAX, EDX, -32 + PAYLOAD);            // mov [lhs], eax
+        });
+    }
+
+    void int_compare(Cond cc) {
+        int_binary([&] {
+            mem({ 0x3b }, false, EAX, EDX, -16 + PAYLOAD);            // cmp eax, [rhs]
+            set_bool(cc);
+            load64(ECX, FRAME, offsetof(NativeFrame, tags) + offsetof(ValueTags, bool_tag));
+            store64(EDX, -32, ECX);
+            mem({ 0x89 }, false, EAX, EDX, -32 + PAYLOAD);            // mov [lhs], eax
+        });
+    }
+
+    // A back edge spends one tick of the slice budget. The tick that would use
+    // it up takes the helper, which also preempts the thread.
+    void tick() {
+        load64(ESI, FRAME, offsetof(NativeFrame, budget));
+        mem({ 0x83 }, true, 7, ESI, 0);               // cmp qword [rsi], 1
+        code.push_back(1);
+        guard(EQ);
+    }
+
+    void spend_tick() { mem({ 0xff }, true, 1, ESI, 0); } // dec qword [rsi]
+
+    // Emits the instruction's fast path, its guards left in `guards`. Returns
+    // false if it has none and runs through the helper only.
+    bool fast_path(const Chunk &chunk, size_t pc, size_t next, int target) {
+        auto u8_at = [&](size_t at) { return chunk.code[at]; };
+        auto u16_at = [&](size_t at) { return static_cast<uint16_t>((chunk.code[at] << 8) | chunk.code[at + 1]); };
+
+        switch (static_cast<OpCode>(chunk.code[pc])) {
+            case OP_NULL:     push_scalar(Null, 0);                                  return true;
+            case OP_TRUE:     push_scalar(Bool, 1);                                  return true;
+            case OP_FALSE:    push_scalar(Bool, 0);                                  return true;
+            case OP_ICONST8:  push_scalar(Int, static_cast<int8_t>(u8_at(pc + 1)));   return true;
+            case OP_ICONST16: push_scalar(Int, static_cast<int16_t>(u16_at(pc + 1))); return true;
+            case OP_CONST:
+            case OP_CONST_LONG: {
+                size_t idx = chunk.code[pc] == OP_CONST ? u16_at(pc + 1) : (u8_at(pc + 1) << 16) | u16_at(pc + 2);
+                if (idx >= chunk.constants->size()) return false;
+                const Value &v = (*chunk.constants)[idx];
+                if (!v.is_int() && !v.is_bool()) return false;
+                push_constant(v);
+                return true;
+            }
+            case OP_LOAD_LOCAL: {
+                int32_t local = 16 * u8_at(pc + 1);
+                load_top();
+                room();
+                local_in_range(local);
+                is_scalar(LOCALS, local);
+                overwritable(EDX, 0);
+                copy(EDX, 0, LOCALS, local);
+                grow(1);
+                return true;
+            }
+            case OP_STORE_LOCAL: {
+                int32_t local = 16 * u8_at(pc + 1);
+                load_top();
+                need(1);
+                local_in_range(local);
+                is_scalar(EDX, -16);
+                overwritable(LOCALS, local);
+                copy(LOCALS, local, EDX, -16);
+                return true;
+            }
+            case OP_POP:
+                load_top();
+                need(1);
+                grow(-1);
+                return true;
+            case OP_DUP:
+                load_top();
+                need(1);
+                room();
+                is_scalar(EDX, -16);
+                overwritable(EDX, 0);
+                copy(EDX, 0, EDX, -16);
+                grow(1);
+                return true;
+            case OP_ADD: case OP_ADD_INT: int_arith({ 0x03 });       return true;
+            case OP_SUB: case OP_SUB_INT: int_arith({ 0x2b });       return true;
+            case OP_MUL: case OP_MUL_INT: int_arith({ 0x0f, 0xaf }); return true;
+            case OP_LT:  case OP_LT_INT:  int_compare(LT);           return true;
+            case OP_LE:  case OP_LE_INT:  int_compare(LE);           return true;
+            case OP_GT:  case OP_GT_INT:  int_compare(GT);           return true;
+            case OP_GE:  case OP_GE_INT:  int_compare(GE);           return true;
+            case OP_EQ:                   int_compare(EQ);           return true;
+            case OP_NEQ:                  int_compare(NE);           return true;
+            case OP_JUMP:
+                if (target < 0) return false;
+                if (target < static_cast<int>(next)) { // a negative offset: VM::execute ticks
+                    tick();
+                    spend_tick();
+                }
+                branch_fixups.emplace_back(jmp(), target);
+                return true;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE: {
+                if (target < 0) return false;
+                // the condition stays on the stack; an int is truthy unless 0
+                load_top();
+                need(1);
+                load64(ECX, EDX, -16);
+                mem({ 0x0f, 0xb6 }, false, ESI, EDX, -16 + PAYLOAD);  // movzx esi, byte [top + 8]
+                reg_reg({ 0x39 }, true, INT_TAG, ECX);                 // cmp rcx, r15
+                size_t not_int = jcc(NE);
+                load(ESI, EDX, -16 + PAYLOAD);
+                size_t decide = jmp();
+                patch_rel32(not_int, size());
+                cmp_bool_tag(ECX);
+                guard(NE);
+                patch_rel32(decide, size());
+                reg_reg({ 0x85 }, false, ESI, ESI);                    // test esi, esi
+                branch_fixups.emplace_back(jcc(chunk.code[pc] == OP_JUMP_IF_FALSE ? EQ : NE), target);
+                return true;
+            }
+            case OP_FOR_LOOP: {
+                if (target < 0) return false;
+                Cond again;
+                switch (static_cast<OpCode>(u8_at(pc + 2))) {
+                    case OP_LT: again = LT; break;
+                    case OP_LE: again = LE; break;
+                    case OP_GT: again = GT; break;
+                    case OP_GE: again = GE; break;
+                    default: return false;
+                }
+
+                // counter, limit and step live in consecutive local slots
+                int32_t counter = 16 * u8_at(pc + 1), limit = counter + 16, step = counter + 32;
+                is_int(LOCALS, counter);
+                is_int(LOCALS, limit);
+                is_int(LOCALS, step);
+                tick();
+                load(EAX, LOCALS, counter + PAYLOAD);
+                mem({ 0x03 }, false, EAX, LOCALS, step + PAYLOAD);     // add eax, [step]
+                mem({ 0x89 }, false, EAX, LOCALS, counter + PAYLOAD);  // mov [counter], eax
+                mem({ 0x3b }, false, EAX, LOCALS, limit + PAYLOAD);    // cmp eax, [limit]
+                size_t done = jcc(static_cast<Cond>(again ^ 1));
+                spend_tick();
+                branch_fixups.emplace_back(jmp(), target);
+                patch_rel32(done, size());
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+};
+
+// A fast path's way back to the helper
+struct SlowPath {
+    std::vector<size_t> guards;
+    uint32_t pc, next;
+    int target;
+};
+
+NativeCode::Ptr compile(const Function &func, const Helper *helpers) {
+    const auto &chunk = func.chunk;
+    bool templates = value_tags().int_tag != nullptr;
+    Assembler as;
+    std::vector<int32_t> entries(chunk.code.size(), -1);
+    std::vector<SlowPath> slow_paths;
+
+    as.prologue();
+
+    for (size_t pc = 0; pc < chunk.code.size(); ) {
+        OpCode op = static_cast<OpCode>(chunk.code[pc]);
+        size_t next = pc + instruction_length(chunk, pc);
+        int target = branch_target(chunk, pc);
+        if (target >= 0 && static_cast<size_t>(target) >= chunk.code.size()) target = -1;
+
+        entries[pc] = static_cast<int32_t>(as.code.size());
+        as.guards.clear();
+        if (templates && as.fast_path(chunk, pc, next, target)) {
+            if (!as.guards.empty()) {
+                slow_paths.push_back({ as.guards, static_cast<uint32_t>(pc), static_cast<uint32_t>(next), target });
+            }
+        } else {
+            as.run_helper(helpers[op], static_cast<uint32_t>(pc), static_cast<uint32_t>(next), target);
+        }
+
+        pc = next;
+    }
+
+    // falling off the end leaves ip past the code; VM::run pops the frame
+    size_t end = as.code.size();
+    as.write_ip(static_cast<uint32_t>(chunk.code.size()));
+    size_t exit = as.code.size();
+    as.epilogue();
+
+    // out of line: a failed guard runs the instruction through its helper, then rejoins
+    std::vector<std::pair<size_t, uint32_t>> rejoins;
+    for (const auto &slow : slow_paths) {
+        for (size_t at : slow.guards) as.patch_rel32(at, as.code.size());
+        as.run_helper(helpers[chunk.code[slow.pc]], slow.pc, slow.next, slow.target);
+        rejoins.emplace_back(as.jmp(), slow.next);
+    }
+
+    for (size_t at : as.exit_fixups) {
+        as.patch_rel32(at, exit);
+    }
+
+    for (const auto &[at, next] : rejoins) {
+        as.patch_rel32(at, next < chunk.code.size() ? static_cast<size_t>(entries[next]) : end);
+    }
+
+    for (const auto &[at, target] : as.branch_fixups) {
+        if (entries[target] < 0) return nullptr; // jump into operands: leave it to the interpreter
+        as.patch_rel32(at, static_cast<size_t>(entries[target]));
+    }
+
+    return std::make_shared<NativeCode>(as.code, std::move(entries));
+}
+
+#else
+
+NativeCode::Ptr compile(const Function &, const Helper *) {
+    return nullptr;
+}
+
+#endif
+
+}
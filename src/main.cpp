@@ -4,15 +4,18 @@
 #include "ast_printer.hpp"
 #include "codegen.hpp"
 #include "vm.hpp"
+#include "bytecode_cache.hpp"
+#include "aot.hpp"
 
 #define MEM_TRACKING 1
 #if MEM_TRACKING
 
 namespace memtrack {
 
+// Atomic since every scheduler worker allocates; the maxima are best effort
 struct MemStats {
-    size_t allocations, max_allocations;
-    size_t num_bytes, max_num_bytes;
+    std::atomic<size_t> allocations, max_allocations;
+    std::atomic<size_t> num_bytes, max_num_bytes;
 };
 
 static MemStats stats[5];
@@ -47,29 +50,39 @@ void check_leaks() {
     }
 }
 
+// Kept in front of every block. The phase is recorded so that a block freed in
+// a later phase (e.g. a lazily compiled body's captures, freed while executing)
+// is taken off the counters of the phase that allocated it. 16 bytes, so the
+// block stays aligned for any type.
+struct Header {
+    size_t size;
+    size_t phase;
+};
+
 void *allocate(size_t size) {
-    size_t total_size = size + sizeof(size_t);
+    size_t total_size = size + sizeof(Header);
     void *raw = malloc(total_size);
     if (!raw) throw std::bad_alloc();
-    *(size_t *) raw = size;
+    *(Header *) raw = { size, phase };
 
-    stats[phase].allocations++;
-    stats[phase].num_bytes += size;
-    stats[phase].max_allocations = std::max(stats[phase].max_allocations, stats[phase].allocations);
-    stats[phase].max_num_bytes = std::max(stats[phase].max_num_bytes, stats[phase].num_bytes);
+    auto &s = stats[phase];
+    size_t allocations = s.allocations.fetch_add(1, std::memory_order_relaxed) + 1;
+    size_t num_bytes = s.num_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    if (allocations > s.max_allocations.load(std::memory_order_relaxed)) s.max_allocations.store(allocations, std::memory_order_relaxed);
+    if (num_bytes > s.max_num_bytes.load(std::memory_order_relaxed)) s.max_num_bytes.store(num_bytes, std::memory_order_relaxed);
     
     // std::cerr << "[" << phase_names[phase] << "]: Allocated " << size << " bytes\n";
 
-    return (char *) raw + sizeof(size_t);
+    return (char *) raw + sizeof(Header);
 }
 
 void deallocate(void *ptr) {
     if (!ptr) return;
-    void *raw = (char *) ptr - sizeof(size_t);
-    size_t size = *(size_t *)raw;
+    void *raw = (char *) ptr - sizeof(Header);
+    Header header = *(Header *) raw;
     
-    stats[phase].allocations--;
-    stats[phase].num_bytes -= size;
+    stats[header.phase].allocations.fetch_sub(1, std::memory_order_relaxed);
+    stats[header.phase].num_bytes.fetch_sub(header.size, std::memory_order_relaxed);
     
     free(raw);
 }
@@ -102,67 +115,141 @@ void operator delete[](void* ptr, size_t) noexcept {
 
 #endif
 
-int run(std::istream &input) {
+struct Options {
+    jit::Mode jit = jit::Mode::Off;
+    std::string emit_cpp; // write the compiled module as C++ to this path instead of running it
+    size_t slice_budget = DEFAULT_SLICE_BUDGET;
+    size_t workers = 1; // OS threads running green threads; 1 keeps runs deterministic
+    std::string trace; // write the scheduler's events as Chrome trace JSON to this path
+};
+
+// `cache_path` is empty when the source has no file of its own (e.g. stdin)
+int run(std::istream &input, const Options &options, const std::string &cache_path = "") {
     using std::chrono::high_resolution_clock;
     using std::chrono::duration_cast;
     using std::chrono::microseconds;
 
     std::string source((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    uint64_t source_hash = bytecode_cache::hash_source(source);
 
-    Lexer lexer(source);
+    Function::Ptr main_func = nullptr;
+    std::shared_ptr<Codegen::Stats> codegen_stats; // null when loaded from the cache
 
-    memtrack::next_phase();
+    if (!cache_path.empty()) {
+        auto t0 = high_resolution_clock::now();
+        main_func = bytecode_cache::load(cache_path, source_hash);
+        auto t1 = high_resolution_clock::now();
 
-    Parser parser(lexer);
+        if (main_func.get()) {
+            auto duration_us = duration_cast<microseconds>(t1 - t0);
+            std::cout << "[Bytecode Cache Load Time : " << duration_us.count() << " us] (" << cache_path << ")\n";
+            std::cout << "--------------------------------------------\n";
 
-    auto t0 = high_resolution_clock::now();
-    std::shared_ptr<std::vector<StmtPtr>> statements = parser.parse();
-    auto t1 = high_resolution_clock::now();
+            // lexing, parsing, printing and code generation are skipped
+            while (memtrack::phase < 4) memtrack::next_phase();
+        }
+    }
 
-    auto duration_us = duration_cast<microseconds>(t1 - t0);
+    bool compiled = !main_func.get(); // a cache miss, so the cache is written after the run
+    if (compiled) {
+        Lexer lexer(source);
 
-    std::cout << "[Parser Execution Time : " << duration_us.count() << " us]\n";
+        memtrack::next_phase();
 
-    memtrack::next_phase();
+        Parser parser(lexer);
 
-    std::cout << "--------------------------------------------\n";
-    std::cout << "Parsed " << statements->size() << " statements:\n";
-    
-    AstPrinter printer;
-    for (const auto &s : *statements) {
-        std::cout << printer.print(*s) << "\n";
+        auto t0 = high_resolution_clock::now();
+        std::shared_ptr<std::vector<StmtPtr>> statements = parser.parse();
+        auto t1 = high_resolution_clock::now();
+
+        auto duration_us = duration_cast<microseconds>(t1 - t0);
+
+        std::cout << "[Parser Execution Time : " << duration_us.count() << " us]\n";
+
+        memtrack::next_phase();
+
+        std::cout << "--------------------------------------------\n";
+        std::cout << "Parsed " << statements->size() << " statements:\n";
+
+        AstPrinter printer;
+        for (const auto &s : *statements) {
+            std::cout << printer.print(*s) << "\n";
+        }
+
+        std::cout << "--------------------------------------------\n";
+
+        memtrack::next_phase();
+
+        Codegen gen;
+        t0 = high_resolution_clock::now();
+        main_func = gen.compile(statements);
+        t1 = high_resolution_clock::now();
+        codegen_stats = gen.stats;
+
+        duration_us = duration_cast<microseconds>(t1 - t0);
+
+        std::cout << "[Codegen Execution Time : " << duration_us.count() << " us]\n";
+
+        gen.disassemble();
+
+        std::cout << "--------------------------------------------\n";
+
+        memtrack::next_phase();
     }
 
-    std::cout << "--------------------------------------------\n";
-    
-    memtrack::next_phase();
-    
-    Codegen gen;
-    auto main_func = gen.compile(statements);
-    gen.disassemble();
-    
-    std::cout << "--------------------------------------------\n";
+    if (!options.emit_cpp.empty()) {
+        std::ofstream out(options.emit_cpp);
+        aot::emit_cpp(out, main_func, source_hash);
+        if (!out) {
+            std::cerr << "Error: could not write " << options.emit_cpp << "\n";
+            return 1;
+        }
 
-    memtrack::next_phase();
+        std::cout << "[Wrote " << options.emit_cpp << "]\n";
+        return 0;
+    }
 
     VM vm;
+    vm.jit_mode = options.jit;
+    vm.scheduler.slice_budget = options.slice_budget;
+    vm.scheduler.worker_count = options.workers;
+    if (!options.trace.empty()) event_trace::enable();
     Value result = vm.interpret(main_func);
 
     std::cout << "--------------------------------------------\n";
 
+    if (codegen_stats) {
+        std::cout << "[Specialized Arithmetic Sites : " << codegen_stats->specialized_sites << "]\n";
+    }
+
+    if (!options.trace.empty()) {
+        int64_t events = event_trace::write_chrome_json(options.trace);
+        if (events < 0) {
+            std::cerr << "Error: could not write " << options.trace << "\n";
+        } else {
+            std::cout << "[Wrote " << events << " trace events to " << options.trace << "]\n";
+        }
+    }
+
     memtrack::print_stats();
 
+    // written after the run, so the bodies it called lazily are compiled by now
+    // and only the ones it never reached are compiled for the cache
+    if (compiled && !cache_path.empty() && !bytecode_cache::store(cache_path, source_hash, main_func)) {
+        std::cerr << "[Could not write bytecode cache " << cache_path << "]\n";
+    }
+
     if (result.is_null()) return 0;
     if (result.is_int()) return result.as_int();
 
     return result.is_truthy() ? 0 : 1;
 }
 
-int run_prompt() {
-    return run(std::cin);
+int run_prompt(const Options &options) {
+    return run(std::cin, options);
 }
 
-int run_file(char *filename) {
+int run_file(char *filename, const Options &options) {
     std::ifstream file(filename);   
 
     if (!file) {
@@ -170,21 +257,62 @@ int run_file(char *filename) {
         return 1;
     }
 
-    return run(file);
+    return run(file, options, bytecode_cache::path_for(filename));
 }
 
 int main(int argc, char **argv) {
     std::srand(std::time(nullptr));
 
-    if (argc > 2) {
-        std::cerr << "Usage: " << argv[0] << " [source file]\n";
-        return 1;
+    Options options;
+    char *filename = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg.rfind("--jit=", 0) == 0 && jit::parse_mode(arg.substr(6), options.jit)) {
+            continue;
+        }
+
+        if (arg.rfind("--slice=", 0) == 0 && arg.size() > 8 &&
+            arg.find_first_not_of("0123456789", 8) == std::string::npos) {
+            options.slice_budget = std::stoul(arg.substr(8));
+            continue;
+        }
+
+        if (arg == "--workers=auto") {
+            options.workers = std::max(1u, std::thread::hardware_concurrency());
+            continue;
+        }
+
+        if (arg.rfind("--workers=", 0) == 0 && arg.size() > 10 &&
+            arg.find_first_not_of("0123456789", 10) == std::string::npos && std::stoul(arg.substr(10)) > 0) {
+            options.workers = std::stoul(arg.substr(10));
+            continue;
+        }
+
+        if (arg.rfind("--trace=", 0) == 0 && arg.size() > 8) {
+            options.trace = arg.substr(8);
+            continue;
+        }
+
+        if (arg.rfind("--emit-cpp=", 0) == 0 && arg.size() > 11) {
+            options.emit_cpp = arg.substr(11);
+            continue;
+        }
+
+        if (arg[0] == '-' || filename) {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--jit=off|baseline|stencil|trace] [--slice=<budget>] [--workers=<n>|auto] [--trace=<output.json>] [--emit-cpp=<output.cpp>] [source file]\n";
+            return 1;
+        }
+
+        filename = argv[i];
     }
 
-    if (argc == 2) {
-        return run_file(argv[1]);
+    if (filename) {
+        return run_file(filename, options);
     } else {
-        return run_prompt();
+        return run_prompt(options);
     }
 
     return 0;
@@ -49,22 +49,27 @@ StmtPtr Parser::declaration() {
     return statement();
 }
 
-// var_declaration → "let" IDENTIFIER ( "=" expression )? ("," IDENTIFIER ( "=" expression )? )* ";" ;
+// var_declaration → "let" IDENTIFIER ( ":" type )? ( "=" expression )? ";" ;
 StmtPtr Parser::var_declaration() {
     // TODO: support multiple variable declarations in one statement
     auto name = consume(TokenType::Identifier, "Expect variable name.");
 
+    StaticType type = StaticType::Any;
+    if (match(TokenType::Colon)) {
+        type = type_annotation();
+    }
+
     ExprPtr initializer = nullptr;
     if (match(TokenType::Assign)) {
         initializer = expression();
     }
     
     consume(TokenType::Semicolon, "Expect ';' after variable declaration.");
-    return make_stmt<LetStmt>(name, std::move(initializer));
+    return make_stmt<LetStmt>(name, std::move(initializer), type);
 }
 
-// parameters → IDENTIFIER ( "," IDENTIFIER )* ;
-std::vector<Token> Parser::parameters() {
+// parameters → IDENTIFIER ( ":" type )? ( "," IDENTIFIER ( ":" type )? )* ;
+std::vector<Token> Parser::parameters(FunctionTypes &types) {
     std::vector<Token> params;
 
     if (!check(TokenType::RightParen)) {
@@ -74,25 +79,44 @@ std::vector<Token> Parser::parameters() {
             }
 
             params.push_back(consume(TokenType::Identifier, "Expect parameter name."));
+            types.params.push_back(match(TokenType::Colon) ? type_annotation() : StaticType::Any);
         } while (match(TokenType::Comma));
     }
 
     return params;
 }
 
-// func_declaration → "fn" IDENTIFIER "(" parameters? ")" "{" block_statements "}" ;
+// type → "int" | "float" | "bool" | "string" | "any" ;
+StaticType Parser::type_annotation() {
+    auto name = consume(TokenType::Identifier, "Expect type name.");
+
+    StaticType type;
+    if (!parse_static_type(name.value, type)) {
+        throw ParseError(name, "Unknown type '" + name.value + "'.");
+    }
+
+    return type;
+}
+
+// func_declaration → "fn" IDENTIFIER "(" parameters? ")" ( "->" type )? "{" block_statements "}" ;
 StmtPtr Parser::func_declaration() {
     auto name = consume(TokenType::Identifier, "Expect function name.");
     consume(TokenType::LeftParen, "Expect '(' after function name.");
 
-    std::vector<Token> params = parameters();
+    FunctionTypes types;
+    std::vector<Token> params = parameters(types);
 
     consume(TokenType::RightParen, "Expect ')' after parameters.");
+
+    if (match(TokenType::RightArrow)) {
+        types.result = type_annotation();
+    }
+
     consume(TokenType::LeftCurly, "Expect '{' before function body.");
 
     auto body = block_statements();
 
-    return make_stmt<FunctionStmt>(name, std::move(params), body);
+    return make_stmt<FunctionStmt>(name, std::move(params), body, std::move(types));
 }
 
 // struct_declaration → "struct" IDENTIFIER "{" func_declaration* "}" ;
@@ -229,7 +253,7 @@ StmtPtr Parser::close_statement() {
 // select_statement → "select" "{" case_clause* default_clause? "}" ;
 // case_clause → { send_clause | recv_clause } "{" block_statements "}" ;
 // default_clause → "else" "{" block_statements "}" ;
-// send_clause → expression "<-" expression ;
+// send_clause → ternary "<-" ternary ;
 // recv_clause → ( { "let" IDENTIFIER } )? "<-" expression ;
 StmtPtr Parser::select_statement() {
     consume(TokenType::LeftCurly, "Expect '{' after 'select'.");
@@ -276,14 +300,15 @@ StmtPtr Parser::select_statement() {
 
             recv_clauses.push_back(std::move(recv_clause));
         } else {
-            ExprPtr expr = expression();
+            // below send_message, which would take the '<-' itself
+            ExprPtr expr = ternary();
 
             consume(TokenType::LeftArrow, "Expect '<-' in case clause.");
 
             // send clause
             SelectSendClause send_clause;
-            send_clause.value_expr = std::move(expr);
-            send_clause.pipe_expr = expression();
+            send_clause.pipe_expr = std::move(expr);
+            send_clause.value_expr = ternary();
 
             consume(TokenType::LeftCurly, "Expect '{' after send clause.");
             send_clause.body = block();
@@ -880,10 +905,12 @@ ExprPtr Parser::object_literal() {
 }
 
 // lambda_expression → "fn" "(" parameters? ")" ( "->" expression | "{" block_statements "}" ) ;
+// (`->` starts an expression body here, so lambdas have no result annotation)
 ExprPtr Parser::lambda_expression() {    
     consume(TokenType::LeftParen, "Expect '(' after 'fn' keyword.");
     
-    std::vector<Token> params = parameters();
+    FunctionTypes types;
+    std::vector<Token> params = parameters(types);
 
     consume(TokenType::RightParen, "Expect ')' after parameters.");
     
@@ -893,14 +920,14 @@ ExprPtr Parser::lambda_expression() {
         auto body = std::make_shared<std::vector<StmtPtr>>();
         body->push_back(make_stmt<ReturnStmt>(std::move(return_expr)));
 
-        return make_expr<LambdaExpr>(std::move(params), body);
+        return make_expr<LambdaExpr>(std::move(params), body, std::move(types));
     }
 
     consume(TokenType::LeftCurly, "Expect '{' before function body.");
 
     auto body = block_statements();
 
-    return make_expr<LambdaExpr>(std::move(params), body);
+    return make_expr<LambdaExpr>(std::move(params), body, std::move(types));
 }
 
 void Parser::synchronize() {
@@ -0,0 +1,162 @@
+#include "stencil_jit.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include "stencils.inc" // generated at build time, see the Makefile
+#endif
+
+namespace jit {
+
+#if defined(__x86_64__)
+
+struct Placement {
+    const Stencil *stencil;
+    size_t offset;
+    uint32_t pc, next;
+    int target;           // bytecode offset of a local branch target, -1 if none
+    size_t target_offset; // its stencil's offset, once known
+    int32_t operand;
+};
+
+// The stencil for the instruction at `pc`, setting its operand hole. Without
+// one of its own, the instruction runs through its helper.
+static const Stencil *select_stencil(const Chunk &chunk, size_t pc, size_t next, int target, int32_t &operand) {
+    auto u8_at = [&](size_t at) { return chunk.code[at]; };
+    auto u16_at = [&](size_t at) { return static_cast<uint16_t>((chunk.code[at] << 8) | chunk.code[at + 1]); };
+    const Stencil *generic = target >= 0 ? &stencil_branch : &stencil_step;
+    operand = 0;
+
+    // the fast paths recognize ints and bools by their tags
+    if (!value_tags().int_tag) return generic;
+
+    switch (static_cast<OpCode>(chunk.code[pc])) {
+        case OP_NULL:     return &stencil_push_null;
+        case OP_TRUE:     operand = 1; return &stencil_push_bool;
+        case OP_FALSE:    operand = 0; return &stencil_push_bool;
+        case OP_ICONST8:  operand = static_cast<int8_t>(u8_at(pc + 1));   return &stencil_push_int;
+        case OP_ICONST16: operand = static_cast<int16_t>(u16_at(pc + 1)); return &stencil_push_int;
+        case OP_CONST:
+        case OP_CONST_LONG: {
+            size_t idx = chunk.code[pc] == OP_CONST ? u16_at(pc + 1) : (u8_at(pc + 1) << 16) | u16_at(pc + 2);
+            if (idx >= chunk.constants->size()) return generic;
+
+            const Value &v = (*chunk.constants)[idx];
+            if (v.is_int())  { operand = v.as_int(); return &stencil_push_int; }
+            if (v.is_bool()) { operand = v.as_bool(); return &stencil_push_bool; }
+            return generic;
+        }
+        case OP_LOAD_LOCAL:  operand = u8_at(pc + 1); return &stencil_load_local;
+        case OP_STORE_LOCAL: operand = u8_at(pc + 1); return &stencil_store_local;
+        case OP_POP:         return &stencil_pop;
+        case OP_DUP:         return &stencil_dup;
+        case OP_ADD: case OP_ADD_INT: return &stencil_add;
+        case OP_SUB: case OP_SUB_INT: return &stencil_sub;
+        case OP_MUL: case OP_MUL_INT: return &stencil_mul;
+        case OP_LT:  case OP_LT_INT:  return &stencil_lt;
+        case OP_LE:  case OP_LE_INT:  return &stencil_le;
+        case OP_GT:  case OP_GT_INT:  return &stencil_gt;
+        case OP_GE:  case OP_GE_INT:  return &stencil_ge;
+        case OP_EQ:                   return &stencil_eq;
+        case OP_NEQ:                  return &stencil_ne;
+        case OP_JUMP:
+            if (target < 0) return generic;
+            // a negative offset spends a tick in VM::execute
+            return target < static_cast<int>(next) ? &stencil_loop : &stencil_jump;
+        case OP_JUMP_IF_FALSE: return target >= 0 ? &stencil_jump_if_false : generic;
+        case OP_JUMP_IF_TRUE:  return target >= 0 ? &stencil_jump_if_true : generic;
+        case OP_FOR_LOOP:
+            if (target < 0) return generic;
+            operand = u8_at(pc + 1);
+            switch (static_cast<OpCode>(u8_at(pc + 2))) {
+                case OP_LT: return &stencil_for_lt;
+                case OP_LE: return &stencil_for_le;
+                case OP_GT: return &stencil_for_gt;
+                case OP_GE: return &stencil_for_ge;
+                default:    return generic;
+            }
+        default:
+            return generic;
+    }
+}
+
+static void patch(uint8_t *base, const Placement &p, Helper helper, uint64_t continue_at) {
+    uint8_t *code = base + p.offset;
+    std::memcpy(code, p.stencil->code, p.stencil->size);
+
+    for (size_t i = 0; i < p.stencil->hole_count; i++) {
+        const Hole &hole = p.stencil->holes[i];
+        uint64_t value = 0;
+
+        switch (hole.kind) {
+            case HoleKind::Pc:       value = p.pc; break;
+            case HoleKind::Next:     value = p.next; break;
+            case HoleKind::Operand:  value = static_cast<uint32_t>(p.operand); break;
+            case HoleKind::Helper:   value = reinterpret_cast<uint64_t>(helper); break;
+            case HoleKind::Continue: value = continue_at; break;
+            case HoleKind::Target:
+                value = reinterpret_cast<uint64_t>(base + p.target_offset);
+                break;
+        }
+
+        value += static_cast<uint64_t>(hole.addend);
+        std::memcpy(code + hole.offset, &value, sizeof(value));
+    }
+}
+
+NativeCode::Ptr compile_stencils(const Function &func, const Helper *helpers) {
+    const auto &chunk = func.chunk;
+    std::vector<int32_t> entries(chunk.code.size(), -1);
+    std::vector<Placement> placements;
+
+    // NativeCode::enter calls offset 0 with the entry stencil's address
+    size_t size = stencil_enter.size;
+
+    for (size_t pc = 0; pc < chunk.code.size(); ) {
+        size_t next = pc + instruction_length(chunk, pc);
+        int target = branch_target(chunk, pc);
+        if (target >= 0 && static_cast<size_t>(target) >= chunk.code.size()) target = -1;
+
+        int32_t operand;
+        const Stencil *stencil = select_stencil(chunk, pc, next, target, operand);
+        entries[pc] = static_cast<int32_t>(size);
+        placements.push_back({ stencil, size, static_cast<uint32_t>(pc), static_cast<uint32_t>(next),
+                               target, 0, operand });
+        size += stencil->size;
+
+        pc = next;
+    }
+
+    // falling off the end leaves ip past the code; VM::run pops the frame
+    size_t exit = size;
+    auto end = static_cast<uint32_t>(chunk.code.size());
+    Placement exit_placement { &stencil_exit, exit, end, end, -1, 0, 0 };
+    size += stencil_exit.size;
+
+    for (auto &p : placements) {
+        if (p.target < 0) continue;
+        if (entries[p.target] < 0) return nullptr; // jump into operands: leave it to the interpreter
+        p.target_offset = static_cast<size_t>(entries[p.target]);
+    }
+
+    return std::make_shared<NativeCode>(size, [&](uint8_t *base) {
+        std::memcpy(base, stencil_enter.code, stencil_enter.size);
+        patch(base, exit_placement, nullptr, 0);
+
+        for (size_t i = 0; i < placements.size(); i++) {
+            const auto &p = placements[i];
+            size_t continue_at = i + 1 < placements.size() ? placements[i + 1].offset : exit;
+            patch(base, p, helpers[chunk.code[p.pc]], reinterpret_cast<uint64_t>(base + continue_at));
+        }
+    }, std::move(entries));
+}
+
+#else
+
+NativeCode::Ptr compile_stencils(const Function &, const Helper *) {
+    return nullptr;
+}
+
+#endif
+
+}
@@ -0,0 +1,196 @@
+// Build-time tool: reads the ELF object compiled from stencils.cpp and writes the
+// stencils as C++ arrays for stencil_jit.cpp. Each function `stencil_<name>`
+// (in its own section thanks to -ffunction-sections) becomes the bytes of that
+// section plus one hole per relocation against a _JIT_* symbol. A stencil may
+// only pass control to another as its last act (see is_tail_jump).
+//
+// Usage: generate <stencils.o> <output.inc>
+
+#include <elf.h>
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static const std::map<std::string, std::string> HOLE_KINDS = {
+    { "_JIT_PC",       "Pc" },
+    { "_JIT_NEXT",     "Next" },
+    { "_JIT_OPERAND",  "Operand" },
+    { "_JIT_HELPER",   "Helper" },
+    { "_JIT_CONTINUE", "Continue" },
+    { "_JIT_TARGET",   "Target" },
+};
+
+struct ObjectFile {
+    std::vector<char> data;
+
+    template <typename T>
+    const T *at(uint64_t offset, uint64_t count = 1) const {
+        if (offset > data.size() || count * sizeof(T) > data.size() - offset) {
+            throw std::runtime_error("Truncated object file");
+        }
+        return reinterpret_cast<const T *>(data.data() + offset);
+    }
+
+    const Elf64_Ehdr &header() const { return *at<Elf64_Ehdr>(0); }
+
+    const Elf64_Shdr &section(size_t index) const {
+        if (index >= header().e_shnum) throw std::runtime_error("Bad section index");
+        return *at<Elf64_Shdr>(header().e_shoff + index * sizeof(Elf64_Shdr));
+    }
+
+    std::string string(size_t table, uint32_t offset) const {
+        const auto &strtab = section(table);
+        if (offset >= strtab.sh_size) throw std::runtime_error("Bad string offset");
+        return at<char>(strtab.sh_offset + offset);
+    }
+
+    std::string section_name(size_t index) const {
+        return string(header().e_shstrndx, section(index).sh_name);
+    }
+};
+
+// Whether the 64-bit hole at `offset` is loaded by `movabs reg, hole` and then,
+// past the epilogue's pops, jumped to with `jmp reg`. Calling it instead would
+// return into this stencil, leaving a native frame behind per instruction run.
+static bool is_tail_jump(const uint8_t *code, size_t size, uint64_t offset) {
+    if (offset < 2 || offset + 8 > size) return false;
+    uint8_t rex = code[offset - 2], mov = code[offset - 1];
+    if ((rex & 0xfe) != 0x48 || (mov & 0xf8) != 0xb8) return false;
+    uint8_t reg = static_cast<uint8_t>(((rex & 1) << 3) | (mov & 7));
+
+    size_t at = offset + 8;
+    while (at < size) {
+        if (code[at] >= 0x58 && code[at] <= 0x5f) {                                   // pop r
+            at += 1;
+        } else if (at + 1 < size && code[at] == 0x41 && code[at + 1] >= 0x58 && code[at + 1] <= 0x5f) {
+            at += 2;                                                                  // pop r8-r15
+        } else if (at + 3 < size && code[at] == 0x48 && code[at + 1] == 0x83 && code[at + 2] == 0xc4) {
+            at += 4;                                                                  // add rsp, imm8
+        } else {
+            break;
+        }
+    }
+
+    if (reg >= 8) {
+        return at + 2 < size && code[at] == 0x41 && code[at + 1] == 0xff && code[at + 2] == 0xe0 + (reg & 7);
+    }
+    return at + 1 < size && code[at] == 0xff && code[at + 1] == 0xe0 + reg;
+}
+
+static void emit_stencil(std::ostream &out, const ObjectFile &obj, size_t symtab_index,
+                         const Elf64_Sym &symbol, const std::string &name) {
+    const auto &text = obj.section(symbol.st_shndx);
+    if (symbol.st_value != 0 || symbol.st_size != text.sh_size) {
+        throw std::runtime_error(name + " does not fill its own section (missing -ffunction-sections?)");
+    }
+
+    auto bytes = obj.at<uint8_t>(text.sh_offset, text.sh_size);
+    const auto &symtab = obj.section(symtab_index);
+    auto symbols = obj.at<Elf64_Sym>(symtab.sh_offset, symtab.sh_size / sizeof(Elf64_Sym));
+
+    std::ostringstream holes;
+    size_t hole_count = 0;
+
+    for (size_t i = 0; i < obj.header().e_shnum; i++) {
+        const auto &rela = obj.section(i);
+        if (rela.sh_type == SHT_REL) throw std::runtime_error("REL relocations are not supported");
+        if (rela.sh_type != SHT_RELA || rela.sh_info != symbol.st_shndx) continue;
+
+        auto entries = obj.at<Elf64_Rela>(rela.sh_offset, rela.sh_size / sizeof(Elf64_Rela));
+        for (size_t j = 0; j < rela.sh_size / sizeof(Elf64_Rela); j++) {
+            const auto &entry = entries[j];
+            std::string target = obj.string(symtab.sh_link, symbols[ELF64_R_SYM(entry.r_info)].st_name);
+
+            auto kind = HOLE_KINDS.find(target);
+            if (kind == HOLE_KINDS.end()) {
+                throw std::runtime_error(name + " refers to '" + target + "', which is not a hole");
+            }
+            if (ELF64_R_TYPE(entry.r_info) != R_X86_64_64) {
+                throw std::runtime_error(name + " has a non-absolute relocation (compile with -mcmodel=large)");
+            }
+            if ((target == "_JIT_CONTINUE" || target == "_JIT_TARGET") &&
+                !is_tail_jump(bytes, text.sh_size, entry.r_offset)) {
+                throw std::runtime_error(name + " passes control to " + target + " other than by a tail jmp");
+            }
+
+            holes << "    { " << entry.r_offset << ", jit::HoleKind::" << kind->second
+                  << ", " << entry.r_addend << " },\n";
+            hole_count++;
+        }
+    }
+
+    out << "static const uint8_t " << name << "_code[] = {";
+    for (size_t i = 0; i < text.sh_size; i++) {
+        out << (i % 16 == 0 ? "\n    " : " ") << "0x" << std::hex << std::setw(2) << std::setfill('0')
+            << static_cast<int>(bytes[i]) << std::dec << ",";
+    }
+    out << "\n};\n";
+
+    if (hole_count > 0) {
+        out << "static const jit::Hole " << name << "_holes[] = {\n" << holes.str() << "};\n";
+        out << "static const jit::Stencil " << name << " = { " << name << "_code, sizeof(" << name
+            << "_code), " << name << "_holes, " << hole_count << " };\n\n";
+    } else {
+        out << "static const jit::Stencil " << name << " = { " << name << "_code, sizeof(" << name
+            << "_code), nullptr, 0 };\n\n";
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <stencils.o> <output.inc>\n";
+        return 1;
+    }
+
+    try {
+        std::ifstream in(argv[1], std::ios::binary);
+        if (!in) throw std::runtime_error(std::string("Could not open ") + argv[1]);
+
+        ObjectFile obj{ std::vector<char>(std::istreambuf_iterator<char>(in), {}) };
+        const auto &header = obj.header();
+        if (std::memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_ident[EI_CLASS] != ELFCLASS64 ||
+            header.e_machine != EM_X86_64) {
+            throw std::runtime_error("Expected an x86-64 ELF object");
+        }
+
+        std::ostringstream out;
+        out << "// Generated from src/stencils/stencils.cpp by src/stencils/generate.cpp. Do not edit.\n\n";
+
+        size_t stencil_count = 0;
+        for (size_t i = 0; i < header.e_shnum; i++) {
+            const auto &symtab = obj.section(i);
+            if (symtab.sh_type != SHT_SYMTAB) continue;
+
+            auto symbols = obj.at<Elf64_Sym>(symtab.sh_offset, symtab.sh_size / sizeof(Elf64_Sym));
+            for (size_t j = 0; j < symtab.sh_size / sizeof(Elf64_Sym); j++) {
+                const auto &symbol = symbols[j];
+                if (ELF64_ST_TYPE(symbol.st_info) != STT_FUNC) continue;
+
+                std::string name = obj.string(symtab.sh_link, symbol.st_name);
+                if (name.rfind("stencil_", 0) != 0) continue;
+
+                emit_stencil(out, obj, i, symbol, name);
+                stencil_count++;
+            }
+        }
+
+        if (stencil_count == 0) throw std::runtime_error("No stencils found");
+
+        std::ofstream file(argv[2]);
+        file << out.str();
+        if (!file) throw std::runtime_error(std::string("Could not write ") + argv[2]);
+    } catch (const std::exception &e) {
+        std::cerr << argv[0] << ": " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,268 @@
+// Stencils for the copy-and-patch JIT (--jit=stencil). This file is not part of
+// the interpreter: it is compiled on its own with -mcmodel=large so that every
+// reference to a _JIT_* symbol becomes a 64-bit absolute relocation, and
+// generate.cpp turns the resulting object into byte arrays whose relocations are
+// the holes patched at runtime. Every transfer between stencils is a tail call,
+// so a run of stitched stencils uses a single native stack frame.
+//
+// The hot opcodes get a stencil of their own that works on the Values in place,
+// like the baseline tier's templates. The helper only runs when a check fails,
+// and it then runs the whole instruction, so a fast path never bails out after
+// it has changed anything.
+
+#include <cstddef>
+#include <cstdint>
+
+struct VM;
+
+// A Value as the JIT sees it: a std::any laid out as jit::ValueTags describes,
+// a tag naming the stored type followed by an int or bool stored inline
+struct Value {
+    const void *tag;
+    union {
+        int32_t i;
+        uint8_t b;
+        uint64_t bits;
+    };
+};
+
+// Mirrors jit::NativeFrame
+struct NativeFrame {
+    Value *stack;
+    size_t *stack_size;
+    size_t capacity;
+    Value *locals;
+    int *ip;
+    int64_t *budget;
+    const void *int_tag;
+    const void *bool_tag;
+};
+
+extern "C" {
+    // Holes: only their addresses are used, and those are patched in
+    extern char _JIT_PC;      // bytecode offset of the instruction
+    extern char _JIT_NEXT;    // bytecode offset of the instruction after it
+    extern char _JIT_OPERAND; // the instruction's operand: a local slot or an int
+
+    int  _JIT_HELPER(VM *vm, uint32_t pc, uint32_t next);  // the opcode's runtime helper
+    void _JIT_CONTINUE(VM *vm, NativeFrame *frame);        // stencil of the next instruction
+    void _JIT_TARGET(VM *vm, NativeFrame *frame);          // stencil of the branch target
+}
+
+#define HOLE(name) static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&name))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+// Result codes of jit::Helper
+enum { NEXT = 0, EXIT = 1, BRANCH = 2 };
+
+// The instruction through its helper
+static ALWAYS_INLINE void step(VM *vm, NativeFrame *frame) {
+    if (_JIT_HELPER(vm, HOLE(_JIT_PC), HOLE(_JIT_NEXT)) != NEXT) return;
+    _JIT_CONTINUE(vm, frame);
+}
+
+static ALWAYS_INLINE void branch(VM *vm, NativeFrame *frame) {
+    int result = _JIT_HELPER(vm, HOLE(_JIT_PC), HOLE(_JIT_NEXT));
+    if (result == BRANCH) {
+        _JIT_TARGET(vm, frame);
+        return;
+    }
+    if (result != NEXT) return;
+    _JIT_CONTINUE(vm, frame);
+}
+
+static ALWAYS_INLINE bool is_int(const NativeFrame *frame, const Value &v) { return v.tag == frame->int_tag; }
+
+// Ints and bools copy as plain bytes
+static ALWAYS_INLINE bool is_scalar(const NativeFrame *frame, const Value &v) {
+    return v.tag == frame->int_tag || v.tag == frame->bool_tag;
+}
+
+// Null, int and bool slots own nothing, so they can be written over as is.
+// Slots above the top may still hold a popped value.
+static ALWAYS_INLINE bool overwritable(const NativeFrame *frame, const Value &v) {
+    return !v.tag || is_scalar(frame, v);
+}
+
+// Wraps around like the interpreter's int arithmetic
+static ALWAYS_INLINE int32_t wrap(uint32_t v) { return static_cast<int32_t>(v); }
+
+static ALWAYS_INLINE void push(VM *vm, NativeFrame *frame, const void *tag, int32_t payload) {
+    size_t size = *frame->stack_size;
+    Value *top = frame->stack + size;
+    if (size >= frame->capacity || !overwritable(frame, *top)) return step(vm, frame);
+
+    top->tag = tag;
+    top->bits = static_cast<uint32_t>(payload);
+    *frame->stack_size = size + 1;
+    _JIT_CONTINUE(vm, frame);
+}
+
+// Both operands ints; `op` leaves the result in the lhs slot
+template <typename Op>
+static ALWAYS_INLINE void int_binary(VM *vm, NativeFrame *frame, Op op) {
+    size_t size = *frame->stack_size;
+    if (size < 2) return step(vm, frame);
+
+    Value *lhs = frame->stack + size - 2;
+    if (!is_int(frame, lhs[0]) || !is_int(frame, lhs[1])) return step(vm, frame);
+
+    op(lhs[0], lhs[1].i);
+    *frame->stack_size = size - 1;
+    _JIT_CONTINUE(vm, frame);
+}
+
+template <typename Compare>
+static ALWAYS_INLINE void int_compare(VM *vm, NativeFrame *frame, Compare compare) {
+    int_binary(vm, frame, [&](Value &lhs, int32_t rhs) {
+        lhs.bits = compare(lhs.i, rhs);
+        lhs.tag = frame->bool_tag;
+    });
+}
+
+template <bool WHEN>
+static ALWAYS_INLINE void jump_if(VM *vm, NativeFrame *frame) {
+    size_t size = *frame->stack_size;
+    if (size == 0) return branch(vm, frame);
+
+    // the condition stays on the stack; an int is truthy unless 0
+    const Value &cond = frame->stack[size - 1];
+    bool truthy;
+    if (cond.tag == frame->int_tag) truthy = cond.i != 0;
+    else if (cond.tag == frame->bool_tag) truthy = cond.b != 0;
+    else return branch(vm, frame);
+
+    if (truthy == WHEN) {
+        _JIT_TARGET(vm, frame);
+        return;
+    }
+    _JIT_CONTINUE(vm, frame);
+}
+
+// Counter, limit and step live in consecutive local slots. Taking the loop
+// spends a tick of the slice budget; the tick that would use it up takes the
+// helper, which also preempts the thread.
+template <typename Again>
+static ALWAYS_INLINE void for_loop(VM *vm, NativeFrame *frame, Again again) {
+    Value *vars = frame->locals + HOLE(_JIT_OPERAND);
+    if (!is_int(frame, vars[0]) || !is_int(frame, vars[1]) || !is_int(frame, vars[2]) || *frame->budget == 1) {
+        return branch(vm, frame);
+    }
+
+    vars[0].i = wrap(static_cast<uint32_t>(vars[0].i) + static_cast<uint32_t>(vars[2].i));
+    if (again(vars[0].i, vars[1].i)) {
+        --*frame->budget;
+        _JIT_TARGET(vm, frame);
+        return;
+    }
+    _JIT_CONTINUE(vm, frame);
+}
+
+extern "C" {
+
+// Placed at offset 0: NativeCode::enter calls it with the stencil to start at
+void stencil_enter(VM *vm, void (*target)(VM *, NativeFrame *), NativeFrame *frame) {
+    target(vm, frame);
+}
+
+// An instruction without a stencil of its own or a static branch target
+void stencil_step(VM *vm, NativeFrame *frame) { step(vm, frame); }
+
+// The same with a branch target within the function
+void stencil_branch(VM *vm, NativeFrame *frame) { branch(vm, frame); }
+
+// Constants: null, true/false and ints (the operand)
+void stencil_push_null(VM *vm, NativeFrame *frame) { push(vm, frame, nullptr, 0); }
+void stencil_push_bool(VM *vm, NativeFrame *frame) { push(vm, frame, frame->bool_tag, HOLE(_JIT_OPERAND)); }
+void stencil_push_int(VM *vm, NativeFrame *frame)  { push(vm, frame, frame->int_tag, HOLE(_JIT_OPERAND)); }
+
+// Locals: the operand is the slot, which must lie below the top as VM::execute checks
+void stencil_load_local(VM *vm, NativeFrame *frame) {
+    size_t size = *frame->stack_size;
+    Value *top = frame->stack + size;
+    const Value *local = frame->locals + HOLE(_JIT_OPERAND);
+    if (size >= frame->capacity || local >= top || !is_scalar(frame, *local) || !overwritable(frame, *top)) {
+        return step(vm, frame);
+    }
+
+    *top = *local;
+    *frame->stack_size = size + 1;
+    _JIT_CONTINUE(vm, frame);
+}
+
+void stencil_store_local(VM *vm, NativeFrame *frame) {
+    size_t size = *frame->stack_size;
+    Value *top = frame->stack + size;
+    Value *local = frame->locals + HOLE(_JIT_OPERAND);
+    if (local >= top || !is_scalar(frame, top[-1]) || !overwritable(frame, *local)) return step(vm, frame);
+
+    *local = top[-1];
+    _JIT_CONTINUE(vm, frame);
+}
+
+void stencil_pop(VM *vm, NativeFrame *frame) {
+    size_t size = *frame->stack_size;
+    if (size == 0) return step(vm, frame);
+
+    *frame->stack_size = size - 1;
+    _JIT_CONTINUE(vm, frame);
+}
+
+void stencil_dup(VM *vm, NativeFrame *frame) {
+    size_t size = *frame->stack_size;
+    Value *top = frame->stack + size;
+    if (size == 0 || size >= frame->capacity || !is_scalar(frame, top[-1]) || !overwritable(frame, *top)) {
+        return step(vm, frame);
+    }
+
+    *top = top[-1];
+    *frame->stack_size = size + 1;
+    _JIT_CONTINUE(vm, frame);
+}
+
+// Int arithmetic and compares, for the generic and the typed opcodes alike
+void stencil_add(VM *vm, NativeFrame *frame) {
+    int_binary(vm, frame, [](Value &lhs, int32_t rhs) { lhs.i = wrap(static_cast<uint32_t>(lhs.i) + static_cast<uint32_t>(rhs)); });
+}
+
+void stencil_sub(VM *vm, NativeFrame *frame) {
+    int_binary(vm, frame, [](Value &lhs, int32_t rhs) { lhs.i = wrap(static_cast<uint32_t>(lhs.i) - static_cast<uint32_t>(rhs)); });
+}
+
+void stencil_mul(VM *vm, NativeFrame *frame) {
+    int_binary(vm, frame, [](Value &lhs, int32_t rhs) { lhs.i = wrap(static_cast<uint32_t>(lhs.i) * static_cast<uint32_t>(rhs)); });
+}
+
+void stencil_lt(VM *vm, NativeFrame *frame) { int_compare(vm, frame, [](int32_t a, int32_t b) { return a < b; }); }
+void stencil_le(VM *vm, NativeFrame *frame) { int_compare(vm, frame, [](int32_t a, int32_t b) { return a <= b; }); }
+void stencil_gt(VM *vm, NativeFrame *frame) { int_compare(vm, frame, [](int32_t a, int32_t b) { return a > b; }); }
+void stencil_ge(VM *vm, NativeFrame *frame) { int_compare(vm, frame, [](int32_t a, int32_t b) { return a >= b; }); }
+void stencil_eq(VM *vm, NativeFrame *frame) { int_compare(vm, frame, [](int32_t a, int32_t b) { return a == b; }); }
+void stencil_ne(VM *vm, NativeFrame *frame) { int_compare(vm, frame, [](int32_t a, int32_t b) { return a != b; }); }
+
+// Jumps within the function. A backward one spends a tick like FOR_LOOP.
+void stencil_jump(VM *vm, NativeFrame *frame) { _JIT_TARGET(vm, frame); }
+
+void stencil_loop(VM *vm, NativeFrame *frame) {
+    if (*frame->budget == 1) return branch(vm, frame);
+
+    --*frame->budget;
+    _JIT_TARGET(vm, frame);
+}
+
+void stencil_jump_if_false(VM *vm, NativeFrame *frame) { jump_if<false>(vm, frame); }
+void stencil_jump_if_true(VM *vm, NativeFrame *frame)  { jump_if<true>(vm, frame); }
+
+// FOR_LOOP, one stencil per comparison; the operand is the counter's slot
+void stencil_for_lt(VM *vm, NativeFrame *frame) { for_loop(vm, frame, [](int32_t c, int32_t l) { return c < l; }); }
+void stencil_for_le(VM *vm, NativeFrame *frame) { for_loop(vm, frame, [](int32_t c, int32_t l) { return c <= l; }); }
+void stencil_for_gt(VM *vm, NativeFrame *frame) { for_loop(vm, frame, [](int32_t c, int32_t l) { return c > l; }); }
+void stencil_for_ge(VM *vm, NativeFrame *frame) { for_loop(vm, frame, [](int32_t c, int32_t l) { return c >= l; }); }
+
+// Falling off the end of the code leaves ip past it (the Next hole); VM::run
+// pops the frame
+void stencil_exit(VM *, NativeFrame *frame) {
+    *frame->ip = static_cast<int>(HOLE(_JIT_NEXT));
+}
+
+}
@@ -1,31 +1,98 @@
 #include "vm.hpp"
 #include "threading.hpp"
 
+#include <map>
+
+// The worker running on this OS thread, null outside the workers
+static thread_local Worker *current_worker = nullptr;
+
 GreenThread::Ptr Scheduler::get_thread_by_id(size_t id) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     auto it = threads.find(id);
     return it != threads.end() ? it->second : nullptr;
 }
 
 void Scheduler::add_thread(GreenThread::Ptr thread) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     threads[thread->ID] = thread;
 }
 
-void Scheduler::enqueue(GreenThread::Ptr thread) {
-    ready_queue.push_back(thread->ID);
+// Queues a ready thread on the calling worker (to run next with `next`). Called
+// with `lock` held, so that a worker about to park cannot miss it.
+void Scheduler::enqueue(GreenThread::Ptr thread, bool next) {
+    thread->ready_since = std::chrono::steady_clock::now();
+
+    if (!current_worker) {
+        injection_queue.push_back(thread.get());
+    } else if (next) {
+        if (auto *previous = current_worker->run_next.exchange(thread.get())) current_worker->ready.push(previous);
+    } else {
+        current_worker->ready.push(thread.get());
+    }
+
+    idle.notify_one();
+}
+
+// Makes a blocked thread ready. One still on its worker is only marked, and
+// the worker requeues it once its slice is over (see finish_slice). Anything
+// else is a stale waiter (already woken, or killed) and is left alone, so a
+// thread is never queued twice.
+void Scheduler::wake(const GreenThread::Ptr &thread, bool next) {
+    if (thread->state != GreenThread::Blocked) return;
+    if (thread->timer) cancel_timer(*thread);
+
+    thread->state = GreenThread::Ready;
+    event_trace::record(event_trace::Kind::Wake, thread->ID);
+    if (!thread->on_cpu) enqueue(thread, next);
 }
 
-GreenThread::Ptr Scheduler::dequeue() {
-    if (ready_queue.empty()) return nullptr;
-    size_t tid = ready_queue.front();
-    ready_queue.pop_front();
-    return threads[tid];
+// Replaces the placeholder a blocking native left on `thread`'s stack. While
+// the thread is still on its worker the placeholder may not be pushed yet, so
+// the value waits for finish_slice.
+void Scheduler::resume_with(const GreenThread::Ptr &thread, const Value &value) {
+    if (thread->on_cpu) {
+        thread->resume_value = value;
+    } else {
+        thread->stack[thread->stack_size - 1] = value;
+    }
+}
+
+GreenThread::Ptr Scheduler::dequeue(Worker &worker) {
+    dequeuing++;
+    GreenThread *thread = worker.run_next.exchange(nullptr);
+
+    if (!thread && !worker.ready.steal(thread)) { // the owner steals too: its own deque runs FIFO
+        {
+            std::lock_guard<std::recursive_mutex> guard(lock);
+            if (!injection_queue.empty()) {
+                thread = injection_queue.front();
+                injection_queue.pop_front();
+            }
+        }
+
+        for (size_t i = 1; !thread && i < workers.size(); i++) {
+            workers[(worker.index + i) % workers.size()]->ready.steal(thread);
+        }
+    }
+
+    auto owned = thread ? thread->shared_from_this() : nullptr;
+    dequeuing--;
+    return owned;
 }
 
-void Scheduler::block_thread(GreenThread::Ptr &thread) {
-    blocked_queue.emplace(thread->wake_time, thread->ID);
+// Frees the retired threads once nothing can reach them: every queue is empty
+// (only live threads are queued from now on) and no worker is between taking
+// a raw pointer and owning it. Called with `lock` held.
+void Scheduler::trim_retired() {
+    if (retired.empty() || !injection_queue.empty()) return;
+    for (const auto &other : workers) {
+        if (other->run_next || !other->ready.empty()) return;
+    }
+    if (dequeuing == 0) retired.clear(); // checked last: a thief counts itself before it looks
 }
 
 Value Scheduler::get_return_value(size_t thread_id) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     if (auto it = return_values.find(thread_id); it != return_values.end()) {
         return it->second;
     }
@@ -34,137 +101,454 @@ Value Scheduler::get_return_value(size_t thread_id) {
 }
 
 void Scheduler::set_return_value(GreenThread::Ptr &thread, const Value &return_value) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     return_values[thread->ID] = return_value;
 }
 
+Pipe::Ptr Scheduler::create_pipe(size_t capacity) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    size_t pipe_id = next_pipe_id++;
+
+    auto pipe = std::make_shared<Pipe>(pipe_id, capacity);
+    pipes[pipe_id] = pipe;
+    return pipe;
+}
+
 Pipe::Ptr Scheduler::get_pipe_by_id(size_t id) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     auto it = pipes.find(id);
     return it != pipes.end() ? it->second : nullptr;
 }
 
-void Scheduler::notify_pipe_select_waiters(Pipe::Ptr &pipe) {
-    for (auto &thread : pipe->select_waiters) {
+void Scheduler::notify_watchers(Pipe::Ptr &pipe) {
+    for (auto &thread : pipe->watchers) {
         if (thread->state == GreenThread::Blocked) {
-            thread->state = GreenThread::Ready;
-            enqueue(thread);
+            wake(thread);
         }
     }
 
-    pipe->select_waiters.clear();
+    pipe->watchers.clear();
+    pipe->watcher_count = 0;
 }
 
-void Scheduler::send_to_pipe(GreenThread::Ptr &current_thread, Pipe::Ptr pipe, const Value &val) {
+// The first blocked select waiting to send to (or receive from) `pipe`
+SelectNode *Scheduler::find_select(Pipe &pipe, SelectCase::Type type, int64_t other_than) {
+    for (SelectNode *node = pipe.selects.head; node; node = node->next) {
+        if (node->frame->cases[node->index].type == type && static_cast<int64_t>(node->thread->ID) != other_than) return node;
+    }
+
+    return nullptr;
+}
+
+void Scheduler::unregister_select(SelectFrame &frame) {
+    for (auto &node : frame.nodes) node.pipe->selects.remove(node);
+    frame.nodes.clear();
+}
+
+// Settles a blocked select on `node`'s case: only the first event to claim the
+// frame gets here, and none of its nodes stays registered
+void Scheduler::complete_select(SelectNode &node, const Value &received) {
+    SelectFrame &frame = *node.frame;
+    frame.claimed = true;
+    frame.chosen = node.index;
+    frame.received = received;
+
+    auto thread = node.thread->shared_from_this();
+    unregister_select(frame); // `node` is gone from here on
+    wake(thread);
+}
+
+// Restores what lock-free sends and receives may have raced past, with `lock`
+// held: no reader stays parked while a value is buffered, no writer while
+// there is room, and no reader and writer park on the same pipe together
+void Scheduler::settle_pipe(Pipe::Ptr &pipe) {
+    bool progress = true;
+    while (progress) {
+        progress = false;
+
+        Value val;
+        if (!pipe->readers.empty() && pipe->buffer.try_pop(val)) {
+            hand_to_reader(pipe, std::move(val));
+            progress = true;
+        }
+
+        if (!pipe->writers.empty()) {
+            GreenThread &writer = *pipe->writers.head;
+            if (pipe->buffer.try_push(writer.pending_values[writer.pending_next])) {
+                take_from_writer(pipe); // already moved into the buffer
+                progress = true;
+            }
+        }
+
+        // direct handoff, as on an unbuffered pipe
+        if (!pipe->readers.empty() && !pipe->writers.empty()) {
+            hand_to_reader(pipe, take_from_writer(pipe));
+            progress = true;
+        }
+
+        if (!pipe->selects.head) continue;
+
+        // blocked selects take part like parked readers and writers
+        if (auto node = find_select(*pipe, SelectCase::Recv)) {
+            if (pipe->buffer.try_pop(val)) {
+                event_trace::record(event_trace::Kind::Recv, node->thread->ID, pipe->ID);
+                complete_select(*node, val);
+                progress = true;
+            } else if (!pipe->writers.empty()) {
+                complete_select(*node, take_from_writer(pipe));
+                progress = true;
+            }
+        }
+
+        if (auto node = find_select(*pipe, SelectCase::Send)) {
+            Value sent = node->frame->cases[node->index].value;
+            if (!pipe->readers.empty()) {
+                event_trace::record(event_trace::Kind::Send, node->thread->ID, pipe->ID);
+                hand_to_reader(pipe, sent);
+                complete_select(*node);
+                progress = true;
+            } else if (pipe->buffer.try_push(sent)) {
+                event_trace::record(event_trace::Kind::Send, node->thread->ID, pipe->ID);
+                complete_select(*node);
+                progress = true;
+            } else if (auto receiver = find_select(*pipe, SelectCase::Recv, node->thread->ID)) {
+                // two blocked selects meet on an unbuffered pipe
+                event_trace::record(event_trace::Kind::Send, node->thread->ID, pipe->ID);
+                event_trace::record(event_trace::Kind::Recv, receiver->thread->ID, pipe->ID);
+                complete_select(*receiver, node->frame->cases[node->index].value);
+                complete_select(*node);
+                progress = true;
+            }
+        }
+    }
+
+    notify_watchers(pipe);
+}
+
+// Wakes the first parked reader with `val`. A recv_many reader also takes
+// whatever else is ready, up to its batch size, and gets them as an array.
+void Scheduler::hand_to_reader(Pipe::Ptr &pipe, Value val) {
+    auto reader = pipe->readers.pop_front();
+    event_trace::record(event_trace::Kind::Recv, reader->ID, pipe->ID);
+
+    if (reader->recv_batch == 0) {
+        resume_with(reader, val);
+    } else {
+        std::vector<Value> values { std::move(val) };
+        take_available(pipe, values, reader->recv_batch, reader->ID);
+        reader->recv_batch = 0;
+        resume_with(reader, std::make_shared<Array>(std::move(values)));
+    }
+
+    wake(reader);
+}
+
+// The next value of the first parked writer. The writer is woken once it has
+// handed over all of its values.
+Value Scheduler::take_from_writer(Pipe::Ptr &pipe) {
+    GreenThread &writer = *pipe->writers.head;
+    Value val = std::move(writer.pending_values[writer.pending_next++]);
+    event_trace::record(event_trace::Kind::Send, writer.ID, pipe->ID);
+
+    if (writer.pending_next == writer.pending_values.size()) {
+        auto done = pipe->writers.pop_front();
+        if (done->send_batch) resume_with(done, static_cast<int>(done->send_batch));
+
+        done->pending_values.clear();
+        done->pending_next = 0;
+        done->send_batch = 0;
+        wake(done);
+    }
+
+    return val;
+}
+
+// Moves up to `max` ready values into `out` without blocking: the buffered
+// ones, then those of parked writers. Returns how many were taken; the caller
+// settles the pipe afterwards.
+size_t Scheduler::take_available(Pipe::Ptr &pipe, std::vector<Value> &out, size_t max, int64_t receiver) {
+    size_t taken = 0;
+    Value val;
+
+    while (taken < max) {
+        if (pipe->buffer.try_pop(val)) {
+            out.push_back(std::move(val));
+        } else if (!pipe->writers.empty()) {
+            out.push_back(take_from_writer(pipe));
+        } else {
+            break;
+        }
+
+        event_trace::record(event_trace::Kind::Recv, receiver, pipe->ID);
+        taken++;
+    }
+
+    return taken;
+}
+
+// Hands `val` to a parked reader or buffers it, with `lock` held. False when
+// the sender would have to wait.
+bool Scheduler::try_send(int64_t sender, Pipe::Ptr &pipe, const Value &val) {
     if (pipe->closed) {
         throw std::runtime_error("Cannot send to a closed pipe");
     }
 
-    // direct handoff to a waiting reader
+    // direct handoff to a waiting reader, or to a select waiting to receive
     if (!pipe->readers.empty()) {
-        auto reader = pipe->readers.front();
-        pipe->readers.pop_front();
+        event_trace::record(event_trace::Kind::Send, sender, pipe->ID);
+        hand_to_reader(pipe, val);
+
+        notify_watchers(pipe);
+        return true;
+    }
 
-        reader->stack[reader->stack_size - 1] = val;
-        reader->state = GreenThread::Ready;
-        enqueue(reader);
+    if (auto node = find_select(*pipe, SelectCase::Recv, sender)) {
+        event_trace::record(event_trace::Kind::Send, sender, pipe->ID);
+        event_trace::record(event_trace::Kind::Recv, node->thread->ID, pipe->ID);
+        complete_select(*node, val);
 
-        notify_pipe_select_waiters(pipe);
-        return;
+        notify_watchers(pipe);
+        return true;
     }
 
     // buffer has space
-    if (pipe->buffer.size() < pipe->capacity) {
-        pipe->buffer.push_back(val);
-        notify_pipe_select_waiters(pipe);
-        return;
+    Value copy = val;
+    if (pipe->buffer.try_push(copy)) {
+        event_trace::record(event_trace::Kind::Send, sender, pipe->ID);
+        notify_watchers(pipe);
+        return true;
     }
 
-    // Block the current thread
-    pipe->writers.push_back(current_thread);
-    current_thread->state = GreenThread::Blocked;
-    current_thread->wake_time = {};
-    current_thread->pending_value = val;
+    return false;
 }
 
-Value Scheduler::receive_from_pipe(GreenThread::Ptr current_thread, Pipe::Ptr pipe) {
-    if (!pipe->buffer.empty()) {
-        Value val = pipe->buffer.front();
-        pipe->buffer.pop_front();
+// Takes a buffered value or one from a parked writer, with `lock` held. Empty
+// when there is none, whether or not the pipe is closed.
+std::optional<Value> Scheduler::try_receive(int64_t receiver, Pipe::Ptr &pipe) {
+    Value val;
+    if (pipe->buffer.try_pop(val)) {
+        event_trace::record(event_trace::Kind::Recv, receiver, pipe->ID);
 
-        // wake up a waiting writer if any
-        if (!pipe->writers.empty()) {
-            auto writer = pipe->writers.front();
-            pipe->writers.pop_front();
+        // a waiting writer's value takes the freed slot
+        settle_pipe(pipe);
+        return val;
+    }
 
-            pipe->buffer.push_back(writer->pending_value);
+    // direct handoff from a waiting writer, or from a select waiting to send
+    if (!pipe->writers.empty()) {
+        val = take_from_writer(pipe);
+        event_trace::record(event_trace::Kind::Recv, receiver, pipe->ID);
 
-            writer->state = GreenThread::Ready;
-            enqueue(writer);
+        notify_watchers(pipe);
+        return val;
+    }
 
-            notify_pipe_select_waiters(pipe);
-        }
+    if (auto node = find_select(*pipe, SelectCase::Send, receiver)) {
+        val = node->frame->cases[node->index].value;
+        event_trace::record(event_trace::Kind::Send, node->thread->ID, pipe->ID);
+        event_trace::record(event_trace::Kind::Recv, receiver, pipe->ID);
+        complete_select(*node);
 
+        notify_watchers(pipe);
         return val;
     }
 
-    // direct handoff from a waiting writer
-    if (!pipe->writers.empty()) {
-        auto writer = pipe->writers.front();
-        pipe->writers.pop_front();
+    return std::nullopt;
+}
 
-        Value val = writer->pending_value;
+// Like try_receive, but a bounded pipe's buffer is tried without `lock`
+std::optional<Value> Scheduler::poll_pipe(int64_t receiver, Pipe::Ptr &pipe) {
+    if (pipe->buffer.lock_free()) {
+        Value val;
+        if (pipe->buffer.try_pop(val)) {
+            event_trace::record(event_trace::Kind::Recv, receiver, pipe->ID);
+
+            if (pipe->has_waiters()) {
+                std::lock_guard<std::recursive_mutex> guard(lock);
+                settle_pipe(pipe);
+            }
+            return val;
+        }
+    }
 
-        writer->state = GreenThread::Ready;
-        enqueue(writer);
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return try_receive(receiver, pipe);
+}
 
-        notify_pipe_select_waiters(pipe);
-        return val;
+// A bounded pipe with room takes the value without `lock`; the lock is only
+// taken to hand it to a parked thread or to park the sender
+void Scheduler::send_to_pipe(GreenThread::Ptr &current_thread, Pipe::Ptr pipe, const Value &val) {
+    int64_t sender = current_thread ? static_cast<int64_t>(current_thread->ID) : -1;
+
+    if (pipe->buffer.lock_free() && !pipe->closed) {
+        Value copy = val;
+        if (pipe->buffer.try_push(copy)) {
+            event_trace::record(event_trace::Kind::Send, sender, pipe->ID);
+
+            if (pipe->has_waiters()) {
+                std::lock_guard<std::recursive_mutex> guard(lock);
+                settle_pipe(pipe);
+            }
+            return;
+        }
     }
 
-    if (pipe->closed) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    if (try_send(sender, pipe, val)) return;
+    if (!current_thread) return; // an after() pipe the script filled meanwhile
+
+    // Block the current thread
+    current_thread->pending_values.assign(1, val);
+    current_thread->state = GreenThread::Blocked;
+    pipe->writers.push_back(*current_thread);
+
+    // a lock-free receive may have made room since try_send; settling also
+    // wakes select waiters, as a blocked writer makes the pipe receivable
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    settle_pipe(pipe);
+}
+
+// With `timeout_ms` >= 0 a reader that has to wait gets null once it runs out
+// (0 does not wait at all)
+Value Scheduler::receive_from_pipe(GreenThread::Ptr current_thread, Pipe::Ptr pipe, int timeout_ms) {
+    if (auto val = poll_pipe(current_thread->ID, pipe)) return *val;
+
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    // the pipe may have changed since poll_pipe let go of the lock
+    if (auto val = try_receive(current_thread->ID, pipe)) return *val;
+
+    if (pipe->closed || timeout_ms == 0) {
         return {}; // return null value on closed pipe
     }
 
     // Block the current thread
-    pipe->readers.push_back(current_thread);
     current_thread->state = GreenThread::Blocked;
-    current_thread->wake_time = {};
+    pipe->readers.push_back(*current_thread);
+    if (timeout_ms > 0) {
+        start_timer(timeout_ms, { TimerEvent::RecvTimeout, current_thread, pipe });
+    }
+
+    // a lock-free send may have filled the buffer since try_receive
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    settle_pipe(pipe);
     return {};
 }
 
 void Scheduler::close_pipe(Pipe::Ptr pipe) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
     pipe->closed = true;
 
-    // Wake up all waiting readers with null values
+    // values sent lock-free before the close still reach parked readers
+    settle_pipe(pipe);
+
+    // Wake up the remaining readers with null values (recv_many: no values)
     while (!pipe->readers.empty()) {
-        auto reader = pipe->readers.front();
-        pipe->readers.pop_front();
+        auto reader = pipe->readers.pop_front();
 
-        reader->stack[reader->stack_size - 1] = {}; // null value
-        reader->state = GreenThread::Ready;
-        enqueue(reader);
+        if (reader->recv_batch) {
+            reader->recv_batch = 0;
+            resume_with(reader, std::make_shared<Array>(std::vector<Value> {}));
+        } else {
+            resume_with(reader, {}); // null value
+        }
+        wake(reader);
     }
 
-    pipe->readers.clear();
+    // a receive case on a closed pipe completes with null
+    while (auto node = find_select(*pipe, SelectCase::Recv)) {
+        complete_select(*node);
+    }
 
     // Wake up all waiting writers with an error
-    while (!pipe->writers.empty()) {
-        auto writer = pipe->writers.front();
+    if (!pipe->writers.empty()) {
         pipe->writers.pop_front();
 
         throw std::runtime_error("Cannot write to a closed pipe");
     }
 
-    pipe->writers.clear();
+    notify_watchers(pipe);
+}
+
+// Hands over as many of `values` as parked readers and the buffer take, and
+// parks with the rest until readers have taken them all. Returns the number
+// of values sent.
+Value Scheduler::send_many_to_pipe(GreenThread::Ptr &current_thread, Pipe::Ptr pipe, const std::vector<Value> &values) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    if (pipe->closed) {
+        throw std::runtime_error("Cannot send to a closed pipe");
+    }
+
+    size_t sent = 0;
+    while (sent < values.size() && !pipe->readers.empty()) {
+        event_trace::record(event_trace::Kind::Send, current_thread->ID, pipe->ID);
+        hand_to_reader(pipe, values[sent++]);
+    }
+
+    for (Value copy; sent < values.size(); sent++) {
+        copy = values[sent];
+        if (!pipe->buffer.try_push(copy)) break;
+        event_trace::record(event_trace::Kind::Send, current_thread->ID, pipe->ID);
+    }
+
+    if (sent == values.size()) {
+        notify_watchers(pipe);
+        return static_cast<int>(sent);
+    }
+
+    // Block the current thread with the values left over
+    current_thread->pending_values.assign(values.begin() + sent, values.end());
+    current_thread->send_batch = values.size();
+    current_thread->state = GreenThread::Blocked;
+    pipe->writers.push_back(*current_thread);
 
-    notify_pipe_select_waiters(pipe);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    settle_pipe(pipe);
+    return {};
 }
 
-void Scheduler::select_begin(GreenThread::Ptr thread, uint8_t case_count) {
+// Up to `max` values as an array, waiting only while there are none. A closed
+// and drained pipe gives an empty array.
+Value Scheduler::receive_many_from_pipe(GreenThread::Ptr &current_thread, Pipe::Ptr pipe, size_t max) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    std::vector<Value> values;
+    if (take_available(pipe, values, max, current_thread->ID) != 0) {
+        settle_pipe(pipe);
+        return std::make_shared<Array>(std::move(values));
+    }
+
+    if (pipe->closed || max == 0) {
+        return std::make_shared<Array>(std::move(values));
+    }
+
+    // Block the current thread until a value arrives (see hand_to_reader)
+    current_thread->recv_batch = max;
+    current_thread->state = GreenThread::Blocked;
+    pipe->readers.push_back(*current_thread);
 
-    SelectFrame select_frame;
-    select_frame.cases.reserve(case_count);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    settle_pipe(pipe);
+    return {};
+}
+
+// Every value that is ready, as an array; never waits
+Value Scheduler::drain_pipe(GreenThread::Ptr &current_thread, Pipe::Ptr pipe) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    std::vector<Value> values;
+    if (take_available(pipe, values, SIZE_MAX, current_thread->ID) != 0) {
+        settle_pipe(pipe);
+    }
+
+    return std::make_shared<Array>(std::move(values));
+}
 
-    thread->active_select = std::make_unique<SelectFrame>(select_frame);
+void Scheduler::select_begin(GreenThread::Ptr thread, uint8_t case_count) {
+    thread->active_select = std::make_unique<SelectFrame>();
+    thread->active_select->cases.reserve(case_count);
 }
 
 void Scheduler::select_add_recv_case(GreenThread::Ptr thread, Pipe::Ptr pipe, uint16_t target_ip, uint8_t slot) {
@@ -192,48 +576,99 @@ void Scheduler::select_add_default_case(GreenThread::Ptr thread, uint16_t target
     thread->active_select->default_target_ip = target_ip;
 }
 
+// Runs a select: one of the ready cases at random, else the default, else the
+// thread blocks with a node on every case pipe and the first pipe event that
+// can complete a case does so (see complete_select). The thread then runs
+// this instruction again to pick up the outcome.
 void Scheduler::select_execute(GreenThread::Ptr current_thread, int &curr_ip) {
-    std::vector<SelectCase*> ready_cases;
-    for (auto &sel_case : current_thread->active_select->cases) {
-        if ((sel_case.type == SelectCase::Send && sel_case.pipe && sel_case.pipe->can_send()) ||
-            (sel_case.type == SelectCase::Recv && sel_case.pipe && sel_case.pipe->can_receive())) {
-            ready_cases.push_back(&sel_case);
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    auto &frame = *current_thread->active_select;
+    auto &cases = frame.cases;
+    auto &stats = current_thread->select_stats;
+    if (stats.wins.size() < cases.size()) stats.wins.resize(cases.size());
+
+    auto finish = [&](size_t index, const Value &received) {
+        const SelectCase &selected = cases[index];
+        if (selected.type == SelectCase::Recv && selected.slot != 0xFF) {
+            current_thread->stack[selected.slot] = received;
         }
+
+        event_trace::record(event_trace::Kind::Select, current_thread->ID, index);
+        stats.selects++;
+        stats.wins[index]++;
+        curr_ip = selected.target_ip;
+        current_thread->active_select = nullptr;
+    };
+
+    // completed by a pipe event while blocked
+    if (frame.claimed) {
+        stats.blocked++;
+        finish(frame.chosen, frame.received);
+        return;
     }
 
-    if (!ready_cases.empty()) {
+    auto is_ready = [](const SelectCase &sel_case) {
+        return (sel_case.type == SelectCase::Send && sel_case.pipe && sel_case.pipe->can_send()) ||
+               (sel_case.type == SelectCase::Recv && sel_case.pipe && sel_case.pipe->can_receive());
+    };
+
+    std::vector<size_t> ready_cases;
+    for (size_t i = 0; i < cases.size(); i++) {
+        if (is_ready(cases[i])) ready_cases.push_back(i);
+    }
+
+    while (!ready_cases.empty()) {
         // Randomly pick one of the ready cases
-        SelectCase *selected = ready_cases[rand() % ready_cases.size()];
+        size_t pick = rand() % ready_cases.size();
+        SelectCase &selected = cases[ready_cases[pick]];
 
-        if (selected->type == SelectCase::Recv) {
-            Value received = receive_from_pipe(current_thread, selected->pipe);
-            if (selected->slot != 0xFF) {
-                current_thread->stack[selected->slot] = received;
+        if (selected.type == SelectCase::Recv) {
+            auto received = try_receive(current_thread->ID, selected.pipe);
+            if (!received && selected.pipe->closed) received = Value{};
+
+            if (received) {
+                finish(ready_cases[pick], *received);
+                return;
             }
-        } else if (selected->type == SelectCase::Send) {
-            send_to_pipe(current_thread, selected->pipe, selected->value);
+        } else if (try_send(current_thread->ID, selected.pipe, selected.value)) {
+            finish(ready_cases[pick], {});
+            return;
         }
 
-        curr_ip = selected->target_ip;
-        current_thread->active_select = nullptr;
-        return;
+        // a lock-free send or receive on another worker got there first
+        ready_cases[pick] = ready_cases.back();
+        ready_cases.pop_back();
     }
 
     // No ready cases, jump to default if exists
-    if (current_thread->active_select->has_default) {
-        curr_ip = current_thread->active_select->default_target_ip;
+    if (frame.has_default) {
+        event_trace::record(event_trace::Kind::Select, current_thread->ID, -1);
+        stats.selects++;
+        stats.defaults++;
+        curr_ip = frame.default_target_ip;
         current_thread->active_select = nullptr;
         return;
     }
 
     // No default case, block the thread
-    for (const auto &sel_case : current_thread->active_select->cases) {
-        if (!sel_case.pipe) continue; // skip disabled cases
-        sel_case.pipe->select_waiters.push_back(current_thread);
+    frame.nodes.reserve(cases.size()); // the pipes point into it
+    for (size_t i = 0; i < cases.size(); i++) {
+        if (!cases[i].pipe) continue; // skip disabled cases
+        frame.nodes.push_back({ current_thread.get(), &frame, i, cases[i].pipe.get() });
+        cases[i].pipe->selects.push_back(frame.nodes.back());
     }
 
     current_thread->state = GreenThread::Blocked;
+    event_trace::record(event_trace::Kind::Select, current_thread->ID, -2);
     curr_ip -= 1; // stay on the SELECT_EXEC instruction
+
+    // a lock-free operation may have readied a case before the registration
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (auto &sel_case : cases) {
+        if (frame.claimed) break;
+        if (sel_case.pipe) settle_pipe(sel_case.pipe);
+    }
 }
 
 bool Pipe::can_receive() {
@@ -241,29 +676,105 @@ bool Pipe::can_receive() {
 }
 
 bool Pipe::can_send() {
-    return !closed && (!readers.empty() || buffer.size() < capacity);
+    return !closed && (!readers.empty() || !buffer.full());
 }
 
+std::optional<Value> Scheduler::join_threads(GreenThread::Ptr &waiter, const std::vector<size_t> &ids, JoinWait::Mode mode) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+
+    auto wait = std::make_unique<JoinWait>();
+    wait->mode = mode;
+    wait->results.resize(ids.size());
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        auto thread = get_thread_by_id(ids[i]);
+
+        // already exited
+        if (!thread || thread->state == GreenThread::Finished) {
+            Value result = get_return_value(ids[i]);
+            if (mode == JoinWait::One) return result;
+            if (mode == JoinWait::Any) return std::make_shared<Array>(std::vector<Value> { static_cast<int>(i), result });
+
+            wait->results[i] = result;
+            continue;
+        }
+
+        wait->nodes.push_back({ waiter.get(), thread.get(), i });
+    }
+
+    if (wait->nodes.empty()) {
+        return mode == JoinWait::All ? Value(std::make_shared<Array>(std::move(wait->results))) : Value{};
+    }
+
+    // the nodes are in place now, so the lists can point into them
+    for (auto &node : wait->nodes) node.target->joiners.push_back(node);
+    wait->remaining = wait->nodes.size();
+
+    waiter->join_wait = std::move(wait);
+    waiter->state = GreenThread::Blocked;
+    return std::nullopt;
+}
+
+void Scheduler::unregister_join(JoinWait &wait) {
+    for (auto &node : wait.nodes) {
+        if (node.target) node.target->joiners.remove(node);
+    }
+    wait.nodes.clear();
+}
+
+// Resumes the joins that were waiting for `thread`, which has exited (a killed
+// thread's result is null). Each waiter is woken once, by the exit that
+// completes its wait.
 void Scheduler::notify_waiters(GreenThread::Ptr &thread) {
-    for (auto it = join_map.begin(); it != join_map.end(); ) {
-        if (it->second == thread->ID) {
-            auto parent_thread = get_thread_by_id(it->first);
-            if (parent_thread && parent_thread->state != GreenThread::Finished) {
-                parent_thread->stack[parent_thread->stack_size - 1] = get_return_value(thread->ID);
-                parent_thread->state = GreenThread::Ready;
-                // put to the start of the ready queue
-                ready_queue.push_front(parent_thread->ID);
-            }
-            it = join_map.erase(it);
-        } else {
-            ++it;
+    if (!thread->joiners.head) return;
+    Value result = get_return_value(thread->ID);
+
+    while (JoinNode *node = thread->joiners.head) {
+        thread->joiners.remove(*node);
+        node->target = nullptr;
+
+        auto waiter = node->waiter->shared_from_this();
+        JoinWait &wait = *waiter->join_wait;
+
+        Value resumed;
+        switch (wait.mode) {
+            case JoinWait::One:
+                resumed = result;
+                break;
+            case JoinWait::All:
+                wait.results[node->index] = result;
+                if (--wait.remaining != 0) continue;
+                resumed = std::make_shared<Array>(std::move(wait.results));
+                break;
+            case JoinWait::Any:
+                resumed = std::make_shared<Array>(std::vector<Value> { static_cast<int>(node->index), result });
+                break;
+        }
+
+        unregister_join(wait);
+        waiter->join_wait = nullptr;
+
+        if (waiter->state != GreenThread::Finished) {
+            resume_with(waiter, resumed);
+            wake(waiter, true); // runs next
         }
     }
 }
 
 void Scheduler::kill_thread_and_children(GreenThread::Ptr &thread) {
     if (threads.erase(thread->ID) != 0) {
-        std::cerr << "[Killing thread " << thread->ID << "]\n";
+        if (thread->timer) cancel_timer(*thread);
+        if (thread->wait_list) thread->wait_list->remove(*thread);
+        if (thread->active_select) unregister_select(*thread->active_select);
+        if (thread->join_wait) unregister_join(*thread->join_wait);
+
+        // a killed thread stops at its next instruction; a deque may still hold it
+        if (thread->state != GreenThread::Finished) {
+            event_trace::record(event_trace::Kind::Exit, thread->ID, 1);
+            thread->state = GreenThread::Finished;
+            retired.push_back(thread);
+            notify_waiters(thread);
+        }
     }
 
     for (auto &child : thread->children) {
@@ -271,21 +782,55 @@ void Scheduler::kill_thread_and_children(GreenThread::Ptr &thread) {
     }
 }
 
-void Scheduler::wake_threads(const std::chrono::steady_clock::time_point &now) {
-    while (!blocked_queue.empty() && blocked_queue.top().first <= now) {
-        auto thread_id = blocked_queue.top().second;
-        blocked_queue.pop();
-        
-        auto thread_it = threads.find(thread_id);
-        if (thread_it == threads.end()) continue; // Thread might have finished
+// Arms a timer `ms` from now, rounded up so it never fires early. The event's
+// thread (if any) owns the timer until it fires or is cancelled.
+void Scheduler::start_timer(int ms, TimerEvent event) {
+    auto now = std::chrono::ceil<std::chrono::milliseconds>(std::chrono::steady_clock::now() - epoch);
+    auto thread = event.thread;
 
-        auto thread = thread_it->second;
-        thread->state = GreenThread::Ready;
-        thread->wake_time = {};
-        enqueue(thread);
+    auto timer = timers.add(static_cast<uint64_t>(now.count()) + ms, std::move(event));
+    if (thread) thread->timer = timer;
+}
+
+void Scheduler::cancel_timer(GreenThread &thread) {
+    timers.cancel(thread.timer);
+    thread.timer = nullptr;
+}
+
+void Scheduler::fire_timer(TimerEvent &event) {
+    if (event.thread) event.thread->timer = nullptr;
+
+    switch (event.kind) {
+        case TimerEvent::Sleep:
+            wake(event.thread);
+            break;
+        case TimerEvent::RecvTimeout: {
+            if (event.thread->wait_list != &event.pipe->readers) break; // served in the meantime
+
+            event.pipe->readers.remove(*event.thread);
+            resume_with(event.thread, {});
+            wake(event.thread);
+            break;
+        }
+        case TimerEvent::After: {
+            if (!event.pipe->can_send()) break; // closed, or filled by the script
+
+            // the same reading clock() gives
+            auto now = std::chrono::high_resolution_clock::now().time_since_epoch();
+            double seconds = std::chrono::duration_cast<std::chrono::milliseconds>(now).count() / 1000.0;
+            GreenThread::Ptr none;
+            send_to_pipe(none, event.pipe, seconds);
+            break;
+        }
     }
 }
 
+// Fires every timer due by `now`, with `lock` held
+void Scheduler::expire_timers(const std::chrono::steady_clock::time_point &now) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - epoch).count();
+    timers.advance(static_cast<uint64_t>(elapsed), [this](TimerEvent &event) { fire_timer(event); });
+}
+
 void Scheduler::send_to_sleep(GreenThread::Ptr thread, int ms) {
     // std::cout << "[Thread " << thread->ID << " sleeping for " << ms << " ms]\n";
     if (ms <= 0) {
@@ -293,98 +838,191 @@ void Scheduler::send_to_sleep(GreenThread::Ptr thread, int ms) {
         return;
     }
 
+    std::lock_guard<std::recursive_mutex> guard(lock);
     thread->state = GreenThread::Blocked;
-    thread->wake_time = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    start_timer(ms, { TimerEvent::Sleep, thread, nullptr });
 }
 
-void Scheduler::sleep_until_ready(const std::chrono::steady_clock::time_point &now) {
-    if (!blocked_queue.empty()) {
-        auto sleep_duration = blocked_queue.top().first - now;
-        if (sleep_duration.count() > 0) {
-            std::cerr << "[Scheduler sleeping for " 
-                      << std::chrono::duration_cast<std::chrono::milliseconds>(sleep_duration).count() 
-                      << " ms]\n";
-            std::this_thread::sleep_for(sleep_duration);
+// A pipe that receives the time once, `ms` from now; for select timeouts
+Pipe::Ptr Scheduler::after(int ms) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    auto pipe = create_pipe(1);
+    start_timer(std::max(ms, 0), { TimerEvent::After, nullptr, pipe });
+    return pipe;
+}
+
+// Parks an idle worker until work is queued, the next timer is due or the
+// program ends. Once every worker is parked with no timer pending, whatever
+// threads are left can never be woken: the run ends with a deadlock error.
+void Scheduler::wait_for_work(std::unique_lock<std::recursive_mutex> &guard) {
+    auto next_tick = timers.next_tick();
+    if (!next_tick) {
+        if (++idle_workers == workers.size() && !threads.empty()) {
+            idle_workers--;
+            deadlock = describe_deadlock();
+            done = true;
+            idle.notify_all();
+            return;
         }
+
+        idle.wait(guard);
+        idle_workers--;
+        return;
+    }
+
+    auto deadline = epoch + std::chrono::milliseconds(*next_tick);
+    auto sleep_duration = deadline - std::chrono::steady_clock::now();
+    if (sleep_duration.count() > 0) {
+        idle.wait_until(guard, deadline);
     }
 }
 
-Value Scheduler::schedule(VM &vm) {
-    Value final_return;
-
-    while (!threads.empty()) {
-        auto now = std::chrono::steady_clock::now();
-        wake_threads(now);
-
-        // print all threads
-        for (const auto& [id, thread] : threads) {
-            std::cerr << "[Thread " << id << " State: ";
-            switch (thread->state) {
-                case GreenThread::Running:  std::cerr << "Running"; break;
-                case GreenThread::Ready:    std::cerr << "Ready"; break;
-                case GreenThread::Blocked:  std::cerr << "Blocked"; break;
-                case GreenThread::Finished: std::cerr << "Finished"; break;
-            }
-            std::cerr << "]\n";
+// What each of the remaining (all blocked) threads is waiting for
+std::string Scheduler::describe_deadlock() {
+    std::map<size_t, std::string> waits;
+    for (const auto &[id, pipe] : pipes) {
+        pipe->readers.for_each([&](GreenThread &reader) { waits[reader.ID] = "receiving from pipe " + std::to_string(id); });
+        pipe->writers.for_each([&](GreenThread &writer) { waits[writer.ID] = "sending to pipe " + std::to_string(id); });
+        for (SelectNode *node = pipe->selects.head; node; node = node->next) {
+            if (!waits.count(node->thread->ID)) waits[node->thread->ID] = "selecting on pipe " + std::to_string(id);
         }
+        for (const auto &watcher : pipe->watchers) {
+            if (!waits.count(watcher->ID)) waits[watcher->ID] = "iterating over pipe " + std::to_string(id);
+        }
+    }
+    for (const auto &[id, thread] : threads) {
+        if (!thread->join_wait) continue;
 
-        // print ready queue
-        std::cerr << "[Ready Queue: ";
-        for (const auto& tid : ready_queue) {
-            std::cerr << tid << " ";
+        std::string targets;
+        for (const auto &node : thread->join_wait->nodes) {
+            if (node.target) targets += (targets.empty() ? "" : ", ") + std::to_string(node.target->ID);
         }
-        std::cerr << "]\n";
-
-        // print blocked queue
-        std::cerr << "[Blocked Queue: ";
-        auto blocked_copy = blocked_queue;
-        while (!blocked_copy.empty()) {
-            std::cerr << "(" << blocked_copy.top().second << ", " 
-                      << std::chrono::duration_cast<std::chrono::milliseconds>(
-                          blocked_copy.top().first.time_since_epoch()).count() 
-                      << "ms) ";
-            blocked_copy.pop();
+
+        switch (thread->join_wait->mode) {
+            case JoinWait::One: waits[id] = "joining thread " + targets; break;
+            case JoinWait::All: waits[id] = "waiting for all of threads " + targets; break;
+            case JoinWait::Any: waits[id] = "waiting for any of threads " + targets; break;
         }
-        std::cerr << "]\n";
+    }
 
-        auto next_thread = dequeue();
-        if (!next_thread) {
-            // std::cout << "[No ready threads, scheduler sleeping]\n";
-            sleep_until_ready(now);
-            continue;
+    std::vector<size_t> ids;
+    for (const auto &[id, thread] : threads) ids.push_back(id);
+    std::sort(ids.begin(), ids.end());
+
+    std::string message = "Deadlock: all " + std::to_string(ids.size()) + " threads are blocked";
+    for (size_t id : ids) {
+        auto it = waits.find(id);
+        message += "\n  thread " + std::to_string(id) + ": " + (it != waits.end() ? it->second : "blocked");
+    }
+
+    return message;
+}
+
+// Bookkeeping once `thread` is off its worker, with `lock` held
+void Scheduler::finish_slice(GreenThread::Ptr &thread) {
+    thread->on_cpu = false;
+    event_trace::record(event_trace::Kind::Stop, thread->ID, thread->state);
+    if (!threads.count(thread->ID)) return; // killed while it ran
+
+    if (thread->resume_value) {
+        thread->stack[thread->stack_size - 1] = *thread->resume_value;
+        thread->resume_value.reset();
+    }
+
+    if (thread->state == GreenThread::Finished) {
+        event_trace::record(event_trace::Kind::Exit, thread->ID, 0);
+        final_return = get_return_value(thread->ID);
+        notify_waiters(thread);
+        kill_thread_and_children(thread);
+
+        if (threads.empty()) {
+            done = true;
+            idle.notify_all();
         }
+        return;
+    }
 
-        // std::cout << "[Scheduling thread " << next_thread->ID << "]\n";
+    // parked until woken (its timer, if any, is already running)
+    if (thread->state == GreenThread::Blocked) {
+        event_trace::record(event_trace::Kind::Block, thread->ID);
+        return;
+    }
 
-        next_thread->state = GreenThread::Running;
+    // preempted, yielded, or woken before its slice was over
+    thread->state = GreenThread::Ready;
+    enqueue(thread);
+}
 
-        vm.current_thread = next_thread;
-        vm.run();
-        vm.current_thread = nullptr;
-        
-        final_return = get_return_value(next_thread->ID);
+void Scheduler::run_worker(VM &vm, Worker &worker) {
+    current_worker = &worker;
+    event_trace::worker = static_cast<int16_t>(worker.index);
 
-        if (next_thread->state == GreenThread::Finished) {
-            notify_waiters(next_thread);
-            kill_thread_and_children(next_thread);
-            continue;
+    while (true) {
+        {
+            std::unique_lock<std::recursive_mutex> guard(lock);
+            if (done) break;
+
+            expire_timers(std::chrono::steady_clock::now());
         }
-        
-        if (next_thread->state == GreenThread::Blocked) {
-            if (next_thread->wake_time == std::chrono::steady_clock::time_point{}) {
-                // Blocked without a wake time (e.g., waiting for join)
-                continue;
+
+        auto next_thread = dequeue(worker);
+        if (!next_thread) {
+            std::unique_lock<std::recursive_mutex> guard(lock);
+            trim_retired();
+            if (!done && !worker.run_next && worker.ready.empty() && injection_queue.empty()) {
+                wait_for_work(guard);
             }
+            continue;
+        }
 
-            block_thread(next_thread);
+        next_thread->on_cpu = true;
+        auto ready = GreenThread::Ready;
+        if (!next_thread->state.compare_exchange_strong(ready, GreenThread::Running)) { // killed while queued
+            next_thread->on_cpu = false;
             continue;
         }
 
-        next_thread->state = GreenThread::Ready;
-        enqueue(next_thread);
+        auto &stats = next_thread->slice_stats;
+        stats.max_wait = std::max(stats.max_wait, std::chrono::steady_clock::now() - next_thread->ready_since);
+        stats.slices++;
+
+        // without a budget the count never reaches zero
+        int64_t budget = slice_budget ? static_cast<int64_t>(slice_budget) : INT64_MAX;
+        next_thread->budget = budget;
+
+        vm.current_thread = next_thread;
+        event_trace::record(event_trace::Kind::Run, next_thread->ID);
+        vm.run();
+        vm.current_thread = nullptr;
+
+        stats.ticks += static_cast<size_t>(budget - next_thread->budget);
+
+        std::lock_guard<std::recursive_mutex> guard(lock);
+        finish_slice(next_thread);
     }
 
-    return final_return;
+    current_worker = nullptr;
+    event_trace::worker = -1;
 }
 
+Value Scheduler::schedule(VM &vm) {
+    for (size_t i = 0; i < std::max<size_t>(worker_count, 1); i++) {
+        workers.push_back(std::make_unique<Worker>(i));
+    }
+
+    // this thread is worker 0
+    std::vector<std::thread> os_threads;
+    for (size_t i = 1; i < workers.size(); i++) {
+        os_threads.emplace_back([this, &vm, i]() { run_worker(vm, *workers[i]); });
+    }
+
+    run_worker(vm, *workers[0]);
+
+    for (auto &os_thread : os_threads) {
+        os_thread.join();
+    }
 
+    if (!deadlock.empty()) throw std::runtime_error(deadlock);
+
+    return final_return;
+}
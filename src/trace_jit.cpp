@@ -0,0 +1,716 @@
+#include "trace_jit.hpp"
+#include "vm.hpp"
+
+namespace jit {
+
+// ==== Recording ====
+
+static TraceType type_of(const Value &v) {
+    if (v.is_int())  return TraceType::Int;
+    if (v.is_bool()) return TraceType::Bool;
+    return TraceType::Ref;
+}
+
+static bool is_unboxed(TraceType type) {
+    return type == TraceType::Int || type == TraceType::Bool;
+}
+
+static bool finish(TraceRecorder &rec);
+
+void TraceRecorder::abort() {
+    auto &slot = func->traces[trace->header];
+    if (++slot->attempts >= MAX_TRACE_ATTEMPTS) {
+        slot->failed = true;
+    }
+
+    trace = nullptr;
+    func = nullptr;
+    stack.clear();
+}
+
+// Returns false if the instruction cannot be traced
+static bool record_instruction(TraceRecorder &rec, VM &vm, CallFrame &frame, int pc, OpCode op) {
+    Trace &t = *rec.trace;
+    auto &stack = rec.stack;
+    const auto &chunk = rec.func->chunk;
+    GreenThread &thread = *vm.current_thread;
+    Value *locals = &thread.stack[frame.base];
+
+    auto u8  = [&](int at) { return chunk.code[at]; };
+    auto u16 = [&](int at) { return static_cast<uint16_t>((chunk.code[at] << 8) | chunk.code[at + 1]); };
+
+    auto emit = [&](TraceInstr instr) { t.body.push_back(instr); };
+    auto temp = [&]() { return t.reg_count++; };
+    auto side_exit = [&](int ip) {
+        t.exits.push_back({ ip, stack });
+        return static_cast<int>(t.exits.size()) - 1;
+    };
+    auto push_const = [&](int32_t v, TraceType type) {
+        int dst = temp();
+        emit({ TraceOp::Const, dst, -1, -1, v });
+        stack.push_back({ dst, type });
+    };
+
+    // slot registers are shared by every stack entry loaded from them, so an
+    // entry still on the stack must keep its own copy before the slot changes
+    auto detach = [&](int slot) {
+        for (auto &entry : stack) {
+            if (entry.reg != slot || !is_unboxed(entry.type)) continue;
+            int copy = temp();
+            emit({ TraceOp::Move, copy, slot });
+            entry.reg = copy;
+        }
+    };
+
+    auto use_slot = [&](int slot, TraceType type) {
+        if (t.slot_types[slot] == TraceType::Unknown) t.slot_types[slot] = type;
+        return t.slot_types[slot] == type;
+    };
+
+    auto binary = [&](TraceOp top, TraceType result) {
+        if (stack.size() < 2) return false;
+        StackEntry b = stack.back(); stack.pop_back();
+        StackEntry a = stack.back(); stack.pop_back();
+
+        bool ints = a.type == TraceType::Int && b.type == TraceType::Int;
+        bool bools = a.type == TraceType::Bool && b.type == TraceType::Bool;
+        if (!ints && !(bools && (top == TraceOp::Eq || top == TraceOp::Ne))) return false;
+
+        int dst = temp();
+        emit({ top, dst, a.reg, b.reg });
+        stack.push_back({ dst, result });
+        return true;
+    };
+
+    switch (op) {
+        case OP_TRUE:    push_const(1, TraceType::Bool); return true;
+        case OP_FALSE:   push_const(0, TraceType::Bool); return true;
+        case OP_ICONST8: push_const(static_cast<int8_t>(u8(pc + 1)), TraceType::Int); return true;
+        case OP_ICONST16: push_const(static_cast<int16_t>(u16(pc + 1)), TraceType::Int); return true;
+        case OP_CONST:
+        case OP_CONST_LONG: {
+            size_t idx = op == OP_CONST ? u16(pc + 1) : (u8(pc + 1) << 16) | u16(pc + 2);
+            const Value &v = (*chunk.constants)[idx];
+            if (v.is_int())  { push_const(v.as_int(), TraceType::Int); return true; }
+            if (v.is_bool()) { push_const(v.as_bool(), TraceType::Bool); return true; }
+            return false;
+        }
+        case OP_LOAD_LOCAL: {
+            size_t slot = u8(pc + 1);
+            if (slot >= t.stack_depth) {
+                // a local declared inside the loop body lives on the virtual stack
+                if (slot - t.stack_depth >= stack.size()) return false;
+                stack.push_back(stack[slot - t.stack_depth]);
+                return true;
+            }
+
+            TraceType type = type_of(locals[slot]);
+            if (!use_slot(static_cast<int>(slot), type)) return false;
+            stack.push_back({ static_cast<int>(slot), type });
+            return true;
+        }
+        case OP_STORE_LOCAL: {
+            size_t slot = u8(pc + 1);
+            if (stack.empty() || !is_unboxed(stack.back().type)) return false;
+            StackEntry value = stack.back();
+
+            if (slot >= t.stack_depth) {
+                size_t idx = slot - t.stack_depth;
+                if (idx >= stack.size() || stack[idx].type != value.type) return false;
+                int copy = temp();
+                emit({ TraceOp::Move, copy, value.reg });
+                stack[idx] = { copy, value.type };
+                return true;
+            }
+
+            if (!use_slot(static_cast<int>(slot), value.type)) return false;
+            if (value.reg != static_cast<int>(slot)) {
+                detach(static_cast<int>(slot));
+                emit({ TraceOp::Move, static_cast<int>(slot), value.reg });
+            }
+            t.written[slot] = true;
+            return true;
+        }
+        case OP_POP:
+            if (stack.empty()) return false;
+            stack.pop_back();
+            return true;
+        case OP_DUP:
+            if (stack.empty()) return false;
+            stack.push_back(stack.back());
+            return true;
+        case OP_DUP2: {
+            if (stack.size() < 2) return false;
+            StackEntry a = stack[stack.size() - 2], b = stack.back();
+            stack.push_back(a);
+            stack.push_back(b);
+            return true;
+        }
+        case OP_ADD:
+        case OP_ADD_INT:     return binary(TraceOp::Add, TraceType::Int);
+        case OP_SUB:
+        case OP_SUB_INT:     return binary(TraceOp::Sub, TraceType::Int);
+        case OP_MUL:
+        case OP_MUL_INT:     return binary(TraceOp::Mul, TraceType::Int);
+        case OP_BIT_AND:     return binary(TraceOp::And, TraceType::Int);
+        case OP_BIT_OR:      return binary(TraceOp::Or,  TraceType::Int);
+        case OP_BIT_XOR:     return binary(TraceOp::Xor, TraceType::Int);
+        case OP_SHIFT_LEFT:  return binary(TraceOp::Shl, TraceType::Int);
+        case OP_SHIFT_RIGHT: return binary(TraceOp::Shr, TraceType::Int);
+        case OP_LT:
+        case OP_LT_INT:      return binary(TraceOp::Lt,  TraceType::Bool);
+        case OP_LE:
+        case OP_LE_INT:      return binary(TraceOp::Le,  TraceType::Bool);
+        case OP_GT:
+        case OP_GT_INT:      return binary(TraceOp::Gt,  TraceType::Bool);
+        case OP_GE:
+        case OP_GE_INT:      return binary(TraceOp::Ge,  TraceType::Bool);
+        case OP_EQ:          return binary(TraceOp::Eq,  TraceType::Bool);
+        case OP_NEQ:         return binary(TraceOp::Ne,  TraceType::Bool);
+        case OP_MOD:
+        case OP_MOD_INT: {
+            // a zero (or -1) divisor leaves to the interpreter, operands still on the stack
+            int exit = side_exit(pc);
+            if (!binary(TraceOp::Mod, TraceType::Int)) return false;
+            t.body.back().exit = exit;
+            return true;
+        }
+        case OP_NOT: {
+            if (stack.empty() || !is_unboxed(stack.back().type)) return false;
+            int dst = temp();
+            emit({ TraceOp::Not, dst, stack.back().reg });
+            stack.back() = { dst, TraceType::Bool };
+            return true;
+        }
+        case OP_NEG:
+        case OP_BIT_NOT: {
+            if (stack.empty() || stack.back().type != TraceType::Int) return false;
+            int dst = temp();
+            if (op == OP_NEG) {
+                emit({ TraceOp::Neg, dst, stack.back().reg });
+            } else {
+                int ones = temp();
+                emit({ TraceOp::Const, ones, -1, -1, -1 });
+                emit({ TraceOp::Xor, dst, stack.back().reg, ones });
+            }
+            stack.back() = { dst, TraceType::Int };
+            return true;
+        }
+        case OP_JUMP: {
+            int target = pc + 3 + static_cast<int16_t>(u16(pc + 1));
+            if (target > pc) return true; // forward jumps just continue the trace
+            return target == t.header && stack.empty() && finish(rec);
+        }
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE: {
+            if (stack.empty() || !is_unboxed(stack.back().type)) return false;
+            int next = pc + 3;
+            int target = next + static_cast<int16_t>(u16(pc + 1));
+            if (target <= pc) return false;
+
+            bool truthy = thread.stack[thread.stack_size - 1].is_truthy();
+            bool taken = (op == OP_JUMP_IF_TRUE) == truthy;
+
+            TraceInstr guard { TraceOp::Guard, -1, stack.back().reg };
+            guard.imm = truthy;
+            guard.exit = side_exit(taken ? next : target);
+            emit(guard);
+            return true;
+        }
+        case OP_FOR_LOOP: {
+            int slot = u8(pc + 1);
+            OpCode cmp = static_cast<OpCode>(u8(pc + 2));
+            int next = pc + 5;
+            int target = next + static_cast<int16_t>(u16(pc + 3));
+            if (target != t.header || !stack.empty()) return false;
+            if (static_cast<size_t>(slot) + 2 >= t.stack_depth) return false;
+
+            for (int i = 0; i < 3; i++) {
+                if (!locals[slot + i].is_int() || !use_slot(slot + i, TraceType::Int)) return false;
+            }
+
+            emit({ TraceOp::Add, slot, slot, slot + 2 });
+            t.written[slot] = true;
+
+            TraceOp test = (cmp == OP_LT) ? TraceOp::Lt : (cmp == OP_LE) ? TraceOp::Le :
+                           (cmp == OP_GT) ? TraceOp::Gt : TraceOp::Ge;
+            int again = temp();
+            emit({ test, again, slot, slot + 1 });
+
+            TraceInstr guard { TraceOp::Guard, -1, again };
+            guard.imm = 1;
+            guard.exit = side_exit(next);
+            emit(guard);
+
+            return finish(rec);
+        }
+        case OP_LOAD_INDEX: {
+            if (stack.size() < 2) return false;
+            StackEntry index = stack.back();
+            StackEntry container = stack[stack.size() - 2];
+            if (index.type != TraceType::Int || container.type != TraceType::Ref) return false;
+
+            TraceType elem;
+            try {
+                Value v = thread.stack[thread.stack_size - 2].get_index(thread.stack[thread.stack_size - 1]);
+                elem = type_of(v);
+            } catch (...) {
+                return false;
+            }
+            if (!is_unboxed(elem)) return false;
+
+            TraceInstr load { TraceOp::LoadElem, temp(), index.reg };
+            load.imm = container.reg;
+            load.type = elem;
+            load.exit = side_exit(pc);
+            emit(load);
+
+            stack.pop_back();
+            stack.back() = { load.dst, elem };
+            return true;
+        }
+        case OP_STORE_INDEX: {
+            if (stack.size() < 3) return false;
+            StackEntry value = stack.back();
+            StackEntry index = stack[stack.size() - 2];
+            StackEntry container = stack[stack.size() - 3];
+            if (!is_unboxed(value.type) || index.type != TraceType::Int || container.type != TraceType::Ref) {
+                return false;
+            }
+
+            TraceInstr store { TraceOp::StoreElem, -1, index.reg, value.reg };
+            store.imm = container.reg;
+            store.type = value.type;
+            store.exit = side_exit(pc);
+            emit(store);
+
+            stack.resize(stack.size() - 3);
+            stack.push_back(value);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+void TraceRecorder::record(VM &vm, CallFrame &frame, int pc, OpCode op) {
+    if (vm.current_thread.get() != thread || vm.current_thread->frames.size() != frame_depth ||
+        frame.closure->func.get() != func || ++length > MAX_TRACE_LENGTH) {
+        abort();
+        return;
+    }
+
+    if (!record_instruction(*this, vm, frame, pc, op)) {
+        abort();
+    }
+}
+
+// ==== Optimization ====
+
+static bool is_pure(TraceOp op) {
+    return op != TraceOp::Mod && op != TraceOp::Guard && op != TraceOp::LoadElem && op != TraceOp::StoreElem;
+}
+
+static int32_t fold(TraceOp op, int32_t a, int32_t b) {
+    switch (op) {
+        case TraceOp::Add: return static_cast<int32_t>(static_cast<uint32_t>(a) + static_cast<uint32_t>(b));
+        case TraceOp::Sub: return static_cast<int32_t>(static_cast<uint32_t>(a) - static_cast<uint32_t>(b));
+        case TraceOp::Mul: return static_cast<int32_t>(static_cast<uint32_t>(a) * static_cast<uint32_t>(b));
+        case TraceOp::And: return a & b;
+        case TraceOp::Or:  return a | b;
+        case TraceOp::Xor: return a ^ b;
+        case TraceOp::Shl: return static_cast<int32_t>(static_cast<uint32_t>(a) << (b & 31));
+        case TraceOp::Shr: return a >> (b & 31);
+        case TraceOp::Neg: return static_cast<int32_t>(0u - static_cast<uint32_t>(a));
+        case TraceOp::Not: return a == 0;
+        case TraceOp::Lt:  return a < b;
+        case TraceOp::Le:  return a <= b;
+        case TraceOp::Gt:  return a > b;
+        case TraceOp::Ge:  return a >= b;
+        case TraceOp::Eq:  return a == b;
+        case TraceOp::Ne:  return a != b;
+        default:           return 0;
+    }
+}
+
+static void optimize(Trace &t) {
+    size_t slots = t.stack_depth;
+    std::vector<bool> slot_written(slots, false);
+    for (const auto &instr : t.body) {
+        if (instr.dst >= 0 && static_cast<size_t>(instr.dst) < slots) slot_written[instr.dst] = true;
+    }
+
+    // Constant folding: temps are assigned once, so a temp set from constants stays constant
+    std::unordered_map<int, int32_t> consts;
+    for (auto &instr : t.body) {
+        bool temp_dst = instr.dst >= 0 && static_cast<size_t>(instr.dst) >= slots;
+        if (instr.op == TraceOp::Const) {
+            if (temp_dst) consts[instr.dst] = instr.imm;
+            continue;
+        }
+        if (!is_pure(instr.op) || instr.op == TraceOp::Move || !temp_dst) continue;
+
+        auto a = consts.find(instr.a);
+        auto b = consts.find(instr.b);
+        bool unary = instr.op == TraceOp::Neg || instr.op == TraceOp::Not;
+        if (a == consts.end() || (!unary && b == consts.end())) continue;
+
+        instr.imm = fold(instr.op, a->second, unary ? 0 : b->second);
+        instr.op = TraceOp::Const;
+        consts[instr.dst] = instr.imm;
+    }
+
+    // Guard elimination: guards on constants were proven by the recording itself, and
+    // a guard repeating an earlier one on an unchanged register cannot fail
+    std::vector<TraceInstr> body;
+    std::unordered_map<int, int32_t> checked;
+    for (const auto &instr : t.body) {
+        if (instr.op == TraceOp::Guard) {
+            if (consts.count(instr.a)) continue;
+            auto it = checked.find(instr.a);
+            if (it != checked.end() && it->second == instr.imm) continue;
+            checked[instr.a] = instr.imm;
+        } else if (instr.dst >= 0) {
+            checked.erase(instr.dst);
+        }
+        body.push_back(instr);
+    }
+
+    // Loop invariant code motion: pure instructions whose inputs never change
+    // inside the loop run once, before it
+    std::vector<bool> invariant(t.reg_count, false);
+    for (size_t s = 0; s < slots; s++) invariant[s] = !slot_written[s];
+
+    std::vector<TraceInstr> loop;
+    for (const auto &instr : body) {
+        bool temp_dst = instr.dst >= 0 && static_cast<size_t>(instr.dst) >= slots;
+        bool inputs_invariant = (instr.a < 0 || invariant[instr.a]) && (instr.b < 0 || invariant[instr.b]);
+        if (temp_dst && is_pure(instr.op) && inputs_invariant) {
+            t.preheader.push_back(instr);
+            invariant[instr.dst] = true;
+        } else {
+            loop.push_back(instr);
+        }
+    }
+
+    // Dead code elimination: temps nobody reads (including side exits) are dropped
+    std::vector<bool> used(t.reg_count, false);
+    for (const auto &exit : t.exits) {
+        for (const auto &entry : exit.stack) {
+            if (is_unboxed(entry.type)) used[entry.reg] = true;
+        }
+    }
+
+    auto sweep = [&](std::vector<TraceInstr> &code) {
+        std::vector<TraceInstr> kept;
+        for (auto it = code.rbegin(); it != code.rend(); ++it) {
+            bool temp_dst = it->dst >= 0 && static_cast<size_t>(it->dst) >= slots;
+            if (temp_dst && is_pure(it->op) && !used[it->dst]) continue;
+            if (it->a >= 0) used[it->a] = true;
+            if (it->b >= 0) used[it->b] = true;
+            kept.push_back(*it);
+        }
+        code.assign(kept.rbegin(), kept.rend());
+    };
+    sweep(loop);
+    sweep(t.preheader);
+
+    t.body = std::move(loop);
+}
+
+// ==== Native code ====
+
+struct TraceContext {
+    Value *locals;
+};
+
+// Element access goes through Value so bounds checks and conversions match the interpreter
+static int trace_load_elem(TraceContext *ctx, int slot, int index, int32_t *out, int type) {
+    try {
+        Value v = ctx->locals[slot].get_index(index);
+        if (type == static_cast<int>(TraceType::Int) && v.is_int()) {
+            *out = v.as_int();
+            return 0;
+        }
+        if (type == static_cast<int>(TraceType::Bool) && v.is_bool()) {
+            *out = v.as_bool();
+            return 0;
+        }
+    } catch (...) {}
+
+    return 1;
+}
+
+static int trace_store_elem(TraceContext *ctx, int slot, int index, int32_t value, int type) {
+    try {
+        if (type == static_cast<int>(TraceType::Bool)) {
+            ctx->locals[slot].set_index(index, value != 0);
+        } else {
+            ctx->locals[slot].set_index(index, static_cast<int>(value));
+        }
+    } catch (...) {
+        return 1;
+    }
+
+    return 0;
+}
+
+#if defined(__x86_64__)
+
+// Registers: rbx points at the int32 register file, r12 at the TraceContext.
+// The native function returns the index of the side exit it took.
+struct TraceAssembler : X86Assembler {
+    std::vector<std::pair<size_t, int>> exit_fixups; // rel32 position, exit index
+
+    static int32_t reg(int r) { return 4 * r; }
+
+    void exit_if(Cond cc, int exit) { exit_fixups.emplace_back(jcc(cc), exit); }
+
+    void arith(std::initializer_list<uint8_t> opcode, const TraceInstr &i) {
+        load(EAX, reg(i.a));
+        mem(opcode, EAX, reg(i.b));
+        store(reg(i.dst), EAX);
+    }
+
+    void compare(Cond cc, const TraceInstr &i) {
+        load(EAX, reg(i.a));
+        mem({ 0x3b }, EAX, reg(i.b)); // cmp eax, [b]
+        set_bool(cc);
+        store(reg(i.dst), EAX);
+    }
+
+    void call_elem_helper(const void *helper, const TraceInstr &i) {
+        bytes({ 0x4c, 0x89, 0xe7 });     // mov rdi, r12
+        mov_imm(ESI, static_cast<uint32_t>(i.imm));
+        load(EDX, reg(i.a));
+        if (i.op == TraceOp::LoadElem) {
+            mem({ 0x48, 0x8d }, ECX, reg(i.dst)); // lea rcx, [dst]
+        } else {
+            load(ECX, reg(i.b));
+        }
+        bytes({ 0x41, 0xb8 });           // mov r8d, type
+        u32(static_cast<uint32_t>(i.type));
+        call_abs(helper);
+        test_eax();
+        exit_if(NE, i.exit);
+    }
+
+    void instruction(const TraceInstr &i) {
+        switch (i.op) {
+            case TraceOp::Const: store_imm(reg(i.dst), i.imm); break;
+            case TraceOp::Move:
+                load(EAX, reg(i.a));
+                store(reg(i.dst), EAX);
+                break;
+            case TraceOp::Add: arith({ 0x03 }, i); break;
+            case TraceOp::Sub: arith({ 0x2b }, i); break;
+            case TraceOp::Mul: arith({ 0x0f, 0xaf }, i); break;
+            case TraceOp::And: arith({ 0x23 }, i); break;
+            case TraceOp::Or:  arith({ 0x0b }, i); break;
+            case TraceOp::Xor: arith({ 0x33 }, i); break;
+            case TraceOp::Shl:
+            case TraceOp::Shr:
+                load(EAX, reg(i.a));
+                load(ECX, reg(i.b));
+                bytes({ 0xd3, static_cast<uint8_t>(i.op == TraceOp::Shl ? 0xe0 : 0xf8) }); // shl/sar eax, cl
+                store(reg(i.dst), EAX);
+                break;
+            case TraceOp::Mod:
+                cmp_imm8(reg(i.b), 0);
+                exit_if(EQ, i.exit);
+                cmp_imm8(reg(i.b), -1);
+                exit_if(EQ, i.exit);
+                load(EAX, reg(i.a));
+                bytes({ 0x99 });            // cdq
+                mem({ 0xf7 }, 7, reg(i.b)); // idiv dword [b]
+                store(reg(i.dst), EDX);
+                break;
+            case TraceOp::Neg:
+                load(EAX, reg(i.a));
+                bytes({ 0xf7, 0xd8 }); // neg eax
+                store(reg(i.dst), EAX);
+                break;
+            case TraceOp::Not:
+                cmp_imm8(reg(i.a), 0);
+                set_bool(EQ);
+                store(reg(i.dst), EAX);
+                break;
+            case TraceOp::Lt: compare(LT, i); break;
+            case TraceOp::Le: compare(LE, i); break;
+            case TraceOp::Gt: compare(GT, i); break;
+            case TraceOp::Ge: compare(GE, i); break;
+            case TraceOp::Eq: compare(EQ, i); break;
+            case TraceOp::Ne: compare(NE, i); break;
+            case TraceOp::Guard:
+                cmp_imm8(reg(i.a), 0);
+                exit_if(i.imm ? EQ : NE, i.exit);
+                break;
+            case TraceOp::LoadElem:
+                call_elem_helper(reinterpret_cast<const void *>(&trace_load_elem), i);
+                break;
+            case TraceOp::StoreElem:
+                call_elem_helper(reinterpret_cast<const void *>(&trace_store_elem), i);
+                break;
+        }
+    }
+};
+
+static std::unique_ptr<ExecutableMemory> emit_native(const Trace &t) {
+    TraceAssembler as;
+
+    as.bytes({ 0x53 });                   // push rbx
+    as.bytes({ 0x41, 0x54 });             // push r12
+    as.bytes({ 0x48, 0x83, 0xec, 0x08 }); // sub rsp, 8 (keeps calls 16-byte aligned)
+    as.bytes({ 0x48, 0x89, 0xfb });       // mov rbx, rdi
+    as.bytes({ 0x49, 0x89, 0xf4 });       // mov r12, rsi
+
+    for (const auto &instr : t.preheader) as.instruction(instr);
+
+    size_t loop = as.size();
+    for (const auto &instr : t.body) as.instruction(instr);
+
+    // the back edge spends the slice budget, kept in the register after the last
+    // one; running out takes the extra exit numbered t.exits.size()
+    as.mem({ 0x83 }, 5, TraceAssembler::reg(t.reg_count)); // sub dword [budget], 1
+    as.code.push_back(1);
+    as.exit_if(X86Assembler::EQ, static_cast<int>(t.exits.size()));
+    as.patch_rel32(as.jmp(), loop);
+
+    std::vector<size_t> stubs;
+    std::vector<size_t> epilogue_jumps;
+    for (size_t k = 0; k <= t.exits.size(); k++) {
+        stubs.push_back(as.size());
+        as.mov_imm(X86Assembler::EAX, static_cast<uint32_t>(k));
+        epilogue_jumps.push_back(as.jmp());
+    }
+
+    size_t epilogue = as.size();
+    as.bytes({ 0x48, 0x83, 0xc4, 0x08 }); // add rsp, 8
+    as.bytes({ 0x41, 0x5c });             // pop r12
+    as.bytes({ 0x5b });                   // pop rbx
+    as.bytes({ 0xc3 });                   // ret
+
+    for (size_t at : epilogue_jumps) as.patch_rel32(at, epilogue);
+    for (const auto &[at, exit] : as.exit_fixups) as.patch_rel32(at, stubs[exit]);
+
+    return std::make_unique<ExecutableMemory>(as.code);
+}
+
+#else
+
+static std::unique_ptr<ExecutableMemory> emit_native(const Trace &) {
+    return nullptr;
+}
+
+#endif
+
+static bool finish(TraceRecorder &rec) {
+    Trace::Ptr trace = rec.trace;
+    optimize(*trace);
+
+    trace->native = emit_native(*trace);
+    if (!trace->native) return false;
+
+    auto &slot = rec.func->traces[trace->header];
+    trace->attempts = slot->attempts;
+    slot = trace;
+
+    rec.trace = nullptr;
+    rec.func = nullptr;
+    rec.stack.clear();
+    return true;
+}
+
+// ==== Running traces ====
+
+static bool enter_trace(VM &vm, CallFrame &frame, Trace &t) {
+    GreenThread &thread = *vm.current_thread;
+    if (thread.stack_size - frame.base != t.stack_depth) return false;
+
+    // type guards for the whole loop, checked once on entry
+    Value *locals = &thread.stack[frame.base];
+    std::vector<int32_t> regs(t.reg_count + 1);
+    for (size_t s = 0; s < t.slot_types.size(); s++) {
+        switch (t.slot_types[s]) {
+            case TraceType::Int:
+                if (!locals[s].is_int()) return false;
+                regs[s] = locals[s].as_int();
+                break;
+            case TraceType::Bool:
+                if (!locals[s].is_bool()) return false;
+                regs[s] = locals[s].as_bool();
+                break;
+            default:
+                break;
+        }
+    }
+
+    int32_t slice = static_cast<int32_t>(std::min<int64_t>(thread.budget, INT32_MAX));
+    regs[t.reg_count] = slice;
+
+    TraceContext ctx { locals };
+    using Entry = int (*)(int32_t *regs, TraceContext *ctx);
+    int exit_index = reinterpret_cast<Entry>(t.native->memory)(regs.data(), &ctx);
+
+    auto box = [&](int reg, TraceType type) {
+        return (type == TraceType::Bool) ? Value(regs[reg] != 0) : Value(static_cast<int>(regs[reg]));
+    };
+
+    for (size_t s = 0; s < t.written.size(); s++) {
+        if (t.written[s]) locals[s] = box(static_cast<int>(s), t.slot_types[s]);
+    }
+
+    if (static_cast<size_t>(exit_index) == t.exits.size()) {
+        // out of budget at the back edge: resume at the header, yielding if the
+        // whole slice (and not just the part handed to the trace) is spent
+        thread.budget -= slice - 1;
+        thread.tick();
+        frame.ip = t.header;
+        return true;
+    }
+
+    thread.budget -= slice - regs[t.reg_count];
+
+    const TraceExit &exit = t.exits[exit_index];
+    for (const auto &entry : exit.stack) {
+        if (thread.stack_size >= thread.stack.size()) {
+            throw std::runtime_error("Stack overflow");
+        }
+        thread.stack[thread.stack_size++] = is_unboxed(entry.type) ? box(entry.reg, entry.type) : locals[entry.reg];
+    }
+
+    frame.ip = exit.ip;
+    return true;
+}
+
+void on_back_edge(VM &vm, CallFrame &frame) {
+    TraceRecorder &rec = vm.tracer;
+    if (rec.active()) return;
+
+    Function &func = *frame.closure->func;
+    auto &slot = func.traces[frame.ip];
+    if (!slot) slot = std::make_shared<Trace>();
+
+    if (slot->native) {
+        enter_trace(vm, frame, *slot);
+        return;
+    }
+
+    if (slot->failed || ++slot->hotness < HOT_LOOP_THRESHOLD) return;
+    slot->hotness = 0;
+
+    GreenThread &thread = *vm.current_thread;
+    rec.trace = std::make_shared<Trace>();
+    rec.trace->header = frame.ip;
+    rec.trace->stack_depth = thread.stack_size - frame.base;
+    rec.trace->reg_count = static_cast<int>(rec.trace->stack_depth);
+    rec.trace->slot_types.assign(rec.trace->stack_depth, TraceType::Unknown);
+    rec.trace->written.assign(rec.trace->stack_depth, false);
+    rec.func = &func;
+    rec.thread = &thread;
+    rec.frame_depth = thread.frames.size();
+    rec.length = 0;
+    rec.stack.clear();
+}
+
+}
@@ -15,6 +15,30 @@ std::string Array::to_string() const {
     return ss.str();
 }
 
+Array::Ptr Range::to_array() const {
+    std::vector<Value> elements;
+    elements.reserve(size());
+    for (size_t i = 0; i < size(); ++i) {
+        elements.push_back(at(i));
+    }
+
+    return std::make_shared<Array>(elements);
+}
+
+std::string Range::to_string() const {
+    if (array) return array->to_string();
+
+    std::stringstream ss;
+    ss << "[";
+    for (size_t i = 0; i < size(); ++i) {
+        ss << at(i).to_string();
+        if (i < size() - 1) ss << ", ";
+    }
+
+    ss << "]";
+    return ss.str();
+}
+
 std::string Object::to_string() const {
     std::stringstream ss;
     ss << "{";
@@ -41,6 +65,17 @@ Value Value::get_index(const Value &idx) const {
             throw std::runtime_error("Array index out of bounds");
 
         return arr[static_cast<size_t>(i)];
+    } else if (is_range() && idx.is_int()) {
+        int i = idx.as_int();
+        if (i < 0)
+            throw std::runtime_error("Negative index access not supported");
+
+        const Range &range = *std::any_cast<Range::Ptr>(data);
+
+        if (static_cast<size_t>(i) >= range.size())
+            throw std::runtime_error("Array index out of bounds");
+
+        return range.at(static_cast<size_t>(i));
     } else if (idx.is_string()) {
         std::string k = idx.as_string();
         if (is_object()) {
@@ -72,6 +107,8 @@ void Value::set_index(const Value &idx, const Value &val) {
 
         Array &arr = *std::any_cast<Array::Ptr>(data);
         arr[static_cast<size_t>(i)] = val;
+    } else if (is_range() && idx.is_int()) {
+        Value(std::any_cast<Range::Ptr>(data)->materialize()).set_index(idx, val);
     } else if (idx.is_string()) {
         std::string k = idx.as_string();
         if (is_object()) {
@@ -100,6 +137,7 @@ std::string Value::type_name() const {
     if (is_native()) return "native function";
     if (is_closure()) return "closure";
     if (is_array()) return "array";
+    if (is_range()) return "range";
     if (is_object()) return "object";
     if (is_struct()) return "struct";
     if (is_struct_instance()) return "struct instance";
@@ -118,6 +156,7 @@ std::string Value::to_string() const {
     if (is_native())   return as_native()->to_string();
     if (is_closure())  return as_closure()->to_string();
     if (is_array())    return as_array()->to_string();
+    if (is_range())    return as_range()->to_string();
     if (is_object())   return as_object()->to_string();
     if (is_struct())   return as_struct()->to_string();
     if (is_struct_instance()) return as_struct_instance()->to_string();
@@ -137,6 +176,7 @@ bool Value::is_truthy() const {
     if (is_native())   return true;
     if (is_closure())  return true;
     if (is_array())    return !as_array()->empty();
+    if (is_range())    return !as_range()->empty();
     if (is_object())   return !as_object()->empty();
     if (is_struct())   return true;
     if (is_struct_instance()) return true;
@@ -150,9 +190,16 @@ bool Value::is_truthy() const {
     return false;
 }
 
+// Ranges take part in array operators through a temporary copy of their elements.
+static Value range_as_array(const Value &v) {
+    return v.is_range() ? Value(v.as_range()->to_array()) : v;
+}
+
 Value operator+(const Value &lhs, const Value &rhs) {
     if (lhs.is_int() && rhs.is_int())
         return lhs.as_int() + rhs.as_int();
+    if (lhs.is_range() || rhs.is_range())
+        return range_as_array(lhs) + range_as_array(rhs);
     if ((lhs.is_int() || lhs.is_float()) && (rhs.is_int() || rhs.is_float()))
         return lhs.as_float() + rhs.as_float();
     if (lhs.is_string() || rhs.is_string())
@@ -182,6 +229,8 @@ Value operator-(const Value &lhs, const Value &rhs) {
 Value operator*(const Value &lhs, const Value &rhs) {
     if (lhs.is_int() && rhs.is_int())
         return lhs.as_int() * rhs.as_int();
+    if (lhs.is_range() || rhs.is_range())
+        return range_as_array(lhs) * range_as_array(rhs);
     if ((lhs.is_int() || lhs.is_float()) && (rhs.is_int() || rhs.is_float()))
         return lhs.as_float() * rhs.as_float();
     if ((lhs.is_array() && rhs.is_int()) || (lhs.is_int() && rhs.is_array())) { 
@@ -269,6 +318,28 @@ bool operator==(const Value &lhs, const Value &rhs) {
     if (lhs.is_closure() && rhs.is_closure())
         return lhs.as_closure() == rhs.as_closure();
 
+    if (lhs.is_range() && rhs.is_range()) {
+        const auto &r1 = lhs.as_range();
+        const auto &r2 = rhs.as_range();
+        if (r1->size() != r2->size()) return false;
+        for (size_t i = 0; i < r1->size(); ++i) {
+            if (!(r1->at(i) == r2->at(i))) return false;
+        }
+
+        return true;
+    }
+
+    if ((lhs.is_range() && rhs.is_array()) || (lhs.is_array() && rhs.is_range())) {
+        const auto &range = lhs.is_range() ? lhs.as_range() : rhs.as_range();
+        const auto &arr = lhs.is_array() ? lhs.as_array() : rhs.as_array();
+        if (range->size() != arr->size()) return false;
+        for (size_t i = 0; i < arr->size(); ++i) {
+            if (!(range->at(i) == (*arr)[i])) return false;
+        }
+
+        return true;
+    }
+
     if (lhs.is_array() && rhs.is_array()) {
         const auto &a1 = lhs.as_array();
         const auto &a2 = rhs.as_array();
@@ -350,4 +421,37 @@ Value operator>>(const Value &lhs, const Value &rhs) {
     if (lhs.is_int() && rhs.is_int())
         return lhs.as_int() >> rhs.as_int();
     throw std::runtime_error("Unsupported types for '>>'");
-}
\ No newline at end of file
+}
+bool parse_static_type(const std::string &name, StaticType &type) {
+    if (name == "any")         type = StaticType::Any;
+    else if (name == "int")    type = StaticType::Int;
+    else if (name == "float")  type = StaticType::Float;
+    else if (name == "bool")   type = StaticType::Bool;
+    else if (name == "string") type = StaticType::String;
+    else return false;
+
+    return true;
+}
+
+std::string static_type_name(StaticType type) {
+    switch (type) {
+        case StaticType::Int:    return "int";
+        case StaticType::Float:  return "float";
+        case StaticType::Bool:   return "bool";
+        case StaticType::String: return "string";
+        default:                 return "any";
+    }
+}
+
+bool coerce_to_static_type(Value &v, StaticType type) {
+    switch (type) {
+        case StaticType::Int:    return v.is_int();
+        case StaticType::Bool:   return v.is_bool();
+        case StaticType::String: return v.is_string();
+        case StaticType::Float:
+            if (v.is_int()) v = static_cast<double>(v.as_int());
+            return v.is_float();
+        default:
+            return true;
+    }
+}
@@ -2,6 +2,23 @@
 #include "bytecode.hpp"
 #include "native_functions.hpp"
 
+thread_local GreenThread::Ptr VM::current_thread;
+thread_local std::exception_ptr VM::jit_error;
+thread_local jit::TraceRecorder VM::tracer;
+thread_local std::unordered_map<const Array *, Object::Ptr> VM::object_shapes;
+
+// Takes the globals lock only when several workers share the VM
+template <typename Lock>
+struct GlobalsGuard {
+    Lock lock;
+    GlobalsGuard(VM &vm) : lock(vm.globals_lock, std::defer_lock) {
+        if (vm.parallel) lock.lock();
+    }
+};
+
+using GlobalsReadGuard = GlobalsGuard<std::shared_lock<std::shared_mutex>>;
+using GlobalsWriteGuard = GlobalsGuard<std::unique_lock<std::shared_mutex>>;
+
 VM::VM() {
     // define native functions here if needed
     define_native("clock", 0, native_functions::clock);
@@ -17,12 +34,15 @@ VM::VM() {
     define_native("String.split", 1, native_functions::string::split);
 
     define_native("arange", 3, native_functions::array::arange);
+    define_native("array",  1, native_functions::array::to_array);
     define_native("Array.push",    1, native_functions::array::push);
     define_native("Array.pop",     0, native_functions::array::pop);
     define_native("Array.shift",   0, native_functions::array::shift);
     define_native("Array.unshift", 1, native_functions::array::unshift);
     define_native("Array.slice",   2, native_functions::array::slice);
     define_native("Array.sum",     0, native_functions::array::sum);
+    define_native("Range.slice",   2, native_functions::range::slice);
+    define_native("Range.sum",     0, native_functions::range::sum);
 
     globals["pi"] = M_PI;
     define_native("pow",     2, native_functions::math::pow);
@@ -48,16 +68,30 @@ VM::VM() {
 
     define_native("sleep",     1, native_functions::sleep);
     define_native("thread_id", 0, native_functions::thread_id);
+    define_native("slice_stats", 0, native_functions::slice_stats);
+    define_native("select_stats", 0, native_functions::select_stats);
 
     define_native("Thread.join", 0, native_functions::join);
+    define_native("wait_all", 1, native_functions::wait_all);
+    define_native("wait_any", 1, native_functions::wait_any);
     // define_native("Thread.detach", 0, native_functions::detach);
 
-    define_native("pipe", 1, native_functions::pipe);
+    define_native("pipe",  1, native_functions::pipe);
+    define_native("after", 1, native_functions::after);
+    define_native("Pipe.recv", 1, native_functions::recv);
+    define_native("Pipe.send_many", 1, native_functions::send_many);
+    define_native("Pipe.recv_many", 1, native_functions::recv_many);
+    define_native("Pipe.drain",     0, native_functions::drain);
 }
 
 void VM::spawn_thread(Closure::Ptr closure, size_t thread_count) {
     std::vector<Value> handles;
     for (size_t i = 0; i < thread_count; ++i) {
+        if (jit::compiles_functions(jit_mode)) {
+            count_call(*closure->func);
+        }
+
+        std::lock_guard<std::recursive_mutex> guard(scheduler.lock);
         auto new_thread = std::make_shared<GreenThread>(scheduler.next_thread_id++);
         new_thread->stack[new_thread->stack_size++] = Value(closure);
 
@@ -68,6 +102,8 @@ void VM::spawn_thread(Closure::Ptr closure, size_t thread_count) {
         new_thread->frames.push_back(frame);
 
         scheduler.add_thread(new_thread);
+        event_trace::record(event_trace::Kind::Spawn, new_thread->ID,
+                            current_thread ? static_cast<int64_t>(current_thread->ID) : -1);
         scheduler.enqueue(new_thread);
 
         if (current_thread) {
@@ -83,11 +119,37 @@ void VM::spawn_thread(Closure::Ptr closure, size_t thread_count) {
 }
 
 Value VM::interpret(Function::Ptr func) {
+    if (scheduler.worker_count > 1) {
+        // the JIT tiers keep per-function state that is not shared safely
+        if (jit_mode != jit::Mode::Off) {
+            std::cerr << "[JIT disabled: running on " << scheduler.worker_count << " workers]" << std::endl;
+            jit_mode = jit::Mode::Off;
+        }
+
+        parallel = true;
+        func->compile_all(); // before the first thread runs
+    }
+
     auto closure = std::make_shared<Closure>(func);
     spawn_thread(closure, 1);
     return scheduler.schedule(*this);
 }
 
+// Methods are shared through the globals and a call may be preempted while its
+// arguments are evaluated, so each binding gets its own copy instead of writing
+// the receiver into the shared one
+Value VM::bind_method(const Native::Ptr &method, const Value &self) {
+    auto bound = std::make_shared<Native>(*method);
+    bound->bound_instance = self;
+    return bound;
+}
+
+Value VM::bind_method(const Closure::Ptr &method, const Value &self) {
+    auto bound = std::make_shared<Closure>(*method);
+    bound->recv_self = self;
+    return bound;
+}
+
 inline void VM::define_native(const std::string &name, int arity, NativeFn func) {
     globals[name] = std::make_shared<Native>(name, arity, func);
 }
@@ -145,6 +207,14 @@ void VM::call_native(const Native::Ptr &native, int arg_count) {
 }
 
 void VM::call(const Closure::Ptr &closure, int arg_count) {
+    if (closure->func->compile_body) {
+        closure->func->ensure_compiled();
+    }
+
+    if (jit::compiles_functions(jit_mode)) {
+        count_call(*closure->func);
+    }
+
     if (arg_count != closure->func->arity) {
         throw std::runtime_error("Expected " + std::to_string(closure->func->arity) +
                                  " arguments but got " + std::to_string(arg_count));
@@ -165,6 +235,15 @@ void VM::call(const Closure::Ptr &closure, int arg_count) {
     frame.ip = 0;
     frame.base = static_cast<int>(current_thread->stack_size - arg_count - 1);
     current_thread->frames.push_back(frame);
+
+    current_thread->tick();
+}
+
+void VM::count_call(Function &func) {
+    if (func.native_code || ++func.call_count != jit::HOT_CALL_THRESHOLD) return;
+
+    func.native_code = (jit_mode == jit::Mode::Stencil) ? jit::compile_stencils(func, jit_helpers())
+                                                        : jit::compile(func, jit_helpers());
 }
 
 inline Upvalue::Ptr VM::capture_upvalue(Value *local) {
@@ -225,18 +304,22 @@ inline Value& VM::peek(size_t depth) {
 }
 
 void VM::debug_instruction(CallFrame &frame, OpCode op) {
-    std::cerr << "[Thread " << current_thread->ID << "] ";
-    std::cerr << "[IP " << std::hex << std::right << std::setw(4)  << std::setfill('0') << (frame.ip - 1)
-              << "] "   << std::dec << std::left  << std::setw(15) << std::setfill(' ') << opcode_to_string(op)
-              << " | ";
-
-    std::cerr << "Stack: [";
+    // Formatted locally and written once, so workers neither share stream
+    // format state nor interleave halves of a line
+    std::ostringstream line;
+    line << "[Thread " << current_thread->ID << "] ";
+    line << "[IP " << std::hex << std::right << std::setw(4)  << std::setfill('0') << (frame.ip - 1)
+         << "] "   << std::dec << std::left  << std::setw(15) << std::setfill(' ') << opcode_to_string(op)
+         << " | ";
+
+    line << "Stack: [";
     for (size_t i = 0; i < current_thread->stack_size; ++i) {
-        std::cerr << current_thread->stack[i].to_string();
-        if (i < current_thread->stack_size - 1) std::cerr << ", ";
+        line << current_thread->stack[i].to_string();
+        if (i < current_thread->stack_size - 1) line << ", ";
     }
 
-    std::cerr << "]\n";
+    line << "]\n";
+    std::cerr << line.str();
 }
 
 void VM::run() {
@@ -247,8 +330,8 @@ void VM::run() {
         }
 
         CallFrame &curr = current_thread->frames.back();
-        auto &chunk = curr.closure->func->chunk;
-        if (curr.ip >= chunk.code.size()) {
+        auto &func = *curr.closure->func;
+        if (curr.ip >= func.chunk.code.size()) {
             current_thread->frames.pop_back();
             if (current_thread->frames.empty()) {
                 current_thread->state = GreenThread::Finished;
@@ -257,478 +340,855 @@ void VM::run() {
             continue;
         }
 
-        OpCode op = static_cast<OpCode>(read_byte(curr));
-
-        debug_instruction(curr, op);
+        bool ran_native = (func.aot_code && func.aot_code(this)) ||
+                          (func.native_code && func.native_code->enter(*this, curr.ip));
 
-        switch (op) {
-            case OP_NULL:  push({});    break;
-            case OP_TRUE:  push(true);  break;
-            case OP_FALSE: push(false); break;
-            case OP_CONST: {
-                int idx = read_short(curr);
-                if (idx >= chunk.constants.size()) throw std::runtime_error("constant index out of range");
-                push(chunk.constants[idx]);
-                break;
+        if (ran_native) {
+            if (jit_error) {
+                auto error = jit_error;
+                jit_error = nullptr;
+                std::rethrow_exception(error);
             }
-            case OP_ICONST8: {
-                int val = static_cast<int8_t>(read_byte(curr));
-                push(val);
-                break;
+        } else {
+            int pc = curr.ip;
+            OpCode op = static_cast<OpCode>(read_byte(curr));
+
+            debug_instruction(curr, op);
+
+            if (tracer.active()) {
+                tracer.record(*this, curr, pc, op);
             }
-            case OP_ICONST16: {
-                int val = static_cast<int16_t>(read_short(curr));
-                push(val);
-                break;
+
+            size_t depth = current_thread->frames.size();
+            execute(op, curr);
+
+            // a backward jump that stayed in this frame just closed a loop iteration
+            if (jit_mode == jit::Mode::Trace && (op == OP_JUMP || op == OP_FOR_LOOP) &&
+                current_thread->state == GreenThread::Running &&
+                current_thread->frames.size() == depth && curr.ip < pc) {
+                jit::on_back_edge(*this, curr);
             }
-            case OP_DEFINE_GLOBAL: {
-                uint16_t idx = read_short(curr);
-                auto name = chunk.constants[idx].as_string();
-                globals[name] = pop();
-                break;
+        }
+
+        if (current_thread->state != GreenThread::Running) return;
+    }
+}
+
+// The operands of the typed opcodes were proven or checked by the compiler, so
+// they are unpacked directly instead of going through Value's type dispatch
+template <typename T, typename Op>
+static inline void typed_binary_op(GreenThread &thread, Op op) {
+    Value &lhs = thread.stack[thread.stack_size - 2];
+    T b = *std::any_cast<T>(&thread.stack[thread.stack_size - 1].data);
+    T &a = *std::any_cast<T>(&lhs.data);
+    thread.stack_size--;
+
+    using Result = decltype(op(a, b));
+    if constexpr (std::is_same_v<Result, T>) {
+        a = op(a, b); // same type: update in place
+    } else {
+        lhs = Value(op(a, b));
+    }
+}
+
+// Runs one instruction whose opcode has already been read from `curr`
+inline void VM::execute(OpCode op, CallFrame &curr) {
+    auto &chunk = curr.closure->func->chunk;
+    const auto &constants = *chunk.constants;
+
+    switch (op) {
+        case OP_NULL:  push({});    break;
+        case OP_TRUE:  push(true);  break;
+        case OP_FALSE: push(false); break;
+        case OP_CONST: {
+            int idx = read_short(curr);
+            if (idx >= constants.size()) throw std::runtime_error("constant index out of range");
+            push(constants.load(idx));
+            break;
+        }
+        case OP_CONST_LONG: {
+            uint32_t high = read_byte(curr);
+            uint32_t idx = (high << 16) | read_short(curr);
+            if (idx >= constants.size()) throw std::runtime_error("constant index out of range");
+            push(constants.load(idx));
+            break;
+        }
+        case OP_ICONST8: {
+            int val = static_cast<int8_t>(read_byte(curr));
+            push(val);
+            break;
+        }
+        case OP_ICONST16: {
+            int val = static_cast<int16_t>(read_short(curr));
+            push(val);
+            break;
+        }
+        case OP_DEFINE_GLOBAL: {
+            uint16_t idx = read_short(curr);
+            const auto &name = constants[idx].as_string();
+            GlobalsWriteGuard guard(*this);
+            globals[name] = pop();
+            break;
+        }
+        case OP_LOAD_GLOBAL: {
+            uint16_t idx = read_short(curr);
+            const auto &name = constants[idx].as_string();
+            GlobalsReadGuard guard(*this);
+            auto it = globals.find(name);
+            if (it == globals.end()) throw std::runtime_error("Undefined global variable: " + name);
+            push(it->second);
+            break;
+        }
+        case OP_STORE_GLOBAL: {
+            uint16_t idx = read_short(curr);
+            const auto &name = constants[idx].as_string();
+            GlobalsWriteGuard guard(*this);
+            auto it = globals.find(name);
+            if (it == globals.end()) throw std::runtime_error("Undefined global variable: " + name);
+            it->second = peek(0);
+            break;
+        }
+        case OP_LOAD_LOCAL: {
+            uint8_t local_idx = read_byte(curr);
+            int stack_idx = curr.base + local_idx;
+            if (stack_idx < 0 || stack_idx >= current_thread->stack_size) {
+                throw std::runtime_error("Local variable index out of range");
             }
-            case OP_LOAD_GLOBAL: {
-                uint16_t idx = read_short(curr);
-                auto name = chunk.constants[idx].as_string();
-                auto it = globals.find(name);
-                if (it == globals.end()) throw std::runtime_error("Undefined global variable: " + name);
-                push(it->second);
-                break;
+
+            push(current_thread->stack[stack_idx]);
+            break;
+        }
+        case OP_STORE_LOCAL: {
+            uint8_t local_idx = read_byte(curr);
+            int stack_idx = curr.base + local_idx;
+            if (stack_idx < 0 || stack_idx >= current_thread->stack_size) {
+                throw std::runtime_error("Local variable index out of range");
             }
-            case OP_STORE_GLOBAL: {
-                uint16_t idx = read_short(curr);
-                auto name = chunk.constants[idx].as_string();
-                auto it = globals.find(name);
-                if (it == globals.end()) throw std::runtime_error("Undefined global variable: " + name);
-                it->second = peek(0);
-                break;
+
+            current_thread->stack[stack_idx] = peek(0);
+            break;
+        }
+        case OP_LOAD_UPVALUE: {
+            uint8_t upvalue_idx = read_byte(curr);
+            if (upvalue_idx >= curr.closure->upvalues.size()) {
+                throw std::runtime_error("Upvalue index out of range");
             }
-            case OP_LOAD_LOCAL: {
-                uint8_t local_idx = read_byte(curr);
-                int stack_idx = curr.base + local_idx;
-                if (stack_idx < 0 || stack_idx >= current_thread->stack_size) {
-                    throw std::runtime_error("Local variable index out of range");
-                }
 
-                push(current_thread->stack[stack_idx]);
-                break;
+            auto upvalue = curr.closure->upvalues[upvalue_idx];
+            push(upvalue->get());
+            break;
+        }
+        case OP_STORE_UPVALUE: {
+            uint8_t upvalue_idx = read_byte(curr);
+            if (upvalue_idx >= curr.closure->upvalues.size()) {
+                throw std::runtime_error("Upvalue index out of range");
             }
-            case OP_STORE_LOCAL: {
-                uint8_t local_idx = read_byte(curr);
-                int stack_idx = curr.base + local_idx;
-                if (stack_idx < 0 || stack_idx >= current_thread->stack_size) {
-                    throw std::runtime_error("Local variable index out of range");
-                }
 
-                current_thread->stack[stack_idx] = peek(0);
-                break;
+            auto upvalue = curr.closure->upvalues[upvalue_idx];
+            upvalue->set(peek(0));
+            break;
+        }
+        case OP_LOAD_CAPTURE: {
+            uint8_t capture_idx = read_byte(curr);
+            if (capture_idx >= curr.closure->captures.size()) {
+                throw std::runtime_error("Capture index out of range");
             }
-            case OP_LOAD_UPVALUE: {
-                uint8_t upvalue_idx = read_byte(curr);
-                if (upvalue_idx >= curr.closure->upvalues.size()) {
-                    throw std::runtime_error("Upvalue index out of range");
+
+            push(curr.closure->captures[capture_idx]);
+            break;
+        }
+        case OP_LOAD_ENCLOSING: {
+            uint8_t depth = read_byte(curr);
+            uint8_t local_idx = read_byte(curr);
+            const auto &frame = current_thread->frames[current_thread->frames.size() - 1 - depth];
+            push(current_thread->stack[frame.base + local_idx]);
+            break;
+        }
+        case OP_STORE_ENCLOSING: {
+            uint8_t depth = read_byte(curr);
+            uint8_t local_idx = read_byte(curr);
+            const auto &frame = current_thread->frames[current_thread->frames.size() - 1 - depth];
+            current_thread->stack[frame.base + local_idx] = peek(0);
+            break;
+        }
+        case OP_LOAD_FIELD: {
+            int idx = read_short(curr);
+            const std::string &key = constants[idx].as_string();
+            Value obj = pop();
+            GlobalsReadGuard guard(*this);
+
+            if (obj.is_string()) {
+                // Bind 'self' to the instance
+                auto method_it = globals.find("String." + key);
+                if (method_it == globals.end()) {
+                    throw std::runtime_error("Undefined method '" + key + "' for String");
+                }
+                push(bind_method(method_it->second.as_native(), obj));
+            } else if (obj.is_array()) {
+                // Bind 'self' to the instance
+                auto method_it = globals.find("Array." + key);
+                if (method_it == globals.end()) {
+                    throw std::runtime_error("Undefined method '" + key + "' for Array");
+                }
+                push(bind_method(method_it->second.as_native(), obj));
+            } else if (obj.is_range()) {
+                // Ranges answer read-only methods lazily; anything else (e.g. push)
+                // is an Array method and runs on the materialized array
+                auto range = obj.as_range();
+                auto method_it = globals.find("Range." + key);
+                if (method_it == globals.end() || range->array.get()) {
+                    method_it = globals.find("Array." + key);
+                    obj = range->materialize();
+                }
+                if (method_it == globals.end()) {
+                    throw std::runtime_error("Undefined method '" + key + "' for Range");
+                }
+                push(bind_method(method_it->second.as_native(), obj));
+            } else if (obj.is_thread_handle()) {
+                // Bind 'self' to the instance
+                auto method_it = globals.find("Thread." + key);
+                if (method_it == globals.end()) {
+                    throw std::runtime_error("Undefined method '" + key + "' for Thread");
+                }
+                push(bind_method(method_it->second.as_native(), obj));
+            } else if (obj.is_pipe_handle()) {
+                // Bind 'self' to the instance
+                auto method_it = globals.find("Pipe." + key);
+                if (method_it == globals.end()) {
+                    throw std::runtime_error("Undefined method '" + key + "' for Pipe");
+                }
+                push(bind_method(method_it->second.as_native(), obj));
+            } else {
+                auto field_val = obj.get_index(key);
+                if (obj.is_struct_instance() && field_val.is_closure()) {
+                    // Bind 'self' to the instance
+                    field_val = bind_method(field_val.as_closure(), obj);
                 }
 
-                auto upvalue = curr.closure->upvalues[upvalue_idx];
-                push(upvalue->get());
-                break;
+                push(field_val);
             }
-            case OP_STORE_UPVALUE: {
-                uint8_t upvalue_idx = read_byte(curr);
-                if (upvalue_idx >= curr.closure->upvalues.size()) {
-                    throw std::runtime_error("Upvalue index out of range");
+            break;
+        }
+        case OP_STORE_FIELD: {
+            int idx = read_short(curr);
+            const std::string &key = constants[idx].as_string();
+            Value val = pop();
+            Value obj = pop();
+            obj.set_index(key, val);
+            push(val);
+            break;
+        }
+        case OP_LOAD_SLOT: {
+            uint16_t idx = read_short(curr);
+            uint8_t slot = read_byte(curr);
+            Value &obj = peek(0);
+
+            const std::string &key = constants[idx].as_string();
+
+            // the slot is only a hint: anything else (unassigned, a method, a
+            // method moved to another struct) takes the named lookup
+            if (obj.is_struct_instance()) {
+                auto inst = obj.as_struct_instance().get();
+                if (inst->has_slot(slot, key) && inst->assigned[slot]) {
+                    obj = inst->slots[slot];
+                    break;
                 }
-
-                auto upvalue = curr.closure->upvalues[upvalue_idx];
-                upvalue->set(peek(0));
-                break;
             }
-            case OP_LOAD_FIELD: {
-                int idx = read_short(curr);
-                std::string key = chunk.constants[idx].as_string();
-                Value obj = pop();
 
-                if (obj.is_string()) {
-                    // Bind 'self' to the instance
-                    auto method_it = globals.find("String." + key);
-                    if (method_it == globals.end()) {
-                        throw std::runtime_error("Undefined method '" + key + "' for String");
-                    }
-                    auto method = method_it->second.as_native();
-                    method->bound_instance = obj;
-                    push(method);
-                } else if (obj.is_array()) {
-                    // Bind 'self' to the instance
-                    auto method_it = globals.find("Array." + key);
-                    if (method_it == globals.end()) {
-                        throw std::runtime_error("Undefined method '" + key + "' for Array");
-                    }
-                    auto method = method_it->second.as_native();
-                    method->bound_instance = obj;
-                    push(method);
-                } else if (obj.is_thread_handle()) {
-                    // Bind 'self' to the instance
-                    auto method_it = globals.find("Thread." + key);
-                    if (method_it == globals.end()) {
-                        throw std::runtime_error("Undefined method '" + key + "' for Thread");
-                    }
-                    auto method = method_it->second.as_native();
-                    method->bound_instance = obj;
-                    push(method);
-                } else {
-                    auto field_val = obj.get_index(key);
-                    if (obj.is_struct_instance() && field_val.is_closure()) {
-                        // Bind 'self' to the instance
-                        auto closure = field_val.as_closure();
-                        closure->recv_self = obj;
-                        field_val = closure;
-                    }
-
-                    push(field_val);
-                }
-                break;
+            Value field_val = obj.get_index(key);
+            if (obj.is_struct_instance() && field_val.is_closure()) {
+                // Bind 'self' to the instance
+                field_val = bind_method(field_val.as_closure(), obj);
             }
-            case OP_STORE_FIELD: {
-                int idx = read_short(curr);
-                std::string key = chunk.constants[idx].as_string();
-                Value val = pop();
-                Value obj = pop();
+
+            obj = field_val;
+            break;
+        }
+        case OP_STORE_SLOT: {
+            uint16_t idx = read_short(curr);
+            uint8_t slot = read_byte(curr);
+            const std::string &key = constants[idx].as_string();
+            Value val = pop();
+            Value obj = pop();
+
+            if (obj.is_struct_instance() && obj.as_struct_instance()->has_slot(slot, key)) {
+                obj.as_struct_instance()->store_slot(slot, val);
+            } else {
                 obj.set_index(key, val);
-                push(val);
-                break;
-            }
-            case OP_LOAD_INDEX: {
-                Value index = pop();
-                Value container = pop();
-                push(container.get_index(index));
-                break;
             }
-            case OP_STORE_INDEX: {
-                Value val = pop();
-                Value index = pop();
-                Value container = pop();
-                container.set_index(index, val);
-                push(val);
-                break;
+
+            push(val);
+            break;
+        }
+        case OP_LOAD_INDEX: {
+            Value index = pop();
+            Value container = pop();
+            push(container.get_index(index));
+            break;
+        }
+        case OP_STORE_INDEX: {
+            Value val = pop();
+            Value index = pop();
+            Value container = pop();
+            container.set_index(index, val);
+            push(val);
+            break;
+        }
+        case OP_CLOSURE: {
+            uint16_t func_idx = read_short(curr);
+            if (func_idx >= chunk.functions.size()) {
+                throw std::runtime_error("Function index out of range");
             }
-            case OP_CLOSURE: {
-                uint16_t func_idx = read_short(curr);
-                if (func_idx >= chunk.constants.size()) {
-                    throw std::runtime_error("Function index out of range");
-                }
 
-                auto func_val = chunk.constants[func_idx];
-                if (!func_val.is_function()) {
-                    throw std::runtime_error("Expected function for CLOSURE opcode");
-                }
+            const auto &func_val = chunk.functions[func_idx];
+            if (!func_val.is_function()) {
+                throw std::runtime_error("Expected function for CLOSURE opcode");
+            }
 
-                auto func = func_val.as_function();
-                auto closure = std::make_shared<Closure>(func);
-
-                // capture upvalues
-                for (int i = 0; i < func->upvalue_count; i++) {
-                    uint8_t is_local = read_byte(curr);
-                    uint8_t index = read_byte(curr);
-                    if (is_local) {
-                        closure->upvalues.push_back(capture_upvalue(&current_thread->stack[curr.base + index]));
-                    } else {
-                        closure->upvalues.push_back(curr.closure->upvalues[index]);
-                    }
+            auto func = func_val.as_function();
+            auto closure = std::make_shared<Closure>(func);
+
+            // capture upvalues
+            for (int i = 0; i < func->upvalue_count; i++) {
+                uint8_t kind = read_byte(curr);
+                uint8_t index = read_byte(curr);
+                switch (kind) {
+                    case 0: closure->upvalues.push_back(curr.closure->upvalues[index]); break;
+                    case 1: closure->upvalues.push_back(capture_upvalue(&current_thread->stack[curr.base + index])); break;
+                    case 2: closure->captures.push_back(curr.closure->captures[index]); break;
+                    case 3: closure->captures.push_back(current_thread->stack[curr.base + index]); break;
+                    default:
+                        throw std::runtime_error("Invalid upvalue descriptor");
                 }
+            }
 
-                push(closure);
-                break;
+            push(closure);
+            break;
+        }
+        case OP_RETURN: {
+            Value ret_val = pop();
+            close_upvalues(curr.base);
+            current_thread->frames.pop_back();
+            if (current_thread->frames.empty()) {
+                // stored first: a join on another worker trusts a Finished thread's value
+                scheduler.set_return_value(current_thread, ret_val);
+                current_thread->state = GreenThread::Finished;
+                return;
             }
-            case OP_RETURN: {
-                Value ret_val = pop();
-                close_upvalues(curr.base);
-                current_thread->frames.pop_back();
-                if (current_thread->frames.empty()) {
-                    current_thread->state = GreenThread::Finished;
-                    scheduler.set_return_value(current_thread, ret_val);
-                    return;
-                }
 
-                current_thread->stack_size = curr.base;
-                push(ret_val);
-                break;
+            current_thread->stack_size = curr.base;
+            push(ret_val);
+            break;
+        }
+        case OP_CLOSE_UPVALUE: {
+            close_upvalues(static_cast<int>(current_thread->stack_size) - 1);
+            pop();
+            break;
+        }
+        case OP_POP: {
+            pop();
+            break;
+        }
+        case OP_PRINT: {
+            auto value = pop();
+            std::cout << value.to_string() << std::endl;
+            break;
+        }
+        case OP_DUP: {
+            Value v = peek(0);
+            push(v);
+            break;
+        }
+        case OP_DUP2: {
+            Value a = peek(1);
+            Value b = peek(0);
+            push(a);
+            push(b);
+            break;
+        }
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_EQ: 
+        case OP_NEQ:
+        case OP_LT: 
+        case OP_LE: 
+        case OP_GT: 
+        case OP_GE:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT: 
+        case OP_SHIFT_RIGHT: {
+            binary_op(op);
+            break;
+        }
+        case OP_ADD_INT: typed_binary_op<int>(*current_thread, std::plus<int>());          break;
+        case OP_SUB_INT: typed_binary_op<int>(*current_thread, std::minus<int>());         break;
+        case OP_MUL_INT: typed_binary_op<int>(*current_thread, std::multiplies<int>());    break;
+        case OP_LT_INT:  typed_binary_op<int>(*current_thread, std::less<int>());          break;
+        case OP_LE_INT:  typed_binary_op<int>(*current_thread, std::less_equal<int>());    break;
+        case OP_GT_INT:  typed_binary_op<int>(*current_thread, std::greater<int>());       break;
+        case OP_GE_INT:  typed_binary_op<int>(*current_thread, std::greater_equal<int>()); break;
+        case OP_MOD_INT: {
+            if (*std::any_cast<int>(&peek(0).data) == 0) throw std::runtime_error("Modulo by zero");
+            typed_binary_op<int>(*current_thread, std::modulus<int>());
+            break;
+        }
+        case OP_ADD_FLOAT: typed_binary_op<double>(*current_thread, std::plus<double>());          break;
+        case OP_SUB_FLOAT: typed_binary_op<double>(*current_thread, std::minus<double>());         break;
+        case OP_MUL_FLOAT: typed_binary_op<double>(*current_thread, std::multiplies<double>());    break;
+        case OP_LT_FLOAT:  typed_binary_op<double>(*current_thread, std::less<double>());          break;
+        case OP_LE_FLOAT:  typed_binary_op<double>(*current_thread, std::less_equal<double>());    break;
+        case OP_GT_FLOAT:  typed_binary_op<double>(*current_thread, std::greater<double>());       break;
+        case OP_GE_FLOAT:  typed_binary_op<double>(*current_thread, std::greater_equal<double>()); break;
+        case OP_DIV_FLOAT: {
+            if (*std::any_cast<double>(&peek(0).data) == 0) throw std::runtime_error("Division by zero");
+            typed_binary_op<double>(*current_thread, std::divides<double>());
+            break;
+        }
+        case OP_CHECK_TYPE: {
+            auto type = static_cast<StaticType>(read_byte(curr));
+            uint8_t slot = read_byte(curr);
+
+            Value &v = (slot == 0xFF) ? peek(0) : current_thread->stack[curr.base + slot];
+            if (!coerce_to_static_type(v, type)) {
+                throw std::runtime_error("Type error: expected " + static_type_name(type) + " but got " + v.type_name());
             }
-            case OP_CLOSE_UPVALUE: {
-                close_upvalues(static_cast<int>(current_thread->stack_size) - 1);
-                pop();
-                break;
+            break;
+        }
+        case OP_SEND_PIPE: {
+            Value val = pop();
+            Value pipe_val = pop();
+            if (!pipe_val.is_pipe_handle()) {
+                throw std::runtime_error("Expected a pipe handle for SEND_PIPE");
             }
-            case OP_POP: {
-                pop();
-                break;
+
+            auto pipe_handle = pipe_val.as_pipe_handle();
+
+            auto pipe = pipe_handle.pipe_ptr;
+            if (!pipe) {
+                throw std::runtime_error("Invalid pipe ID in SEND_PIPE");
             }
-            case OP_PRINT: {
-                auto value = pop();
-                std::cout << value.to_string() << std::endl;
-                break;
+
+            scheduler.send_to_pipe(current_thread, pipe, val);
+            push(val);
+            break;
+        }
+        case OP_RECV_PIPE: {
+            Value pipe_val = pop();
+            if (!pipe_val.is_pipe_handle()) {
+                throw std::runtime_error("Expected a pipe handle for RECV_PIPE");
             }
-            case OP_DUP: {
-                Value v = peek(0);
-                push(v);
-                break;
+
+            auto pipe_handle = pipe_val.as_pipe_handle();
+
+            auto pipe = pipe_handle.pipe_ptr;
+            if (!pipe) {
+                throw std::runtime_error("Invalid pipe ID in RECV_PIPE");
             }
-            case OP_DUP2: {
-                Value a = peek(1);
-                Value b = peek(0);
-                push(a);
-                push(b);
-                break;
+
+            Value received = scheduler.receive_from_pipe(current_thread, pipe);
+            push(received);
+            break;
+        }
+        case OP_CLOSE_PIPE: {
+            Value pipe_val = pop();
+            if (!pipe_val.is_pipe_handle()) {
+                throw std::runtime_error("Expected a pipe handle for CLOSE_PIPE");
             }
-            case OP_ADD:
-            case OP_SUB:
-            case OP_MUL:
-            case OP_DIV:
-            case OP_MOD:
-            case OP_EQ: 
-            case OP_NEQ:
-            case OP_LT: 
-            case OP_LE: 
-            case OP_GT: 
-            case OP_GE:
-            case OP_BIT_AND:
-            case OP_BIT_OR:
-            case OP_BIT_XOR:
-            case OP_SHIFT_LEFT: 
-            case OP_SHIFT_RIGHT: {
-                binary_op(op);
-                break;
+
+            auto pipe_handle = pipe_val.as_pipe_handle();
+
+            auto pipe = pipe_handle.pipe_ptr;
+            if (!pipe) {
+                throw std::runtime_error("Invalid pipe ID in CLOSE_PIPE");
             }
-            case OP_SEND_PIPE: {
-                Value val = pop();
-                Value pipe_val = pop();
-                if (!pipe_val.is_pipe_handle()) {
-                    throw std::runtime_error("Expected a pipe handle for SEND_PIPE");
-                }
 
-                auto pipe_handle = pipe_val.as_pipe_handle();
+            scheduler.close_pipe(pipe);
+            break;
+        }
+        case OP_SELECT_BEGIN: {
+            uint8_t case_count = read_byte(curr);
+            scheduler.select_begin(current_thread, case_count);
+            break;
+        }
+        case OP_SELECT_RECV: {
+            uint16_t jump_offset = read_short(curr);
+            uint8_t slot = read_byte(curr);
 
-                auto pipe = scheduler.get_pipe_by_id(pipe_handle.ID);
-                if (!pipe) {
-                    throw std::runtime_error("Invalid pipe ID in SEND_PIPE");
-                }
+            Value pipe_val = pop();
 
-                scheduler.send_to_pipe(current_thread, pipe, val);
-                push(val);
-                break;
-            }
-            case OP_RECV_PIPE: {
-                Value pipe_val = pop();
+            // select case is disabled
+            if (pipe_val.is_null()) {
+                scheduler.select_add_recv_case(current_thread, nullptr, curr.ip + jump_offset - 1, slot);
+            } else {
                 if (!pipe_val.is_pipe_handle()) {
-                    throw std::runtime_error("Expected a pipe handle for RECV_PIPE");
+                    throw std::runtime_error("Expected a pipe handle for SELECT_RECV");
                 }
 
                 auto pipe_handle = pipe_val.as_pipe_handle();
 
-                auto pipe = scheduler.get_pipe_by_id(pipe_handle.ID);
+                auto pipe = pipe_handle.pipe_ptr;
                 if (!pipe) {
-                    throw std::runtime_error("Invalid pipe ID in RECV_PIPE");
+                    throw std::runtime_error("Invalid pipe ID in SELECT_RECV");
                 }
 
-                Value received = scheduler.receive_from_pipe(current_thread, pipe);
-                push(received);
-                break;
+                scheduler.select_add_recv_case(current_thread, pipe, curr.ip + jump_offset - 1, slot);
             }
-            case OP_CLOSE_PIPE: {
-                Value pipe_val = pop();
-                if (!pipe_val.is_pipe_handle()) {
-                    throw std::runtime_error("Expected a pipe handle for CLOSE_PIPE");
-                }
 
-                auto pipe_handle = pipe_val.as_pipe_handle();
+            if (slot != 0xFF) {
+                current_thread->stack_size = std::max(current_thread->stack_size, static_cast<size_t>(slot + 1));
+                current_thread->stack[slot] = {};
+            }
+            break;
+        }
+        case OP_SELECT_SEND: {
+            uint16_t jump_offset = read_short(curr);
 
-                auto pipe = scheduler.get_pipe_by_id(pipe_handle.ID);
-                if (!pipe) {
-                    throw std::runtime_error("Invalid pipe ID in CLOSE_PIPE");
-                }
+            Value val = pop();
+            Value pipe_val = pop();
 
-                scheduler.close_pipe(pipe);
-                break;
-            }
-            case OP_SELECT_BEGIN: {
-                uint8_t case_count = read_byte(curr);
-                scheduler.select_begin(current_thread, case_count);
+            // select case is disabled
+            if (pipe_val.is_null()) {
+                scheduler.select_add_send_case(current_thread, nullptr, curr.ip + jump_offset, val);
                 break;
             }
-            case OP_SELECT_RECV: {
-                uint16_t jump_offset = read_short(curr);
-                uint8_t slot = read_byte(curr);
 
-                Value pipe_val = pop();
-
-                // select case is disabled
-                if (pipe_val.is_null()) {
-                    scheduler.select_add_recv_case(current_thread, nullptr, curr.ip + jump_offset - 1, slot);
-                } else {
-                    if (!pipe_val.is_pipe_handle()) {
-                        throw std::runtime_error("Expected a pipe handle for SELECT_RECV");
-                    }
+            if (!pipe_val.is_pipe_handle()) {
+                throw std::runtime_error("Expected a pipe handle for SELECT_SEND");
+            }
 
-                    auto pipe_handle = pipe_val.as_pipe_handle();
+            auto pipe_handle = pipe_val.as_pipe_handle();
 
-                    auto pipe = scheduler.get_pipe_by_id(pipe_handle.ID);
-                    if (!pipe) {
-                        throw std::runtime_error("Invalid pipe ID in SELECT_RECV");
-                    }
+            auto pipe = pipe_handle.pipe_ptr;
+            if (!pipe) {
+                throw std::runtime_error("Invalid pipe ID in SELECT_SEND");
+            }
 
-                    scheduler.select_add_recv_case(current_thread, pipe, curr.ip + jump_offset - 1, slot);
+            scheduler.select_add_send_case(current_thread, pipe, curr.ip + jump_offset, val);
+            break;
+        }
+        case OP_SELECT_DEFAULT: {
+            uint16_t jump_offset = read_short(curr);
+            scheduler.select_add_default_case(current_thread, curr.ip + jump_offset);
+            break;
+        }
+        case OP_SELECT_EXEC: {
+            scheduler.select_execute(current_thread, curr.ip);
+            break;
+        }
+        case OP_NOT:
+        case OP_NEG:
+        case OP_BIT_NOT: {
+            unary_op(op);
+            break;
+        }
+        case OP_JUMP: {
+            int off = static_cast<int16_t>(read_short(curr));
+            curr.ip += off;
+            if (off < 0) current_thread->tick(); // loop back edge
+            break;
+        }
+        case OP_JUMP_IF_FALSE: {
+            int off = static_cast<int16_t>(read_short(curr));
+            Value cond = peek(0);
+            if (!cond.is_truthy()) {
+                curr.ip += off;
+            }
+            break;
+        }
+        case OP_JUMP_IF_TRUE: {
+            int off = static_cast<int16_t>(read_short(curr));
+            Value cond = peek(0);
+            if (cond.is_truthy()) {
+                curr.ip += off;
+            }
+            break;
+        }
+        case OP_FOR_PREP: {
+            uint8_t slot = read_byte(curr);
+            OpCode cmp = static_cast<OpCode>(read_byte(curr));
+            uint16_t off = read_short(curr);
+
+            // counter, limit and step live in consecutive local slots
+            Value *vars = &current_thread->stack[curr.base + slot];
+            if (!loop_condition(cmp, vars[0], vars[1])) {
+                curr.ip += off;
+            }
+            break;
+        }
+        case OP_FOR_LOOP: {
+            uint8_t slot = read_byte(curr);
+            OpCode cmp = static_cast<OpCode>(read_byte(curr));
+            int off = static_cast<int16_t>(read_short(curr));
+
+            Value *vars = &current_thread->stack[curr.base + slot];
+            int *counter = std::any_cast<int>(&vars[0].data);
+            const int *limit = std::any_cast<int>(&vars[1].data);
+            const int *step = std::any_cast<int>(&vars[2].data);
+
+            if (counter && limit && step) {
+                // integer fast path: bump the counter in place
+                *counter += *step;
+                bool again = (cmp == OP_LT) ? *counter <  *limit :
+                             (cmp == OP_LE) ? *counter <= *limit :
+                             (cmp == OP_GT) ? *counter >  *limit :
+                                              *counter >= *limit;
+                if (again) {
+                    curr.ip += off;
+                    current_thread->tick();
                 }
-
-                if (slot != 0xFF) {
-                    std::cerr << "[Thread " << current_thread->ID << "] SELECT_RECV will store received value in stack slot "
-                              << static_cast<int>(slot) << " (stack size: " << current_thread->stack_size << ")\n";
-
-                    current_thread->stack_size = std::max(current_thread->stack_size, static_cast<size_t>(slot + 1));
-                    current_thread->stack[slot] = {};
+            } else {
+                vars[0] = vars[0] + vars[2];
+                if (loop_condition(cmp, vars[0], vars[1])) {
+                    curr.ip += off;
+                    current_thread->tick();
                 }
-                break;
             }
-            case OP_SELECT_SEND: {
-                uint16_t jump_offset = read_short(curr);
+            break;
+        }
+        case OP_GET_ITER: {
+            Value &iterable = peek(0);
+            if (iterable.is_object()) {
+                iterable.data = std::make_shared<ObjectIterator>(iterable.as_object());
+            } else if (!iterable.is_array() && !iterable.is_range() &&
+                       !iterable.is_string() && !iterable.is_pipe_handle()) {
+                throw std::runtime_error("Cannot iterate over value of type " + iterable.type_name());
+            }
 
-                Value val = pop();
-                Value pipe_val = pop();
+            push(0); // position
+            break;
+        }
+        case OP_ITER_NEXT: {
+            uint8_t slot = read_byte(curr);
+            uint16_t off = read_short(curr);
 
-                // select case is disabled
-                if (pipe_val.is_null()) {
-                    scheduler.select_add_send_case(current_thread, nullptr, curr.ip + jump_offset, val);
+            // iterable, position and loop variable live in consecutive local slots
+            Value *vars = &current_thread->stack[curr.base + slot];
+            int &pos = *std::any_cast<int>(&vars[1].data);
+
+            if (auto arr = std::any_cast<Array::Ptr>(&vars[0].data)) {
+                if (static_cast<size_t>(pos) >= (*arr)->size()) {
+                    curr.ip += off;
+                    break;
+                }
+                vars[2] = (**arr)[pos++];
+            } else if (auto range = std::any_cast<Range::Ptr>(&vars[0].data)) {
+                if (static_cast<size_t>(pos) >= (*range)->size()) {
+                    curr.ip += off;
+                    break;
+                }
+                vars[2] = (*range)->at(pos++);
+            } else if (auto str = std::any_cast<std::string>(&vars[0].data)) {
+                if (static_cast<size_t>(pos) >= str->size()) {
+                    curr.ip += off;
                     break;
                 }
+                vars[2] = std::string(1, (*str)[pos++]);
+            } else if (auto cursor = std::any_cast<ObjectIterator::Ptr>(&vars[0].data)) {
+                ObjectIterator &iter = **cursor;
+                if (iter.bucket_count != iter.object->items.bucket_count()) {
+                    throw std::runtime_error("Object was resized during iteration");
+                }
 
-                if (!pipe_val.is_pipe_handle()) {
-                    throw std::runtime_error("Expected a pipe handle for SELECT_SEND");
+                if (pos > 0) ++iter.it;
+                if (iter.it == iter.object->end()) {
+                    curr.ip += off;
+                    break;
+                }
+                vars[2] = iter.it->second;
+                pos++;
+            } else {
+                auto pipe = vars[0].as_pipe_handle().pipe_ptr;
+                if (!pipe) {
+                    throw std::runtime_error("Invalid pipe ID in ITER_NEXT");
                 }
 
-                auto pipe_handle = pipe_val.as_pipe_handle();
+                if (auto received = scheduler.poll_pipe(current_thread->ID, pipe)) {
+                    vars[2] = *received;
+                    pos++;
+                    break;
+                }
 
-                auto pipe = scheduler.get_pipe_by_id(pipe_handle.ID);
-                if (!pipe) {
-                    throw std::runtime_error("Invalid pipe ID in SELECT_SEND");
+                std::lock_guard<std::recursive_mutex> pipe_guard(scheduler.lock);
+                if (pipe->closed && pipe->buffer.empty() && pipe->writers.empty()) {
+                    curr.ip += off;
+                    break;
                 }
 
-                scheduler.select_add_send_case(current_thread, pipe, curr.ip + jump_offset, val);
-                break;
-            }
-            case OP_SELECT_DEFAULT: {
-                uint16_t jump_offset = read_short(curr);
-                scheduler.select_add_default_case(current_thread, curr.ip + jump_offset);
-                break;
-            }
-            case OP_SELECT_EXEC: {
-                scheduler.select_execute(current_thread, curr.ip);
-                break;
+                // wait like a select and retry this instruction when woken
+                pipe->add_watcher(current_thread);
+                current_thread->state = GreenThread::Blocked;
+                curr.ip -= 4;
+
+                // a lock-free send may have landed before the registration
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (pipe->can_receive()) scheduler.wake(current_thread);
             }
-            case OP_NOT:
-            case OP_NEG:
-            case OP_BIT_NOT: {
-                unary_op(op);
-                break;
+            break;
+        }
+        case OP_LOAD_ITER_INDEX: {
+            uint8_t slot = read_byte(curr);
+            Value *vars = &current_thread->stack[curr.base + slot];
+
+            if (auto cursor = std::any_cast<ObjectIterator::Ptr>(&vars[0].data)) {
+                vars[3] = (*cursor)->it->first;
+            } else {
+                vars[3] = vars[1].as_int() - 1;
             }
-            case OP_JUMP: {
-                int off = static_cast<int16_t>(read_short(curr));
-                curr.ip += off;
-                break;
+            break;
+        }
+        case OP_CALL: {
+            uint8_t arg_count = read_byte(curr);
+            Value callee = peek(arg_count);
+            call_value(callee, arg_count);
+            break;
+        }
+        case OP_MAKE_ARRAY: {
+            uint16_t count = read_short(curr);
+            std::vector<Value> elements;
+            for (uint16_t i = 0; i < count; ++i) {
+                elements.push_back(pop());
             }
-            case OP_JUMP_IF_FALSE: {
-                int off = static_cast<int16_t>(read_short(curr));
-                Value cond = peek(0);
-                if (!cond.is_truthy()) {
-                    curr.ip += off;
-                }
-                break;
+            std::reverse(elements.begin(), elements.end());
+            push(std::make_shared<Array>(elements));
+            break;
+        }
+        case OP_MAKE_OBJECT: {
+            uint16_t count = read_short(curr);
+            std::unordered_map<std::string, Value> map;
+            for (uint16_t i = 0; i < count; ++i) {
+                Value key = pop();
+                Value val = pop();
+                if (!key.is_string()) throw std::runtime_error("Object keys must be strings");
+                map[key.as_string()] = val;
             }
-            case OP_JUMP_IF_TRUE: {
-                int off = static_cast<int16_t>(read_short(curr));
-                Value cond = peek(0);
-                if (cond.is_truthy()) {
-                    curr.ip += off;
-                }
-                break;
+            push(std::make_shared<Object>(map));
+            break;
+        }
+        case OP_MAKE_OBJECT_FROM_TEMPLATE: {
+            uint16_t idx = read_short(curr);
+            const auto &keys = constants[idx].as_array()->elements;
+            size_t count = keys.size();
+            if (current_thread->stack_size < count) throw std::runtime_error("Stack underflow");
+
+            // the first object built from a template shapes the rest: copying it
+            // sizes the table once, and filling it never inserts
+            auto &shape = object_shapes[constants[idx].as_array().get()];
+            if (!shape.get()) {
+                std::unordered_map<std::string, Value> items;
+                items.reserve(count);
+                for (const auto &key : keys) items.emplace(key.as_string(), Value());
+                shape = std::make_shared<Object>(items);
             }
-            case OP_CALL: {
-                uint8_t arg_count = read_byte(curr);
-                Value callee = peek(arg_count);
-                call_value(callee, arg_count);
-                break;
+
+            auto obj = std::make_shared<Object>(*shape);
+            Value *values = &current_thread->stack[current_thread->stack_size - count];
+            for (size_t i = 0; i < count; ++i) {
+                obj->items.find(keys[i].as_string())->second = std::move(values[i]);
             }
-            case OP_MAKE_ARRAY: {
-                uint16_t count = read_short(curr);
-                std::vector<Value> elements;
-                for (uint16_t i = 0; i < count; ++i) {
-                    elements.push_back(pop());
-                }
-                std::reverse(elements.begin(), elements.end());
-                push(std::make_shared<Array>(elements));
-                break;
+
+            current_thread->stack_size -= count;
+            push(obj);
+            break;
+        }
+        case OP_STRUCT: {
+            uint16_t name_idx = read_short(curr);
+            const auto &name_val = constants[name_idx];
+            if (!name_val.is_string()) {
+                throw std::runtime_error("Expected string for STRUCT name");
             }
-            case OP_MAKE_OBJECT: {
-                uint16_t count = read_short(curr);
-                std::unordered_map<std::string, Value> map;
-                for (uint16_t i = 0; i < count; ++i) {
-                    Value key = pop();
-                    Value val = pop();
-                    if (!key.is_string()) throw std::runtime_error("Object keys must be strings");
-                    map[key.as_string()] = val;
-                }
-                push(std::make_shared<Object>(map));
-                break;
+
+            std::string struct_name = name_val.as_string();
+            auto strct = std::make_shared<Struct>(struct_name);
+            push(strct);
+            break;
+        }
+        case OP_METHOD: {
+            uint16_t name_idx = read_short(curr);
+            const auto &name_val = constants[name_idx];
+            if (!name_val.is_string()) {
+                throw std::runtime_error("Expected string for METHOD name");
             }
-            case OP_STRUCT: {
-                uint16_t name_idx = read_short(curr);
-                auto name_val = chunk.constants[name_idx];
-                if (!name_val.is_string()) {
-                    throw std::runtime_error("Expected string for STRUCT name");
-                }
 
-                std::string struct_name = name_val.as_string();
-                auto strct = std::make_shared<Struct>(struct_name);
-                push(strct);
-                break;
+            std::string method_name = name_val.as_string();
+            Value method_func = pop();
+            Value struct_val = peek(0);
+            if (!struct_val.is_struct()) {
+                throw std::runtime_error("METHOD must be defined on a STRUCT");
             }
-            case OP_METHOD: {
-                uint16_t name_idx = read_short(curr);
-                auto name_val = chunk.constants[name_idx];
-                if (!name_val.is_string()) {
-                    throw std::runtime_error("Expected string for METHOD name");
-                }
 
-                std::string method_name = name_val.as_string();
-                Value method_func = pop();
-                Value struct_val = peek(0);
-                if (!struct_val.is_struct()) {
-                    throw std::runtime_error("METHOD must be defined on a STRUCT");
-                }
+            auto strct = struct_val.as_struct();
+            strct->add_method(method_name, method_func);
+            break;
+        }
+        case OP_FIELD: {
+            uint16_t name_idx = read_short(curr);
+            const auto &name_val = constants[name_idx];
+            if (!name_val.is_string()) {
+                throw std::runtime_error("Expected string for FIELD name");
+            }
 
-                auto strct = struct_val.as_struct();
-                strct->add_method(method_name, method_func);
-                break;
+            Value struct_val = peek(0);
+            if (!struct_val.is_struct()) {
+                throw std::runtime_error("FIELD must be defined on a STRUCT");
             }
-            case OP_SPAWN: {
-                auto thread_count_val = pop();
-                if (!thread_count_val.is_int()) {
-                    throw std::runtime_error("Expected integer for SPAWN thread count");
-                }
 
-                size_t thread_count = static_cast<size_t>(thread_count_val.as_int());
-                Value closure_val = pop();
-                if (!closure_val.is_closure()) {
-                    throw std::runtime_error("Expected closure for SPAWN");
-                }
+            struct_val.as_struct()->add_field(name_val.as_string());
+            break;
+        }
+        case OP_SPAWN: {
+            auto thread_count_val = pop();
+            if (!thread_count_val.is_int()) {
+                throw std::runtime_error("Expected integer for SPAWN thread count");
+            }
 
-                auto closure = closure_val.as_closure();
-                spawn_thread(closure, thread_count);
-                break;
+            size_t thread_count = static_cast<size_t>(thread_count_val.as_int());
+            Value closure_val = pop();
+            if (!closure_val.is_closure()) {
+                throw std::runtime_error("Expected closure for SPAWN");
             }
-            default:
-                throw std::runtime_error("Unknown opcode " + std::to_string((int)op));
+
+            auto closure = closure_val.as_closure();
+            spawn_thread(closure, thread_count);
+            break;
         }
+        default:
+            throw std::runtime_error("Unknown opcode " + std::to_string((int)op));
+    }
 
-        if (current_thread->state != GreenThread::Running) return;
+}
+
+// One helper per opcode: the switch in execute() folds down to a single case
+template <OpCode OP>
+static int jit_op(VM *vm, uint32_t pc, uint32_t next) {
+    GreenThread &thread = *vm->current_thread;
+    CallFrame &curr = thread.frames.back();
+    size_t depth = thread.frames.size();
+
+    curr.ip = static_cast<int>(pc) + 1;
+    try {
+        vm->execute(OP, curr);
+    } catch (...) {
+        vm->jit_error = std::current_exception();
+        return jit::EXIT;
     }
+
+    if (thread.state != GreenThread::Running || thread.frames.size() != depth) return jit::EXIT;
+    return (curr.ip == static_cast<int>(next)) ? jit::NEXT : jit::BRANCH;
+}
+
+template <size_t... I>
+static std::array<jit::Helper, OP_COUNT> make_jit_helpers(std::index_sequence<I...>) {
+    return { &jit_op<static_cast<OpCode>(I)>... };
+}
+
+const jit::Helper *VM::jit_helpers() {
+    static const auto helpers = make_jit_helpers(std::make_index_sequence<OP_COUNT>{});
+    return helpers.data();
 }
 
 inline void VM::unary_op(OpCode op) {
@@ -765,4 +1225,15 @@ inline void VM::binary_op(OpCode op) {
         case OP_SHIFT_LEFT:  push(a << b); break;
         case OP_SHIFT_RIGHT: push(a >> b); break;
     }
-}
\ No newline at end of file
+}
+
+inline bool VM::loop_condition(OpCode cmp, const Value &counter, const Value &limit) {
+    switch (cmp) {
+        case OP_LT: return counter < limit;
+        case OP_LE: return counter <= limit;
+        case OP_GT: return counter > limit;
+        case OP_GE: return counter >= limit;
+        default:
+            throw std::runtime_error("Invalid loop comparison");
+    }
+}